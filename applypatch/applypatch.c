@@ -30,7 +30,8 @@
 #include "mtdutils/mtdutils.h"
 #include "edify/expr.h"
 
-static int LoadPartitionContents(const char* filename, FileContents* file);
+static int LoadPartitionContents(const char* filename, FileContents* file,
+                                 int keep_data);
 static ssize_t FileSink(unsigned char* data, ssize_t len, void* token);
 static int GenerateTarget(FileContents* source_file,
                           const Value* source_patch_value,
@@ -58,7 +59,7 @@ int LoadFileContents(const char* filename, FileContents* file,
     // load the contents of a partition.
     if (strncmp(filename, "MTD:", 4) == 0 ||
         strncmp(filename, "EMMC:", 5) == 0) {
-        return LoadPartitionContents(filename, file);
+        return LoadPartitionContents(filename, file, 1);
     }
 
     if (stat(filename, &file->st) != 0) {
@@ -135,22 +136,40 @@ static int compare_size_indices(const void* a, const void* b) {
 // "end-of-file" marker), so the caller must specify the possible
 // lengths and the hash of the data, and we'll do the load expecting
 // to find one of those hashes.
+//
+// The partition is read through a fixed-size window while a rolling
+// SHA-1 is kept.  If keep_data is nonzero the data read so far is
+// accumulated in file->data, which only ever grows to the size being
+// tested (not the largest candidate).  If keep_data is zero only the
+// digest is computed, file->data is left NULL, and memory use is
+// bounded by the window no matter how large the partition is.
 enum PartitionType { MTD, EMMC };
 
-static int LoadPartitionContents(const char* filename, FileContents* file) {
+#define PARTITION_READ_WINDOW (256 * 1024)
+
+static int LoadPartitionContents(const char* filename, FileContents* file,
+                                 int keep_data) {
+    int* index = NULL;
+    size_t* size = NULL;
+    char** sha1sum = NULL;
+    MtdReadContext* ctx = NULL;
+    FILE* dev = NULL;
+    char* window = NULL;
+    file->data = NULL;
+
     char* copy = strdup(filename);
     const char* magic = strtok(copy, ":");
 
     enum PartitionType type;
 
-    if (strcmp(magic, "MTD") == 0) {
+    if (magic != NULL && strcmp(magic, "MTD") == 0) {
         type = MTD;
-    } else if (strcmp(magic, "EMMC") == 0) {
+    } else if (magic != NULL && strcmp(magic, "EMMC") == 0) {
         type = EMMC;
     } else {
         printf("LoadPartitionContents called with bad filename (%s)\n",
                filename);
-        return -1;
+        goto fail;
     }
     const char* partition = strtok(NULL, ":");
 
@@ -164,19 +183,24 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
     if (colons < 3 || colons%2 == 0) {
         printf("LoadPartitionContents called with bad filename (%s)\n",
                filename);
+        goto fail;
     }
 
     int pairs = (colons-1)/2;     // # of (size,sha1) pairs in filename
-    int* index = malloc(pairs * sizeof(int));
-    size_t* size = malloc(pairs * sizeof(size_t));
-    char** sha1sum = malloc(pairs * sizeof(char*));
+    index = malloc(pairs * sizeof(int));
+    size = malloc(pairs * sizeof(size_t));
+    sha1sum = malloc(pairs * sizeof(char*));
+    if (index == NULL || size == NULL || sha1sum == NULL) {
+        printf("failed to alloc size/sha1 lists for \"%s\"\n", filename);
+        goto fail;
+    }
 
     for (i = 0; i < pairs; ++i) {
         const char* size_str = strtok(NULL, ":");
-        size[i] = strtol(size_str, NULL, 10);
+        size[i] = size_str ? strtol(size_str, NULL, 10) : 0;
         if (size[i] == 0) {
             printf("LoadPartitionContents called with bad size (%s)\n", filename);
-            return -1;
+            goto fail;
         }
         sha1sum[i] = strtok(NULL, ":");
         index[i] = i;
@@ -187,9 +211,6 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
     size_array = size;
     qsort(index, pairs, sizeof(int), compare_size_indices);
 
-    MtdReadContext* ctx = NULL;
-    FILE* dev = NULL;
-
     switch (type) {
         case MTD:
             if (!mtd_partitions_scanned) {
@@ -201,14 +222,14 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
             if (mtd == NULL) {
                 printf("mtd partition \"%s\" not found (loading %s)\n",
                        partition, filename);
-                return -1;
+                goto fail;
             }
 
             ctx = mtd_read_partition(mtd);
             if (ctx == NULL) {
                 printf("failed to initialize read of mtd partition \"%s\"\n",
                        partition);
-                return -1;
+                goto fail;
             }
             break;
 
@@ -217,7 +238,7 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
             if (dev == NULL) {
                 printf("failed to open emmc partition \"%s\": %s\n",
                        partition, strerror(errno));
-                return -1;
+                goto fail;
             }
     }
 
@@ -225,18 +246,39 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
     SHA_init(&sha_ctx);
     uint8_t parsed_sha[SHA_DIGEST_SIZE];
 
-    // allocate enough memory to hold the largest size.
-    file->data = malloc(size[index[pairs-1]]);
-    char* p = (char*)file->data;
+    // With keep_data the window is the tail of file->data; otherwise it
+    // is a single reusable buffer.
+    size_t capacity = 0;
     file->size = 0;                // # bytes read so far
 
+    if (!keep_data) {
+        window = malloc(PARTITION_READ_WINDOW);
+        if (window == NULL) {
+            printf("failed to alloc read window for \"%s\"\n", partition);
+            goto fail;
+        }
+    }
+
     for (i = 0; i < pairs; ++i) {
         // Read enough additional bytes to get us up to the next size
         // (again, we're trying the possibilities in order of increasing
         // size).
-        size_t next = size[index[i]] - file->size;
-        size_t read = 0;
-        if (next > 0) {
+        if (keep_data && size[index[i]] > capacity) {
+            unsigned char* grown = realloc(file->data, size[index[i]]);
+            if (grown == NULL) {
+                printf("failed to alloc %d bytes for partition \"%s\"\n",
+                       size[index[i]], partition);
+                goto fail;
+            }
+            file->data = grown;
+            capacity = size[index[i]];
+        }
+
+        while ((size_t)file->size < size[index[i]]) {
+            size_t next = size[index[i]] - file->size;
+            if (next > PARTITION_READ_WINDOW) next = PARTITION_READ_WINDOW;
+            char* p = keep_data ? (char*)file->data + file->size : window;
+            size_t read = 0;
             switch (type) {
                 case MTD:
                     read = mtd_read_data(ctx, p, next);
@@ -249,9 +291,7 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
             if (next != read) {
                 printf("short read (%d bytes of %d) for partition \"%s\"\n",
                        read, next, partition);
-                free(file->data);
-                file->data = NULL;
-                return -1;
+                goto fail;
             }
             SHA_update(&sha_ctx, p, read);
             file->size += read;
@@ -266,9 +306,7 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
         if (ParseSha1(sha1sum[index[i]], parsed_sha) != 0) {
             printf("failed to parse sha1 %s in %s\n",
                    sha1sum[index[i]], filename);
-            free(file->data);
-            file->data = NULL;
-            return -1;
+            goto fail;
         }
 
         if (memcmp(sha_so_far, parsed_sha, SHA_DIGEST_SIZE) == 0) {
@@ -278,31 +316,20 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
                    size[index[i]], sha1sum[index[i]]);
             break;
         }
-
-        p += read;
     }
 
-    switch (type) {
-        case MTD:
-            mtd_read_close(ctx);
-            break;
-
-        case EMMC:
-            fclose(dev);
-            break;
-    }
-
-
     if (i == pairs) {
         // Ran off the end of the list of (size,sha1) pairs without
         // finding a match.
         printf("contents of partition \"%s\" didn't match %s\n",
                partition, filename);
-        free(file->data);
-        file->data = NULL;
-        return -1;
+        goto fail;
     }
 
+    if (ctx != NULL) mtd_read_close(ctx);
+    if (dev != NULL) fclose(dev);
+    free(window);
+
     const uint8_t* sha_final = SHA_final(&sha_ctx);
     for (i = 0; i < SHA_DIGEST_SIZE; ++i) {
         file->sha1[i] = sha_final[i];
@@ -319,6 +346,37 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
     free(sha1sum);
 
     return 0;
+
+  fail:
+    if (ctx != NULL) mtd_read_close(ctx);
+    if (dev != NULL) fclose(dev);
+    free(window);
+    free(file->data);
+    file->data = NULL;
+    free(copy);
+    free(index);
+    free(size);
+    free(sha1sum);
+    return -1;
+}
+
+// Compute the sha1 (and stat info) of a file or partition without
+// keeping its contents; file->data is NULL on return.  Partitions are
+// hashed through a fixed-size window, so this is safe to use on
+// images much larger than available RAM.  Return 0 on success.
+int LoadFileSha1(const char* filename, FileContents* file,
+                 int retouch_flag) {
+    if (strncmp(filename, "MTD:", 4) == 0 ||
+        strncmp(filename, "EMMC:", 5) == 0) {
+        return LoadPartitionContents(filename, file, 0);
+    }
+
+    if (LoadFileContents(filename, file, retouch_flag) != 0) {
+        return -1;
+    }
+    free(file->data);
+    file->data = NULL;
+    return 0;
 }
 
 
@@ -355,110 +413,140 @@ int SaveFileContents(const char* filename, const FileContents* file) {
     return 0;
 }
 
-// Write a memory buffer to 'target' partition, a string of the form
-// "MTD:<partition>[:...]" or "EMMC:<partition_device>:".  Return 0 on
-// success.
-int WriteToPartition(unsigned char* data, size_t len,
-                        const char* target) {
-    char* copy = strdup(target);
-    const char* magic = strtok(copy, ":");
-
+// Streams patched data into a partition as it is produced, so the
+// target never has to fit in memory.  'target' is a string of the form
+// "MTD:<partition>[:...]" or "EMMC:<partition_device>:".
+typedef struct {
     enum PartitionType type;
-    if (strcmp(magic, "MTD") == 0) {
-        type = MTD;
-    } else if (strcmp(magic, "EMMC") == 0) {
-        type = EMMC;
+    char* copy;                 // strtok()'d target; partition points into it
+    const char* partition;
+    MtdWriteContext* mtd;
+    int fd;
+    size_t written;
+    size_t next_sync;
+} PartitionWriter;
+
+static int OpenPartitionWriter(PartitionWriter* pw, const char* target) {
+    pw->copy = strdup(target);
+    pw->mtd = NULL;
+    pw->fd = -1;
+    pw->written = 0;
+    pw->next_sync = 1<<20;
+
+    const char* magic = strtok(pw->copy, ":");
+    if (magic != NULL && strcmp(magic, "MTD") == 0) {
+        pw->type = MTD;
+    } else if (magic != NULL && strcmp(magic, "EMMC") == 0) {
+        pw->type = EMMC;
     } else {
-        printf("WriteToPartition called with bad target (%s)\n", target);
-        return -1;
+        printf("OpenPartitionWriter called with bad target (%s)\n", target);
+        goto fail;
     }
-    const char* partition = strtok(NULL, ":");
-
-    if (partition == NULL) {
+    pw->partition = strtok(NULL, ":");
+    if (pw->partition == NULL) {
         printf("bad partition target name \"%s\"\n", target);
-        return -1;
+        goto fail;
     }
 
-    switch (type) {
+    switch (pw->type) {
         case MTD:
             if (!mtd_partitions_scanned) {
                 mtd_scan_partitions();
                 mtd_partitions_scanned = 1;
             }
 
-            const MtdPartition* mtd = mtd_find_partition_by_name(partition);
+            const MtdPartition* mtd = mtd_find_partition_by_name(pw->partition);
             if (mtd == NULL) {
                 printf("mtd partition \"%s\" not found for writing\n",
-                       partition);
-                return -1;
+                       pw->partition);
+                goto fail;
             }
 
-            MtdWriteContext* ctx = mtd_write_partition(mtd);
-            if (ctx == NULL) {
+            pw->mtd = mtd_write_partition(mtd);
+            if (pw->mtd == NULL) {
                 printf("failed to init mtd partition \"%s\" for writing\n",
-                       partition);
-                return -1;
+                       pw->partition);
+                goto fail;
             }
+            break;
 
-            size_t written = mtd_write_data(ctx, (char*)data, len);
-            if (written != len) {
-                printf("only wrote %d of %d bytes to MTD %s\n",
-                       written, len, partition);
-                mtd_write_close(ctx);
-                return -1;
+        case EMMC:
+            pw->fd = open(pw->partition, O_RDWR);
+            if (pw->fd < 0) {
+                printf("failed to open %s: %s\n", pw->partition, strerror(errno));
+                goto fail;
             }
+            break;
+    }
+    return 0;
 
-            if (mtd_erase_blocks(ctx, -1) < 0) {
-                printf("error finishing mtd write of %s\n", partition);
-                mtd_write_close(ctx);
-                return -1;
-            }
+  fail:
+    free(pw->copy);
+    pw->copy = NULL;
+    return -1;
+}
+
+static ssize_t PartitionSink(unsigned char* data, ssize_t len, void* token) {
+    PartitionWriter* pw = (PartitionWriter*)token;
+    ssize_t done = 0;
 
-            if (mtd_write_close(ctx)) {
-                printf("error closing mtd write of %s\n", partition);
-                return -1;
+    switch (pw->type) {
+        case MTD:
+            done = mtd_write_data(pw->mtd, (char*)data, len);
+            if (done != len) {
+                printf("only wrote %ld of %ld bytes to MTD %s\n",
+                       (long)done, (long)len, pw->partition);
             }
             break;
 
         case EMMC:
-        {
-            size_t start = 0;
-            int success = 0;
-            int fd = open(partition, O_RDWR);
-            if (fd < 0) {
-                printf("failed to open %s: %s\n", partition, strerror(errno));
-                return -1;
-            }
-            int attempt;
-
-            for (attempt = 0; attempt < 10; ++attempt) {
-                size_t next_sync = start + (1<<20);
-                printf("raw write %s attempt %d start at %d\n", partition, attempt+1, start);
-                lseek(fd, start, SEEK_SET);
-                while (start < len) {
-                    size_t to_write = len - start;
-                    if (to_write > 4096) to_write = 4096;
-
-                    ssize_t written = write(fd, data+start, to_write);
-                    if (written < 0) {
-                        if (errno == EINTR) {
-                            written = 0;
-                        } else {
-                            printf("failed write writing to %s (%s)\n",
-                                   partition, strerror(errno));
-                            return -1;
-                        }
-                    }
-                    start += written;
-                    if (start >= next_sync) {
-                        fsync(fd);
-                        next_sync = start + (1<<20);
-                    }
+            while (done < len) {
+                ssize_t written = write(pw->fd, data+done, len-done);
+                if (written < 0) {
+                    if (errno == EINTR) continue;
+                    printf("failed write writing to %s (%s)\n",
+                           pw->partition, strerror(errno));
+                    break;
                 }
-                fsync(fd);
+                done += written;
+            }
+            break;
+    }
+
+    pw->written += done;
+    if (pw->type == EMMC && pw->written >= pw->next_sync) {
+        fsync(pw->fd);
+        pw->next_sync = pw->written + (1<<20);
+    }
+    return done;
+}
+
+// Finish writing the partition.  If 'sha1' is non-NULL, check the data
+// that actually landed on it: MTD writes are already verified block by
+// block by mtd_write_data(); eMMC is read back (past the page cache)
+// and hashed.  Return 0 on success.  With a NULL 'sha1' the write is
+// being abandoned, and this only releases the writer.
+static int ClosePartitionWriter(PartitionWriter* pw, const uint8_t* sha1) {
+    int result = 0;
+
+    switch (pw->type) {
+        case MTD:
+            if (sha1 != NULL && mtd_erase_blocks(pw->mtd, -1) < 0) {
+                printf("error finishing mtd write of %s\n", pw->partition);
+                result = -1;
+            }
+            if (mtd_write_close(pw->mtd)) {
+                printf("error closing mtd write of %s\n", pw->partition);
+                result = -1;
+            }
+            break;
 
-                // drop caches so our subsequent verification read
-                // won't just be reading the cache.
+        case EMMC:
+            if (sha1 != NULL) {
+                fsync(pw->fd);
+
+                // drop caches so our verification read won't just be
+                // reading the cache.
                 sync();
                 int dc = open("/proc/sys/vm/drop_caches", O_WRONLY);
                 write(dc, "3\n", 2);
@@ -466,70 +554,49 @@ int WriteToPartition(unsigned char* data, size_t len,
                 sleep(1);
                 printf("  caches dropped\n");
 
-                // verify
-                lseek(fd, 0, SEEK_SET);
+                SHA_CTX sha_ctx;
+                SHA_init(&sha_ctx);
                 unsigned char buffer[4096];
-                start = len;
-                size_t p;
-                for (p = 0; p < len; p += sizeof(buffer)) {
-                    size_t to_read = len - p;
+                size_t p = 0;
+                lseek(pw->fd, 0, SEEK_SET);
+                while (p < pw->written) {
+                    size_t to_read = pw->written - p;
                     if (to_read > sizeof(buffer)) to_read = sizeof(buffer);
-
-                    size_t so_far = 0;
-                    while (so_far < to_read) {
-                        ssize_t read_count = read(fd, buffer+so_far, to_read-so_far);
-                        if (read_count < 0) {
-                            if (errno == EINTR) {
-                                read_count = 0;
-                            } else {
-                                printf("verify read error %s at %d: %s\n",
-                                       partition, p, strerror(errno));
-                                return -1;
-                            }
-                        }
-                        if ((size_t)read_count < to_read) {
-                            printf("short verify read %s at %d: %d %d %s\n",
-                                   partition, p, read_count, to_read, strerror(errno));
-                        }
-                        so_far += read_count;
-                    }
-
-                    if (memcmp(buffer, data+p, to_read)) {
-                        printf("verification failed starting at %d\n", p);
-                        start = p;
+                    ssize_t read_count = read(pw->fd, buffer, to_read);
+                    if (read_count < 0 && errno == EINTR) continue;
+                    if (read_count <= 0) {
+                        printf("verify read error %s at %ld: %s\n",
+                               pw->partition, (long)p, strerror(errno));
+                        result = -1;
                         break;
                     }
+                    SHA_update(&sha_ctx, buffer, read_count);
+                    p += read_count;
                 }
-
-                if (start == len) {
-                    printf("verification read succeeded (attempt %d)\n", attempt+1);
-                    success = true;
-                    break;
+                if (result == 0 &&
+                    memcmp(SHA_final(&sha_ctx), sha1, SHA_DIGEST_SIZE) != 0) {
+                    printf("verification of %s failed\n", pw->partition);
+                    result = -1;
                 }
-
-                sleep(2);
             }
 
-            if (!success) {
-                printf("failed to verify after all attempts\n");
-                return -1;
+            if (close(pw->fd) != 0) {
+                printf("error closing %s (%s)\n", pw->partition, strerror(errno));
+                result = -1;
             }
-
-            if (close(fd) != 0) {
-                printf("error closing %s (%s)\n", partition, strerror(errno));
-                return -1;
+            if (sha1 != NULL) {
+                // hack: sync and sleep after closing in hopes of getting
+                // the data actually onto flash.
+                printf("sleeping after close\n");
+                sync();
+                sleep(5);
             }
-            // hack: sync and sleep after closing in hopes of getting
-            // the data actually onto flash.
-            printf("sleeping after close\n");
-            sync();
-            sleep(5);
             break;
-        }
     }
 
-    free(copy);
-    return 0;
+    free(pw->copy);
+    pw->copy = NULL;
+    return result;
 }
 
 
@@ -588,10 +655,10 @@ int applypatch_check(const char* filename,
     file.data = NULL;
 
     // It's okay to specify no sha1s; the check will pass if the
-    // LoadFileContents is successful.  (Useful for reading
-    // partitions, where the filename encodes the sha1s; no need to
-    // check them twice.)
-    if (LoadFileContents(filename, &file, RETOUCH_DO_MASK) != 0 ||
+    // LoadFileSha1 is successful.  (Useful for reading partitions,
+    // where the filename encodes the sha1s; no need to check them
+    // twice.)
+    if (LoadFileSha1(filename, &file, RETOUCH_DO_MASK) != 0 ||
         (num_patches > 0 &&
          FindMatchingPatch(file.sha1, patch_sha1_str, num_patches) < 0)) {
         printf("file \"%s\" doesn't have any of expected "
@@ -606,7 +673,7 @@ int applypatch_check(const char* filename,
         // exists and matches the sha1 we're looking for, the check still
         // passes.
 
-        if (LoadFileContents(CACHE_TEMP_SOURCE, &file, RETOUCH_DO_MASK) != 0) {
+        if (LoadFileSha1(CACHE_TEMP_SOURCE, &file, RETOUCH_DO_MASK) != 0) {
             printf("failed to load cache file\n");
             return 1;
         }
@@ -642,22 +709,6 @@ ssize_t FileSink(unsigned char* data, ssize_t len, void* token) {
     return done;
 }
 
-typedef struct {
-    unsigned char* buffer;
-    ssize_t size;
-    ssize_t pos;
-} MemorySinkInfo;
-
-ssize_t MemorySink(unsigned char* data, ssize_t len, void* token) {
-    MemorySinkInfo* msi = (MemorySinkInfo*)token;
-    if (msi->size - msi->pos < len) {
-        return -1;
-    }
-    memcpy(msi->buffer + msi->pos, data, len);
-    msi->pos += len;
-    return len;
-}
-
 // Return the amount of free space (in bytes) on the filesystem
 // containing filename.  filename must exist.  Return -1 on error.
 size_t FreeSpaceForFile(const char* filename) {
@@ -801,6 +852,10 @@ int applypatch(const char* source_filename,
     return result;
 }
 
+// Times to try writing a partition target whose contents don't read
+// back correctly.
+#define PARTITION_WRITE_ATTEMPTS 3
+
 static int GenerateTarget(FileContents* source_file,
                           const Value* source_patch_value,
                           FileContents* copy_file,
@@ -813,7 +868,7 @@ static int GenerateTarget(FileContents* source_file,
     int retry = 1;
     SHA_CTX ctx;
     int output;
-    MemorySinkInfo msi;
+    PartitionWriter pw;
     FileContents* source_to_use;
     char* outname;
     int made_copy = 0;
@@ -837,24 +892,26 @@ static int GenerateTarget(FileContents* source_file,
 
         if (strncmp(target_filename, "MTD:", 4) == 0 ||
             strncmp(target_filename, "EMMC:", 5) == 0) {
-            // If the target is a partition, we're actually going to
-            // write the output to /tmp and then copy it to the
-            // partition.  statfs() always returns 0 blocks free for
-            // /tmp, so instead we'll just assume that /tmp has enough
-            // space to hold the file.
-
-            // We still write the original source to cache, in case
-            // the partition write is interrupted.
-            if (MakeFreeSpaceOnCache(source_file->size) < 0) {
-                printf("not enough free space on /cache\n");
-                return 1;
-            }
-            if (SaveFileContents(CACHE_TEMP_SOURCE, source_file) < 0) {
-                printf("failed to back up source file\n");
-                return 1;
+            // If the target is a partition, the output is streamed
+            // straight onto it as it's produced, so a failure part way
+            // through leaves the partition holding neither source nor
+            // target.  The original source is saved to cache first;
+            // applypatch_check() and a rerun of the patch fall back to
+            // that copy when the partition doesn't match.
+            if (!made_copy) {
+                if (MakeFreeSpaceOnCache(source_file->size) < 0) {
+                    printf("not enough free space on /cache\n");
+                    return 1;
+                }
+                if (SaveFileContents(CACHE_TEMP_SOURCE, source_file) < 0) {
+                    printf("failed to back up source file\n");
+                    return 1;
+                }
+                made_copy = 1;
+                // the source is still in memory, so a write that
+                // doesn't verify can simply be redone.
+                retry = PARTITION_WRITE_ATTEMPTS - 1;
             }
-            made_copy = 1;
-            retry = 0;
         } else {
             int enough_space = 0;
             if (retry > 0) {
@@ -922,17 +979,11 @@ static int GenerateTarget(FileContents* source_file,
         outname = NULL;
         if (strncmp(target_filename, "MTD:", 4) == 0 ||
             strncmp(target_filename, "EMMC:", 5) == 0) {
-            // We store the decoded output in memory.
-            msi.buffer = malloc(target_size);
-            if (msi.buffer == NULL) {
-                printf("failed to alloc %ld bytes for output\n",
-                       (long)target_size);
+            if (OpenPartitionWriter(&pw, target_filename) != 0) {
                 return 1;
             }
-            msi.pos = 0;
-            msi.size = target_size;
-            sink = MemorySink;
-            token = &msi;
+            sink = PartitionSink;
+            token = &pw;
         } else {
             // We write the decoded output to "<tgt-file>.patch".
             outname = (char*)malloc(strlen(target_filename) + 10);
@@ -966,6 +1017,7 @@ static int GenerateTarget(FileContents* source_file,
                                      patch, sink, token, &ctx, bonus_data);
         } else {
             printf("Unknown patch file format\n");
+            if (outname == NULL) ClosePartitionWriter(&pw, NULL);
             return 1;
         }
 
@@ -974,6 +1026,25 @@ static int GenerateTarget(FileContents* source_file,
             close(output);
         }
 
+        if (outname == NULL) {
+            if (result == 0) {
+                // A wrong result won't get any better by retrying.
+                SHA_CTX temp_ctx;
+                memcpy(&temp_ctx, &ctx, sizeof(SHA_CTX));
+                if (memcmp(SHA_final(&temp_ctx), target_sha1,
+                           SHA_DIGEST_SIZE) != 0) {
+                    ClosePartitionWriter(&pw, NULL);
+                    printf("patch did not produce expected sha1; %s now holds "
+                           "bad data (source saved in %s)\n",
+                           target_filename, CACHE_TEMP_SOURCE);
+                    return 1;
+                }
+                result = ClosePartitionWriter(&pw, target_sha1);
+            } else {
+                ClosePartitionWriter(&pw, NULL);
+            }
+        }
+
         if (result != 0) {
             if (retry == 0) {
                 printf("applying patch failed\n");
@@ -996,14 +1067,7 @@ static int GenerateTarget(FileContents* source_file,
         return 1;
     }
 
-    if (output < 0) {
-        // Copy the temp file to the partition.
-        if (WriteToPartition(msi.buffer, msi.pos, target_filename) != 0) {
-            printf("write of patched data to %s failed\n", target_filename);
-            return 1;
-        }
-        free(msi.buffer);
-    } else {
+    if (outname != NULL) {
         // Give the .patch file the same owner, group, and mode of the
         // original source file.
         if (chmod(outname, source_to_use->st.st_mode) != 0) {
@@ -50,6 +50,7 @@
 #include <bzlib.h>
 #include <err.h>
 #include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -156,6 +157,188 @@ static void qsufsort(off_t *I,off_t *V,u_char *old,off_t oldsize)
 	for(i=0;i<oldsize+1;i++) I[V[i]]=i;
 }
 
+/*
+ * Linear-time suffix array construction (SA-IS; Nong, Zhang & Chan,
+ * "Two Efficient Algorithms for Linear Time Suffix Array Construction").
+ *
+ * At the top level the input is 'old' with a virtual sentinel appended,
+ * which sorts before every byte; the result has the same layout as
+ * qsufsort()'s: SA[0]==oldsize, followed by the suffixes of old in
+ * order.  Suffix arrays are unique, so bsdiff() output is unchanged.
+ * Deeper levels work on the int32 string of LMS-substring names.
+ */
+#define SAIS_TGET(t,i) (((t)[(i)>>3]>>((i)&7))&1)
+#define SAIS_TSET(t,i,b) ((b) ? ((t)[(i)>>3]|=1<<((i)&7)) : \
+		((t)[(i)>>3]&=~(1<<((i)&7))))
+#define SAIS_ISLMS(t,i) ((i)>0 && SAIS_TGET(t,i) && !SAIS_TGET(t,(i)-1))
+
+typedef struct {
+	const u_char *b;	/* top level: bytes, virtual sentinel at n-1 */
+	const int32_t *w;	/* deeper levels */
+	int32_t n;
+} sais_str;
+
+static inline int32_t sais_chr(const sais_str *s,int32_t i)
+{
+	if(s->w!=NULL) return s->w[i];
+	return (i==s->n-1) ? 0 : (int32_t)s->b[i]+1;
+}
+
+static void sais_buckets(const sais_str *s,int32_t *bkt,int32_t K,int end)
+{
+	int32_t i,sum=0;
+
+	for(i=0;i<=K;i++) bkt[i]=0;
+	for(i=0;i<s->n;i++) bkt[sais_chr(s,i)]++;
+	for(i=0;i<=K;i++) {
+		sum+=bkt[i];
+		bkt[i]=end ? sum : sum-bkt[i];
+	};
+}
+
+static void sais_induce(const sais_str *s,const u_char *t,int32_t *SA,
+		int32_t *bkt,int32_t K)
+{
+	int32_t i,j,n=s->n;
+
+	/* L-type suffixes, left to right from bucket heads */
+	sais_buckets(s,bkt,K,0);
+	for(i=0;i<n;i++) {
+		j=SA[i]-1;
+		if(j>=0 && !SAIS_TGET(t,j)) SA[bkt[sais_chr(s,j)]++]=j;
+	};
+
+	/* S-type suffixes, right to left from bucket tails */
+	sais_buckets(s,bkt,K,1);
+	for(i=n-1;i>=0;i--) {
+		j=SA[i]-1;
+		if(j>=0 && SAIS_TGET(t,j)) SA[--bkt[sais_chr(s,j)]]=j;
+	};
+}
+
+static int sais(const sais_str *s,int32_t *SA,int32_t K)
+{
+	int32_t i,j,d,n=s->n,n1,name,prev,pos;
+	int32_t *bkt,*s1;
+	u_char *t;
+	int diff;
+
+	if(n==1) { SA[0]=0; return 0; };
+	if((t=calloc(n/8+1,1))==NULL) return -1;
+	if((bkt=malloc((K+1)*sizeof(int32_t)))==NULL) { free(t); return -1; };
+
+	/* Classify suffixes: S-type=1, L-type=0.  The sentinel is S. */
+	SAIS_TSET(t,n-1,1);
+	if(n>1) SAIS_TSET(t,n-2,0);
+	for(i=n-3;i>=0;i--)
+		SAIS_TSET(t,i,(sais_chr(s,i)<sais_chr(s,i+1)) ||
+			(sais_chr(s,i)==sais_chr(s,i+1) && SAIS_TGET(t,i+1)));
+
+	/* Stage 1: sort the LMS-substrings */
+	sais_buckets(s,bkt,K,1);
+	for(i=0;i<n;i++) SA[i]=-1;
+	for(i=1;i<n;i++) if(SAIS_ISLMS(t,i)) SA[--bkt[sais_chr(s,i)]]=i;
+	sais_induce(s,t,SA,bkt,K);
+
+	/* Compact the sorted LMS-substrings into SA[0..n1) and name them */
+	n1=0;
+	for(i=0;i<n;i++) if(SAIS_ISLMS(t,SA[i])) SA[n1++]=SA[i];
+	for(i=n1;i<n;i++) SA[i]=-1;
+	name=0;prev=-1;
+	for(i=0;i<n1;i++) {
+		pos=SA[i];diff=0;
+		for(d=0;d<n;d++) {
+			if(prev==-1 || sais_chr(s,pos+d)!=sais_chr(s,prev+d) ||
+				SAIS_TGET(t,pos+d)!=SAIS_TGET(t,prev+d)) {
+				diff=1;
+				break;
+			} else if(d>0 && (SAIS_ISLMS(t,pos+d) || SAIS_ISLMS(t,prev+d)))
+				break;
+		};
+		if(diff) { name++; prev=pos; };
+		SA[n1+pos/2]=name-1;
+	};
+	for(i=n-1,j=n-1;i>=n1;i--) if(SA[i]>=0) SA[j--]=SA[i];
+
+	/* Stage 2: sort the reduced problem, recursing if names repeat */
+	s1=SA+n-n1;
+	if(name<n1) {
+		sais_str sub;
+		sub.b=NULL;sub.w=s1;sub.n=n1;
+		if(sais(&sub,SA,name-1)!=0) { free(bkt); free(t); return -1; };
+	} else {
+		for(i=0;i<n1;i++) SA[s1[i]]=i;
+	};
+
+	/* Stage 3: induce the full suffix array from the sorted LMS suffixes */
+	sais_buckets(s,bkt,K,1);
+	for(i=1,j=0;i<n;i++) if(SAIS_ISLMS(t,i)) s1[j++]=i;
+	for(i=0;i<n1;i++) SA[i]=s1[SA[i]];
+	for(i=n1;i<n;i++) SA[i]=-1;
+	for(i=n1-1;i>=0;i--) {
+		j=SA[i];SA[i]=-1;
+		SA[--bkt[sais_chr(s,j)]]=j;
+	};
+	sais_induce(s,t,SA,bkt,K);
+
+	free(bkt);
+	free(t);
+	return 0;
+}
+
+/*
+ * Suffix array of 'old', owned by the caller of bsdiff() so it can be
+ * reused across calls with the same source.  Inputs that fit in 31-bit
+ * indices use SA-IS (4 bytes per input byte); anything larger falls
+ * back to qsufsort() with off_t indices (16 bytes per input byte while
+ * sorting).
+ */
+typedef struct {
+	int32_t *I32;
+	off_t *I;
+} SuffixArray;
+
+#define SA_AT(sa,i) ((sa)->I32!=NULL ? (off_t)(sa)->I32[i] : (sa)->I[i])
+
+static SuffixArray *build_suffix_array(u_char *old,off_t oldsize)
+{
+	SuffixArray *sa;
+
+	if((sa=calloc(1,sizeof(SuffixArray)))==NULL) return NULL;
+
+	if(oldsize<INT32_MAX && getenv("BSDIFF_USE_QSUFSORT")==NULL) {
+		sais_str str;
+		str.b=old;str.w=NULL;str.n=oldsize+1;
+		if((sa->I32=malloc((oldsize+1)*sizeof(int32_t)))!=NULL &&
+			sais(&str,sa->I32,256)==0)
+			return sa;
+		free(sa->I32);
+		sa->I32=NULL;
+	};
+
+	off_t *V;
+	if(((sa->I=malloc((oldsize+1)*sizeof(off_t)))==NULL) ||
+		((V=malloc((oldsize+1)*sizeof(off_t)))==NULL)) {
+		free(sa->I);
+		free(sa);
+		return NULL;
+	};
+	qsufsort(sa->I,V,old,oldsize);
+	free(V);
+	return sa;
+}
+
+// Release a suffix array built by bsdiff().
+void bsdiff_free_suffix_array(void *p)
+{
+	SuffixArray *sa=(SuffixArray*)p;
+
+	if(sa==NULL) return;
+	free(sa->I32);
+	free(sa->I);
+	free(sa);
+}
+
 static off_t matchlen(u_char *old,off_t oldsize,u_char *new,off_t newsize)
 {
 	off_t i;
@@ -166,29 +349,29 @@ static off_t matchlen(u_char *old,off_t oldsize,u_char *new,off_t newsize)
 	return i;
 }
 
-static off_t search(off_t *I,u_char *old,off_t oldsize,
+static off_t search(const SuffixArray *sa,u_char *old,off_t oldsize,
 		u_char *new,off_t newsize,off_t st,off_t en,off_t *pos)
 {
 	off_t x,y;
 
 	if(en-st<2) {
-		x=matchlen(old+I[st],oldsize-I[st],new,newsize);
-		y=matchlen(old+I[en],oldsize-I[en],new,newsize);
+		x=matchlen(old+SA_AT(sa,st),oldsize-SA_AT(sa,st),new,newsize);
+		y=matchlen(old+SA_AT(sa,en),oldsize-SA_AT(sa,en),new,newsize);
 
 		if(x>y) {
-			*pos=I[st];
+			*pos=SA_AT(sa,st);
 			return x;
 		} else {
-			*pos=I[en];
+			*pos=SA_AT(sa,en);
 			return y;
 		}
 	};
 
 	x=st+(en-st)/2;
-	if(memcmp(old+I[x],new,MIN(oldsize-I[x],newsize))<0) {
-		return search(I,old,oldsize,new,newsize,x,en,pos);
+	if(memcmp(old+SA_AT(sa,x),new,MIN(oldsize-SA_AT(sa,x),newsize))<0) {
+		return search(sa,old,oldsize,new,newsize,x,en,pos);
 	} else {
-		return search(I,old,oldsize,new,newsize,st,x,pos);
+		return search(sa,old,oldsize,new,newsize,st,x,pos);
 	};
 }
 
@@ -216,16 +399,21 @@ static void offtout(off_t x,u_char *buf)
 //      data from files.  old and new are owned by the caller; we
 //      don't free them at the end.
 //
-//    - the "I" block of memory is owned by the caller, who passes a
-//      pointer to *I, which can be NULL.  This way if we call
-//      bsdiff() multiple times with the same 'old' data, we only do
-//      the qsufsort() step the first time.
+//    - the suffix array is owned by the caller, who passes a
+//      pointer to *IP, which can be NULL.  This way if we call
+//      bsdiff() multiple times with the same 'old' data, we only
+//      sort the suffixes the first time.  Free it with
+//      bsdiff_free_suffix_array().
 //
-int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
+//    - suffixes are sorted with SA-IS instead of qsufsort() when
+//      'old' is under 2GB (set BSDIFF_USE_QSUFSORT in the environment
+//      to force the old algorithm, e.g. for comparison).
+//
+int bsdiff(u_char* old, off_t oldsize, void** IP, u_char* new, off_t newsize,
            const char* patch_filename)
 {
 	int fd;
-	off_t *I;
+	SuffixArray *I;
 	off_t scan,pos,len;
 	off_t lastscan,lastpos,lastoffset;
 	off_t oldscore,scsc;
@@ -241,13 +429,10 @@ int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
 	int bz2err;
 
         if (*IP == NULL) {
-            off_t* V;
-            *IP = malloc((oldsize+1) * sizeof(off_t));
-            V = malloc((oldsize+1) * sizeof(off_t));
-            qsufsort(*IP, V, old, oldsize);
-            free(V);
+            if ((*IP = build_suffix_array(old, oldsize)) == NULL)
+                err(1, NULL);
         }
-        I = *IP;
+        I = (SuffixArray*)*IP;
 
 	if(((db=malloc(newsize+1))==NULL) ||
 		((eb=malloc(newsize+1))==NULL)) err(1,NULL);
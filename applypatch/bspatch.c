@@ -21,6 +21,7 @@
 // notice.
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include <unistd.h>
@@ -97,32 +98,68 @@ int FillBuffer(unsigned char* buffer, int size, bz_stream* stream) {
     return 0;
 }
 
-int ApplyBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
-                     const Value* patch, ssize_t patch_offset,
-                     SinkFn sink, void* token, SHA_CTX* ctx) {
-
-    unsigned char* new_data;
-    ssize_t new_size;
-    if (ApplyBSDiffPatchMem(old_data, old_size, patch, patch_offset,
-                            &new_data, &new_size) != 0) {
-        return -1;
-    }
-
-    if (sink(new_data, new_size, token) < new_size) {
+// Size of the output window used when streaming patched data to a
+// sink.  Peak memory for ApplyBSDiffPatch() is this plus the bzip2
+// decoder state, independent of the size of the target.
+#define BSPATCH_WINDOW (64 * 1024)
+
+typedef struct {
+    SinkFn sink;
+    void* token;
+    SHA_CTX* ctx;
+    unsigned char* data;
+    ssize_t size;
+    ssize_t used;
+} OutputWindow;
+
+static int FlushWindow(OutputWindow* w) {
+    if (w->used == 0) return 0;
+    if (w->sink(w->data, w->used, w->token) < w->used) {
         printf("short write of output: %d (%s)\n", errno, strerror(errno));
         return 1;
     }
-    if (ctx) {
-        SHA_update(ctx, new_data, new_size);
+    if (w->ctx) {
+        SHA_update(w->ctx, w->data, w->used);
     }
-    free(new_data);
+    w->used = 0;
+    return 0;
+}
 
+// Decompress 'len' bytes from 'stream' into the output window, adding
+// the corresponding old data if 'old_data' is non-NULL.  Bytes that
+// fall outside the old file are left as-is, as in stock bspatch.
+static int StreamToWindow(OutputWindow* w, off_t len, bz_stream* stream,
+                          const unsigned char* old_data, ssize_t old_size,
+                          off_t oldpos) {
+    while (len > 0) {
+        ssize_t n = w->size - w->used;
+        if (n > len) n = len;
+        unsigned char* out = w->data + w->used;
+        if (FillBuffer(out, n, stream) != 0) {
+            return 1;
+        }
+        if (old_data) {
+            ssize_t i;
+            for (i = 0; i < n; ++i) {
+                if ((oldpos+i >= 0) && (oldpos+i < old_size)) {
+                    out[i] += old_data[oldpos+i];
+                }
+            }
+            oldpos += n;
+        }
+        w->used += n;
+        len -= n;
+        if (w->used == w->size && FlushWindow(w) != 0) {
+            return 1;
+        }
+    }
     return 0;
 }
 
-int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
-                        const Value* patch, ssize_t patch_offset,
-                        unsigned char** new_data, ssize_t* new_size) {
+// Apply the bsdiff patch, handing the output to 'w' as it is produced.
+static int ApplyBSDiffPatchWindowed(const unsigned char* old_data, ssize_t old_size,
+                                    const Value* patch, ssize_t patch_offset,
+                                    OutputWindow* w) {
     // Patch data format:
     //   0       8       "BSDIFF40"
     //   8       8       X
@@ -135,93 +172,76 @@ int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
     // from oldfile to x bytes from the diff block; copy y bytes from the
     // extra block; seek forwards in oldfile by z bytes".
 
+    if (patch_offset < 0 || patch_offset + 32 > patch->size) {
+        printf("corrupt bsdiff patch file header (too short)\n");
+        return 1;
+    }
     unsigned char* header = (unsigned char*) patch->data + patch_offset;
     if (memcmp(header, "BSDIFF40", 8) != 0) {
         printf("corrupt bsdiff patch file header (magic number)\n");
         return 1;
     }
 
-    ssize_t ctrl_len, data_len;
+    ssize_t ctrl_len, data_len, new_size;
     ctrl_len = offtin(header+8);
     data_len = offtin(header+16);
-    *new_size = offtin(header+24);
+    new_size = offtin(header+24);
 
-    if (ctrl_len < 0 || data_len < 0 || *new_size < 0) {
+    if (ctrl_len < 0 || data_len < 0 || new_size < 0 ||
+        patch_offset + 32 + ctrl_len + data_len > patch->size) {
         printf("corrupt patch file header (data lengths)\n");
         return 1;
     }
 
+    int result = 1;
     int bzerr;
-
-    bz_stream cstream;
-    cstream.next_in = patch->data + patch_offset + 32;
-    cstream.avail_in = ctrl_len;
-    cstream.bzalloc = NULL;
-    cstream.bzfree = NULL;
-    cstream.opaque = NULL;
-    if ((bzerr = BZ2_bzDecompressInit(&cstream, 0, 0)) != BZ_OK) {
-        printf("failed to bzinit control stream (%d)\n", bzerr);
-    }
-
-    bz_stream dstream;
-    dstream.next_in = patch->data + patch_offset + 32 + ctrl_len;
-    dstream.avail_in = data_len;
-    dstream.bzalloc = NULL;
-    dstream.bzfree = NULL;
-    dstream.opaque = NULL;
-    if ((bzerr = BZ2_bzDecompressInit(&dstream, 0, 0)) != BZ_OK) {
-        printf("failed to bzinit diff stream (%d)\n", bzerr);
-    }
-
-    bz_stream estream;
-    estream.next_in = patch->data + patch_offset + 32 + ctrl_len + data_len;
-    estream.avail_in = patch->size - (patch_offset + 32 + ctrl_len + data_len);
-    estream.bzalloc = NULL;
-    estream.bzfree = NULL;
-    estream.opaque = NULL;
-    if ((bzerr = BZ2_bzDecompressInit(&estream, 0, 0)) != BZ_OK) {
-        printf("failed to bzinit extra stream (%d)\n", bzerr);
-    }
-
-    *new_data = malloc(*new_size);
-    if (*new_data == NULL) {
-        printf("failed to allocate %ld bytes of memory for output file\n",
-               (long)*new_size);
-        return 1;
+    int streams = 0;
+    bz_stream stream[3];
+    memset(stream, 0, sizeof(stream));
+    bz_stream* cstream = stream;
+    bz_stream* dstream = stream + 1;
+    bz_stream* estream = stream + 2;
+
+    cstream->next_in = patch->data + patch_offset + 32;
+    cstream->avail_in = ctrl_len;
+    dstream->next_in = patch->data + patch_offset + 32 + ctrl_len;
+    dstream->avail_in = data_len;
+    estream->next_in = patch->data + patch_offset + 32 + ctrl_len + data_len;
+    estream->avail_in = patch->size - (patch_offset + 32 + ctrl_len + data_len);
+
+    for (streams = 0; streams < 3; ++streams) {
+        if ((bzerr = BZ2_bzDecompressInit(stream + streams, 0, 0)) != BZ_OK) {
+            printf("failed to bzinit %s stream (%d)\n",
+                   streams == 0 ? "control" : streams == 1 ? "diff" : "extra",
+                   bzerr);
+            goto done;
+        }
     }
 
     off_t oldpos = 0, newpos = 0;
     off_t ctrl[3];
-    off_t len_read;
-    int i;
     unsigned char buf[24];
-    while (newpos < *new_size) {
+    while (newpos < new_size) {
         // Read control data
-        if (FillBuffer(buf, 24, &cstream) != 0) {
+        if (FillBuffer(buf, 24, cstream) != 0) {
             printf("error while reading control stream\n");
-            return 1;
+            goto done;
         }
         ctrl[0] = offtin(buf);
         ctrl[1] = offtin(buf+8);
         ctrl[2] = offtin(buf+16);
 
         // Sanity check
-        if (newpos + ctrl[0] > *new_size) {
+        if (ctrl[0] < 0 || ctrl[1] < 0 ||
+            newpos + ctrl[0] > new_size) {
             printf("corrupt patch (new file overrun)\n");
-            return 1;
+            goto done;
         }
 
-        // Read diff string
-        if (FillBuffer(*new_data + newpos, ctrl[0], &dstream) != 0) {
+        // Read diff string and add old data to it
+        if (StreamToWindow(w, ctrl[0], dstream, old_data, old_size, oldpos) != 0) {
             printf("error while reading diff stream\n");
-            return 1;
-        }
-
-        // Add old data to diff string
-        for (i = 0; i < ctrl[0]; ++i) {
-            if ((oldpos+i >= 0) && (oldpos+i < old_size)) {
-                (*new_data)[newpos+i] += old_data[oldpos+i];
-            }
+            goto done;
         }
 
         // Adjust pointers
@@ -229,15 +249,15 @@ int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
         oldpos += ctrl[0];
 
         // Sanity check
-        if (newpos + ctrl[1] > *new_size) {
+        if (newpos + ctrl[1] > new_size) {
             printf("corrupt patch (new file overrun)\n");
-            return 1;
+            goto done;
         }
 
         // Read extra string
-        if (FillBuffer(*new_data + newpos, ctrl[1], &estream) != 0) {
+        if (StreamToWindow(w, ctrl[1], estream, NULL, 0, 0) != 0) {
             printf("error while reading extra stream\n");
-            return 1;
+            goto done;
         }
 
         // Adjust pointers
@@ -245,8 +265,76 @@ int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
         oldpos += ctrl[2];
     }
 
-    BZ2_bzDecompressEnd(&cstream);
-    BZ2_bzDecompressEnd(&dstream);
-    BZ2_bzDecompressEnd(&estream);
+    result = FlushWindow(w);
+
+  done:
+    while (streams > 0) {
+        BZ2_bzDecompressEnd(stream + --streams);
+    }
+    return result;
+}
+
+int ApplyBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
+                     const Value* patch, ssize_t patch_offset,
+                     SinkFn sink, void* token, SHA_CTX* ctx) {
+    OutputWindow w;
+    w.sink = sink;
+    w.token = token;
+    w.ctx = ctx;
+    w.size = BSPATCH_WINDOW;
+    w.used = 0;
+    w.data = malloc(w.size);
+    if (w.data == NULL) {
+        printf("failed to allocate %ld bytes for output window\n",
+               (long)w.size);
+        return 1;
+    }
+
+    int result = ApplyBSDiffPatchWindowed(old_data, old_size,
+                                          patch, patch_offset, &w);
+    free(w.data);
+    return result;
+}
+
+static ssize_t NullSink(unsigned char* data, ssize_t len, void* token) {
+    return len;
+}
+
+int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
+                        const Value* patch, ssize_t patch_offset,
+                        unsigned char** new_data, ssize_t* new_size) {
+    if (patch_offset < 0 || patch_offset + 32 > patch->size) {
+        printf("corrupt bsdiff patch file header (too short)\n");
+        return 1;
+    }
+    *new_size = offtin((unsigned char*) patch->data + patch_offset + 24);
+    if (*new_size < 0) {
+        printf("corrupt patch file header (data lengths)\n");
+        return 1;
+    }
+
+    *new_data = malloc(*new_size > 0 ? *new_size : 1);
+    if (*new_data == NULL) {
+        printf("failed to allocate %ld bytes of memory for output file\n",
+               (long)*new_size);
+        return 1;
+    }
+
+    // The "window" is the whole output buffer, so it never needs to be
+    // flushed until the end, where the data is already in place.
+    OutputWindow w;
+    w.sink = NullSink;
+    w.token = NULL;
+    w.ctx = NULL;
+    w.data = *new_data;
+    w.size = *new_size > 0 ? *new_size : 1;
+    w.used = 0;
+
+    if (ApplyBSDiffPatchWindowed(old_data, old_size,
+                                 patch, patch_offset, &w) != 0) {
+        free(*new_data);
+        *new_data = NULL;
+        return 1;
+    }
     return 0;
 }
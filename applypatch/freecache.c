@@ -71,12 +71,26 @@ static int EliminateOpenFiles(char** files, int file_count) {
   return 0;
 }
 
-int FindExpendableFiles(char*** names, int* entries) {
+// What we know about /cache, gathered the first time space has to be
+// made and kept up to date for the rest of the process (one updater
+// run), so that staging thousands of patch sources doesn't rescan
+// /cache and every process's open fds each time.
+static struct {
+  int scanned;
+  char** names;         // deletable files, in deletion order
+  size_t* sizes;        // bytes each one occupies
+  int entries;
+  int next;             // first entry not yet deleted
+  size_t deletable;     // total of sizes[next..entries)
+} plan;
+
+static int FindExpendableFiles(char*** names, size_t** sizes, int* entries) {
   DIR* d;
   struct dirent* de;
   int size = 32;
   *entries = 0;
   *names = malloc(size * sizeof(char*));
+  *sizes = malloc(size * sizeof(size_t));
 
   char path[FILENAME_MAX];
 
@@ -108,7 +122,9 @@ int FindExpendableFiles(char*** names, int* entries) {
         if (*entries >= size) {
           size *= 2;
           *names = realloc(*names, size * sizeof(char*));
+          *sizes = realloc(*sizes, size * sizeof(size_t));
         }
+        (*sizes)[*entries] = st.st_blocks * 512;
         (*names)[(*entries)++] = strdup(path);
       }
     }
@@ -125,8 +141,39 @@ int FindExpendableFiles(char*** names, int* entries) {
   return 0;
 }
 
-int MakeFreeSpaceOnCache(size_t bytes_needed) {
+static int ScanCache() {
+  if (plan.scanned) return 0;
+
+  if (FindExpendableFiles(&plan.names, &plan.sizes, &plan.entries) < 0) {
+    return -1;
+  }
+  plan.scanned = 1;
+  plan.next = 0;
+  plan.deletable = 0;
+
+  int i;
+  for (i = 0; i < plan.entries; ++i) {
+    if (plan.names[i]) plan.deletable += plan.sizes[i];
+  }
+  return 0;
+}
+
+// Space on /cache we can count on for staging a source file: what's
+// free now plus what CACHE_TEMP_SOURCE holds, since saving the next
+// source truncates it first.
+static size_t AvailableOnCache() {
   size_t free_now = FreeSpaceForFile("/cache");
+  if (free_now == (size_t)-1) return 0;
+
+  struct stat st;
+  if (stat(CACHE_TEMP_SOURCE, &st) == 0 && S_ISREG(st.st_mode)) {
+    free_now += st.st_blocks * 512;
+  }
+  return free_now;
+}
+
+int MakeFreeSpaceOnCache(size_t bytes_needed) {
+  size_t free_now = AvailableOnCache();
   printf("%ld bytes free on /cache (%ld needed)\n",
          (long)free_now, (long)bytes_needed);
 
@@ -134,39 +181,45 @@ int MakeFreeSpaceOnCache(size_t bytes_needed) {
     return 0;
   }
 
-  char** names;
-  int entries;
-
-  if (FindExpendableFiles(&names, &entries) < 0) {
+  if (ScanCache() < 0) {
     return -1;
   }
 
-  if (entries == 0) {
+  if (plan.next >= plan.entries) {
     // nothing we can delete to free up space!
     printf("no files can be deleted to free space on /cache\n");
     return -1;
   }
 
+  // Don't delete anything if it couldn't be enough anyway.
+  if (free_now + plan.deletable < bytes_needed) {
+    printf("only %ld bytes could be freed on /cache\n",
+           (long)(free_now + plan.deletable));
+    return -1;
+  }
+
   // We could try to be smarter about which files to delete:  the
   // biggest ones?  the smallest ones that will free up enough space?
   // the oldest?  the newest?
   //
-  // Instead, we'll be dumb.
-
-  int i;
-  for (i = 0; i < entries && free_now < bytes_needed; ++i) {
-    if (names[i]) {
-      unlink(names[i]);
-      free_now = FreeSpaceForFile("/cache");
-      printf("deleted %s; now %ld bytes free\n", names[i], (long)free_now);
-      free(names[i]);
+  // Instead, we'll be dumb.  The ledger tells us when we should have
+  // enough; statfs() has the final word.
+
+  while (free_now < bytes_needed && plan.next < plan.entries) {
+    int i = plan.next++;
+    if (plan.names[i] == NULL) continue;
+
+    unlink(plan.names[i]);
+    free_now += plan.sizes[i];
+    plan.deletable -= plan.sizes[i];
+    printf("deleted %s; now about %ld bytes free\n", plan.names[i], (long)free_now);
+    free(plan.names[i]);
+    plan.names[i] = NULL;
+
+    if (free_now >= bytes_needed) {
+      free_now = AvailableOnCache();
     }
   }
 
-  for (; i < entries; ++i) {
-    free(names[i]);
-  }
-  free(names);
-
   return (free_now >= bytes_needed) ? 0 : -1;
 }
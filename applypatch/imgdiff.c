@@ -122,12 +122,14 @@
  */
 
 #include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <pthread.h>
 
 #include "zlib.h"
 #include "imgdiff.h"
@@ -143,7 +145,7 @@ typedef struct {
   size_t source_start;
   size_t source_len;
 
-  off_t* I;             // used by bsdiff
+  void* I;              // suffix array, used by bsdiff
 
   // --- for CHUNK_DEFLATE chunks only: ---
 
@@ -179,8 +181,9 @@ static int fileentry_compare(const void* a, const void* b) {
 }
 
 // from bsdiff.c
-int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
+int bsdiff(u_char* old, off_t oldsize, void** IP, u_char* new, off_t newsize,
            const char* patch_filename);
+void bsdiff_free_suffix_array(void* I);
 
 unsigned char* ReadZip(const char* filename,
                        int* num_chunks, ImageChunk** chunks,
@@ -520,13 +523,20 @@ unsigned char* ReadImage(const char* filename,
 
 #define BUFFER_SIZE 32768
 
+// Amount of compressed output compared when screening a set of
+// encoder parameters, before committing to recompressing the whole
+// chunk with them.  deflate emits nothing until it finishes its first
+// block, so this costs roughly one block's worth of input.
+#define RECONSTRUCT_PREFIX 4096
+
 /*
  * Takes the uncompressed data stored in the chunk, compresses it
  * using the zlib parameters stored in the chunk, and checks that it
  * matches exactly the compressed data we started with (also stored in
- * the chunk).  Return 0 on success.
+ * the chunk).  If 'limit' is nonzero, only the first 'limit' bytes of
+ * compressed data are checked.  Return 0 on success.
  */
-int TryReconstruction(ImageChunk* chunk, unsigned char* out) {
+int TryReconstruction(ImageChunk* chunk, unsigned char* out, size_t limit) {
   size_t p = 0;
 
 #if 0
@@ -535,6 +545,10 @@ int TryReconstruction(ImageChunk* chunk, unsigned char* out) {
           chunk->memLevel, chunk->strategy);
 #endif
 
+  if (limit >= chunk->deflate_len) {
+    limit = 0;
+  }
+
   z_stream strm;
   strm.zalloc = Z_NULL;
   strm.zfree = Z_NULL;
@@ -544,18 +558,31 @@ int TryReconstruction(ImageChunk* chunk, unsigned char* out) {
   int ret;
   ret = deflateInit2(&strm, chunk->level, chunk->method, chunk->windowBits,
                      chunk->memLevel, chunk->strategy);
+  if (ret != Z_OK) {
+    return -1;
+  }
   do {
-    strm.avail_out = BUFFER_SIZE;
+    size_t avail = BUFFER_SIZE;
+    if (limit && limit - p < avail) {
+      avail = limit - p;
+    }
+    strm.avail_out = avail;
     strm.next_out = out;
     ret = deflate(&strm, Z_FINISH);
-    size_t have = BUFFER_SIZE - strm.avail_out;
+    size_t have = avail - strm.avail_out;
 
-    if (memcmp(out, chunk->deflate_data+p, have) != 0) {
+    if (p + have > chunk->deflate_len ||
+        memcmp(out, chunk->deflate_data+p, have) != 0) {
       // mismatch; data isn't the same.
       deflateEnd(&strm);
       return -1;
     }
     p += have;
+    if (limit && p == limit) {
+      // the prefix matches.
+      deflateEnd(&strm);
+      return 0;
+    }
   } while (ret != Z_STREAM_END);
   deflateEnd(&strm);
   if (p != chunk->deflate_len) {
@@ -565,6 +592,39 @@ int TryReconstruction(ImageChunk* chunk, unsigned char* out) {
   return 0;
 }
 
+typedef struct {
+  int level, memLevel, strategy;
+} DeflateParams;
+
+// Encoder parameters to search, in order.  Level 6 (the default) and
+// level 9 (the maximum) come first since nearly every zip and gzip
+// encoder uses one of them.
+static const int kLevels[] = { 6, 9, 1, 2, 3, 4, 5, 7, 8 };
+static const int kMemLevels[] = { 8, 9 };
+static const int kStrategies[] = { Z_DEFAULT_STRATEGY, Z_FILTERED };
+
+#define NUM_ELEMENTS(a) (sizeof(a) / sizeof((a)[0]))
+#define NUM_DEFLATE_PARAMS \
+  (NUM_ELEMENTS(kLevels) * NUM_ELEMENTS(kMemLevels) * NUM_ELEMENTS(kStrategies))
+
+// Parameters that reconstructed an earlier chunk of the same file;
+// these are tried before anything else.  Set once, before chunks are
+// reconstructed in parallel, so that the parameters chosen for each
+// chunk (and hence the patch) don't depend on thread scheduling.
+static DeflateParams preferred_params;
+static int have_preferred_params = 0;
+
+// How many deflate chunks to try, one at a time, to find the preferred
+// parameters before giving up and searching the rest in parallel.
+#define PREFERRED_PARAMS_PROBE 4
+
+static void PreferDeflateParams(const ImageChunk* chunk) {
+  preferred_params.level = chunk->level;
+  preferred_params.memLevel = chunk->memLevel;
+  preferred_params.strategy = chunk->strategy;
+  have_preferred_params = 1;
+}
+
 /*
  * Verify that we can reproduce exactly the same compressed data that
  * we started with.  Sets the level, method, windowBits, memLevel, and
@@ -577,18 +637,47 @@ int ReconstructDeflateChunk(ImageChunk* chunk) {
     return -1;
   }
 
-  size_t p = 0;
+  DeflateParams candidates[NUM_DEFLATE_PARAMS + 1];
+  int num_candidates = 0;
+  if (have_preferred_params) {
+    candidates[num_candidates++] = preferred_params;
+  }
+  int s, m, l;
+  for (s = 0; s < NUM_ELEMENTS(kStrategies); ++s) {
+    for (m = 0; m < NUM_ELEMENTS(kMemLevels); ++m) {
+      for (l = 0; l < NUM_ELEMENTS(kLevels); ++l) {
+        DeflateParams* c = candidates + num_candidates;
+        c->level = kLevels[l];
+        c->memLevel = kMemLevels[m];
+        c->strategy = kStrategies[s];
+        if (have_preferred_params &&
+            c->level == preferred_params.level &&
+            c->memLevel == preferred_params.memLevel &&
+            c->strategy == preferred_params.strategy) {
+          continue;
+        }
+        ++num_candidates;
+      }
+    }
+  }
+
   unsigned char* out = malloc(BUFFER_SIZE);
 
-  // We only check two combinations of encoder parameters:  level 6
-  // (the default) and level 9 (the maximum).
-  for (chunk->level = 6; chunk->level <= 9; chunk->level += 3) {
+  int i;
+  for (i = 0; i < num_candidates; ++i) {
+    chunk->level = candidates[i].level;
     chunk->windowBits = -15;  // 32kb window; negative to indicate a raw stream.
-    chunk->memLevel = 8;      // the default value.
+    chunk->memLevel = candidates[i].memLevel;
     chunk->method = Z_DEFLATED;
-    chunk->strategy = Z_DEFAULT_STRATEGY;
+    chunk->strategy = candidates[i].strategy;
 
-    if (TryReconstruction(chunk, out) == 0) {
+    // Screen the candidate on the start of the stream; most wrong
+    // parameters diverge in the first block.
+    if (TryReconstruction(chunk, out, RECONSTRUCT_PREFIX) != 0) {
+      continue;
+    }
+    if (chunk->deflate_len <= RECONSTRUCT_PREFIX ||
+        TryReconstruction(chunk, out, 0) == 0) {
       free(out);
       return 0;
     }
@@ -614,7 +703,12 @@ unsigned char* MakePatch(ImageChunk* src, ImageChunk* tgt, size_t* size) {
   }
 
   char ptemp[] = "/tmp/imgdiff-patch-XXXXXX";
-  mkstemp(ptemp);
+  int fd = mkstemp(ptemp);
+  if (fd < 0) {
+    printf("failed to create patch file: %s\n", strerror(errno));
+    return NULL;
+  }
+  close(fd);
 
   int r = bsdiff(src->data, src->len, &(src->I), tgt->data, tgt->len, ptemp);
   if (r != 0) {
@@ -779,6 +873,234 @@ void DumpChunks(ImageChunk* chunks, int num_chunks) {
     }
 }
 
+/*
+ * Run fn(i, cookie) for every i in [0, count) on a pool of worker
+ * threads.  Items are handed out in increasing order, but may finish
+ * in any order; fn must store its results by index.
+ */
+typedef void (*WorkFn)(int i, void* cookie);
+
+typedef struct {
+  WorkFn fn;
+  void* cookie;
+  int count;
+  int next;
+  pthread_mutex_t lock;
+} WorkQueue;
+
+static void* WorkerThread(void* arg) {
+  WorkQueue* q = (WorkQueue*)arg;
+  for (;;) {
+    pthread_mutex_lock(&q->lock);
+    int i = q->next < q->count ? q->next++ : -1;
+    pthread_mutex_unlock(&q->lock);
+    if (i < 0) return NULL;
+    q->fn(i, q->cookie);
+  }
+}
+
+/*
+ * Number of worker threads; one per online CPU unless overridden by
+ * the IMGDIFF_THREADS environment variable.
+ */
+static int WorkerCount() {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  const char* env = getenv("IMGDIFF_THREADS");
+  if (env != NULL) {
+    n = strtol(env, NULL, 10);
+  }
+  if (n > 64) n = 64;
+  return n < 1 ? 1 : n;
+}
+
+static void RunParallel(int count, WorkFn fn, void* cookie) {
+  WorkQueue q;
+  q.fn = fn;
+  q.cookie = cookie;
+  q.count = count;
+  q.next = 0;
+  pthread_mutex_init(&q.lock, NULL);
+
+  int num_threads = WorkerCount();
+  if (num_threads > count) num_threads = count;
+  pthread_t* threads = malloc(num_threads * sizeof(pthread_t));
+  int started = 0;
+  for (; started < num_threads; ++started) {
+    if (pthread_create(threads+started, NULL, WorkerThread, &q) != 0) {
+      break;
+    }
+  }
+  if (started == 0) {
+    // Couldn't start any threads; do the work ourselves.
+    WorkerThread(&q);
+  }
+  int i;
+  for (i = 0; i < started; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+  pthread_mutex_destroy(&q.lock);
+}
+
+typedef struct {
+  ImageChunk* chunks;
+  int* result;
+} ReconstructContext;
+
+static void ReconstructWork(int i, void* cookie) {
+  ReconstructContext* ctx = (ReconstructContext*)cookie;
+  if (ctx->chunks[i].type == CHUNK_DEFLATE) {
+    ctx->result[i] = ReconstructDeflateChunk(ctx->chunks+i);
+  }
+}
+
+/*
+ * A source chunk, shared by all the target chunks that are patched
+ * against it.  Its suffix array is built once, by whichever patch gets
+ * there first, and freed when the last of its targets is done.
+ */
+typedef struct {
+  ImageChunk* chunk;
+  int remaining;         // targets not yet patched
+  int reserved;          // suffix array counted against the memory limit
+  size_t mem;            // estimated size of the suffix array
+  pthread_mutex_t lock;  // held while the suffix array is being built
+} PatchSource;
+
+typedef struct {
+  PatchSource** sources;  // per target chunk
+  int* order;             // target chunks, grouped by source
+  ImageChunk* tgt_chunks;
+  unsigned char** patch_data;
+  size_t* patch_size;
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  size_t mem_limit;
+  size_t mem_in_use;
+} PatchContext;
+
+static void PatchWork(int k, void* cookie) {
+  PatchContext* ctx = (PatchContext*)cookie;
+  int i = ctx->order[k];
+  PatchSource* src = ctx->sources[i];
+
+  // Don't start on a new source if its suffix array (and our diff
+  // buffers) would take the concurrent patches over the memory limit.
+  // A patch that is over the limit on its own still runs, alone.
+  // Sources that are already in use are never held up, since their
+  // memory can only be released once all their targets are done.
+  // The work is handed out grouped by source, so by the time anyone
+  // waits here every target of the sources in use has been taken by
+  // a thread that won't wait; they finish and release their memory.
+  size_t buffers = 2 * (ctx->tgt_chunks[i].len + 1);
+  pthread_mutex_lock(&ctx->lock);
+  while (!src->reserved && ctx->mem_in_use > 0 &&
+         ctx->mem_in_use + src->mem + buffers > ctx->mem_limit) {
+    pthread_cond_wait(&ctx->cond, &ctx->lock);
+  }
+  ctx->mem_in_use += buffers;
+  if (!src->reserved) {
+    ctx->mem_in_use += src->mem;
+    src->reserved = 1;
+  }
+  pthread_mutex_unlock(&ctx->lock);
+
+  pthread_mutex_lock(&src->lock);
+  if (src->chunk->I != NULL) {
+    pthread_mutex_unlock(&src->lock);
+    ctx->patch_data[i] = MakePatch(src->chunk, ctx->tgt_chunks+i,
+                                   ctx->patch_size+i);
+  } else {
+    // bsdiff will build the suffix array; make the other users of
+    // this source wait for it.
+    ctx->patch_data[i] = MakePatch(src->chunk, ctx->tgt_chunks+i,
+                                   ctx->patch_size+i);
+    pthread_mutex_unlock(&src->lock);
+  }
+
+  pthread_mutex_lock(&ctx->lock);
+  ctx->mem_in_use -= buffers;
+  if (--src->remaining == 0) {
+    bsdiff_free_suffix_array(src->chunk->I);
+    src->chunk->I = NULL;
+    ctx->mem_in_use -= src->mem;
+  }
+  pthread_cond_broadcast(&ctx->cond);
+  pthread_mutex_unlock(&ctx->lock);
+}
+
+/*
+ * Compute the patch for each target chunk against sources[i], in
+ * parallel.  Each chunk's patch goes in patch_data[i] / patch_size[i],
+ * so the output is the same regardless of the order in which they
+ * are done.  The IMGDIFF_MEMORY_LIMIT_MB environment variable bounds
+ * the (estimated) memory used by concurrent bsdiffs; the default is
+ * 1GB.
+ */
+static void MakePatches(ImageChunk** sources, ImageChunk* tgt_chunks,
+                        int num_tgt_chunks, unsigned char** patch_data,
+                        size_t* patch_size) {
+  PatchSource* srcs = calloc(num_tgt_chunks, sizeof(PatchSource));
+  PatchSource** by_target = malloc(num_tgt_chunks * sizeof(PatchSource*));
+  int* order = malloc(num_tgt_chunks * sizeof(int));
+  int num_srcs = 0;
+  int i, j, k;
+  for (i = 0; i < num_tgt_chunks; ++i) {
+    for (j = 0; j < num_srcs; ++j) {
+      if (srcs[j].chunk == sources[i]) break;
+    }
+    if (j == num_srcs) {
+      srcs[j].chunk = sources[i];
+      // bsdiff's suffix array: SA-IS needs 4 bytes per byte plus a
+      // bit per byte of scratch, qsufsort (for huge sources, or when
+      // asked for) 16 bytes per byte while sorting.
+      size_t n = sources[i]->len + 1;
+      if (sources[i]->len < INT32_MAX &&
+          getenv("BSDIFF_USE_QSUFSORT") == NULL) {
+        srcs[j].mem = n * sizeof(int32_t) + n / 8;
+      } else {
+        srcs[j].mem = 2 * n * sizeof(off_t);
+      }
+      pthread_mutex_init(&srcs[j].lock, NULL);
+      ++num_srcs;
+    }
+    ++srcs[j].remaining;
+    by_target[i] = srcs+j;
+  }
+  for (k = 0, j = 0; j < num_srcs; ++j) {
+    for (i = 0; i < num_tgt_chunks; ++i) {
+      if (by_target[i] == srcs+j) order[k++] = i;
+    }
+  }
+
+  PatchContext ctx;
+  ctx.sources = by_target;
+  ctx.order = order;
+  ctx.tgt_chunks = tgt_chunks;
+  ctx.patch_data = patch_data;
+  ctx.patch_size = patch_size;
+  ctx.mem_in_use = 0;
+  ctx.mem_limit = (size_t)1024 << 20;
+  const char* env = getenv("IMGDIFF_MEMORY_LIMIT_MB");
+  if (env != NULL) {
+    ctx.mem_limit = (size_t)strtoul(env, NULL, 10) << 20;
+  }
+  pthread_mutex_init(&ctx.lock, NULL);
+  pthread_cond_init(&ctx.cond, NULL);
+
+  RunParallel(num_tgt_chunks, PatchWork, &ctx);
+
+  pthread_cond_destroy(&ctx.cond);
+  pthread_mutex_destroy(&ctx.lock);
+  for (j = 0; j < num_srcs; ++j) {
+    pthread_mutex_destroy(&srcs[j].lock);
+  }
+  free(order);
+  free(by_target);
+  free(srcs);
+}
+
 int main(int argc, char** argv) {
   int zip_mode = 0;
 
@@ -876,13 +1198,36 @@ int main(int argc, char** argv) {
     }
   }
 
+  // Confirm that given the uncompressed chunk data in the target, we
+  // can recompress it and get exactly the same bits as are in the
+  // input target image.  The first few deflate chunks are done one at
+  // a time until one succeeds; its parameters are then tried first for
+  // the rest (which most likely came from the same encoder), in
+  // parallel.  If none of those succeed (an image full of streams we
+  // can't reproduce), the rest get the full search in parallel rather
+  // than being worked through serially.
+  int* reconstructed = calloc(num_tgt_chunks, sizeof(int));
+  int probed = 0;
+  for (i = 0; i < num_tgt_chunks && !have_preferred_params &&
+              probed < PREFERRED_PARAMS_PROBE; ++i) {
+    if (tgt_chunks[i].type == CHUNK_DEFLATE) {
+      ++probed;
+      reconstructed[i] = ReconstructDeflateChunk(tgt_chunks+i);
+      if (reconstructed[i] == 0) {
+        PreferDeflateParams(tgt_chunks+i);
+      }
+    }
+  }
+  ReconstructContext rctx;
+  rctx.chunks = tgt_chunks + i;
+  rctx.result = reconstructed + i;
+  RunParallel(num_tgt_chunks - i, ReconstructWork, &rctx);
+
   for (i = 0; i < num_tgt_chunks; ++i) {
     if (tgt_chunks[i].type == CHUNK_DEFLATE) {
-      // Confirm that given the uncompressed chunk data in the target, we
-      // can recompress it and get exactly the same bits as are in the
-      // input target image.  If this fails, treat the chunk as a normal
+      // If reconstruction failed, treat the chunk as a normal
       // non-deflated chunk.
-      if (ReconstructDeflateChunk(tgt_chunks+i) < 0) {
+      if (reconstructed[i] < 0) {
         printf("failed to reconstruct target deflate chunk %d [%s]; "
                "treating as normal\n", i, tgt_chunks[i].filename);
         ChangeDeflateChunkToNormal(tgt_chunks+i);
@@ -919,6 +1264,8 @@ int main(int argc, char** argv) {
     }
   }
 
+  free(reconstructed);
+
   // Merging neighboring normal chunks.
   if (zip_mode) {
     // For zips, we only need to do this to the target:  deflated
@@ -946,15 +1293,16 @@ int main(int argc, char** argv) {
   printf("Construct patches for %d chunks...\n", num_tgt_chunks);
   unsigned char** patch_data = malloc(num_tgt_chunks * sizeof(unsigned char*));
   size_t* patch_size = malloc(num_tgt_chunks * sizeof(size_t));
+  ImageChunk** sources = malloc(num_tgt_chunks * sizeof(ImageChunk*));
   for (i = 0; i < num_tgt_chunks; ++i) {
     if (zip_mode) {
       ImageChunk* src;
       if (tgt_chunks[i].type == CHUNK_DEFLATE &&
           (src = FindChunkByName(tgt_chunks[i].filename, src_chunks,
                                  num_src_chunks))) {
-        patch_data[i] = MakePatch(src, tgt_chunks+i, patch_size+i);
+        sources[i] = src;
       } else {
-        patch_data[i] = MakePatch(src_chunks, tgt_chunks+i, patch_size+i);
+        sources[i] = src_chunks;
       }
     } else {
       if (i == 1 && bonus_data) {
@@ -964,7 +1312,15 @@ int main(int argc, char** argv) {
         src_chunks[i].len += bonus_size;
      }
 
-      patch_data[i] = MakePatch(src_chunks+i, tgt_chunks+i, patch_size+i);
+      sources[i] = src_chunks+i;
+    }
+  }
+  MakePatches(sources, tgt_chunks, num_tgt_chunks, patch_data, patch_size);
+  free(sources);
+  for (i = 0; i < num_tgt_chunks; ++i) {
+    if (patch_data[i] == NULL && tgt_chunks[i].type != CHUNK_RAW) {
+      printf("failed to make patch for chunk %d\n", i);
+      return 1;
     }
     printf("patch %3d is %d bytes (of %d)\n",
            i, patch_size[i], tgt_chunks[i].source_len);
@@ -18,8 +18,10 @@
 // format.
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <string.h>
 
@@ -29,16 +31,38 @@
 #include "imgdiff.h"
 #include "utils.h"
 
-/*
- * Apply the patch given in 'patch_filename' to the source data given
- * by (old_data, old_size).  Write the patched output to the 'output'
- * file, and update the SHA context with the output data as well.
- * Return 0 on success.
- */
-int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
-                    const Value* patch,
-                    SinkFn sink, void* token, SHA_CTX* ctx,
-                    const Value* bonus_data) {
+// One entry of the patch's chunk table, plus (in parallel mode) the
+// patched output of a deflate chunk.
+typedef struct {
+    int type;
+    size_t src_start;
+    size_t src_len;
+    size_t patch_offset;
+
+    // CHUNK_DEFLATE only.
+    size_t expanded_len;
+    size_t target_len;
+    int level;
+    int method;
+    int windowBits;
+    int memLevel;
+    int strategy;
+
+    // CHUNK_RAW only; points into the patch.
+    unsigned char* raw_data;
+    ssize_t raw_len;
+
+    // Filled in by the workers in parallel mode (CHUNK_DEFLATE only).
+    unsigned char* out;
+    ssize_t out_size;
+    ssize_t out_alloc;
+    int status;
+    int done;
+} PatchChunk;
+
+// Decode the whole chunk table up front.  Return the number of chunks
+// (with *chunks malloc'd) or -1 on error.
+static int ReadChunkTable(const Value* patch, PatchChunk** chunks) {
     ssize_t pos = 12;
     char* header = patch->data;
     if (patch->size < 12) {
@@ -55,178 +79,452 @@ int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
     }
 
     int num_chunks = Read4(header+8);
+    if (num_chunks < 0) {
+        printf("corrupt patch file header (chunk count)\n");
+        return -1;
+    }
+    *chunks = calloc(num_chunks > 0 ? num_chunks : 1, sizeof(PatchChunk));
+    if (*chunks == NULL) {
+        printf("failed to allocate table for %d chunks\n", num_chunks);
+        return -1;
+    }
 
     int i;
     for (i = 0; i < num_chunks; ++i) {
+        PatchChunk* c = *chunks + i;
+
         // each chunk's header record starts with 4 bytes.
         if (pos + 4 > patch->size) {
             printf("failed to read chunk %d record\n", i);
-            return -1;
+            goto fail;
         }
-        int type = Read4(patch->data + pos);
+        c->type = Read4(patch->data + pos);
         pos += 4;
 
-        if (type == CHUNK_NORMAL) {
+        if (c->type == CHUNK_NORMAL) {
             char* normal_header = patch->data + pos;
             pos += 24;
             if (pos > patch->size) {
                 printf("failed to read chunk %d normal header data\n", i);
-                return -1;
+                goto fail;
             }
 
-            size_t src_start = Read8(normal_header);
-            size_t src_len = Read8(normal_header+8);
-            size_t patch_offset = Read8(normal_header+16);
-
-            ApplyBSDiffPatch(old_data + src_start, src_len,
-                             patch, patch_offset, sink, token, ctx);
-        } else if (type == CHUNK_RAW) {
+            c->src_start = Read8(normal_header);
+            c->src_len = Read8(normal_header+8);
+            c->patch_offset = Read8(normal_header+16);
+        } else if (c->type == CHUNK_RAW) {
             char* raw_header = patch->data + pos;
             pos += 4;
             if (pos > patch->size) {
                 printf("failed to read chunk %d raw header data\n", i);
-                return -1;
+                goto fail;
             }
 
-            ssize_t data_len = Read4(raw_header);
+            c->raw_len = Read4(raw_header);
 
-            if (pos + data_len > patch->size) {
+            if (pos + c->raw_len > patch->size) {
                 printf("failed to read chunk %d raw data\n", i);
-                return -1;
+                goto fail;
             }
-            SHA_update(ctx, patch->data + pos, data_len);
-            if (sink((unsigned char*)patch->data + pos,
-                     data_len, token) != data_len) {
-                printf("failed to write chunk %d raw data\n", i);
-                return -1;
-            }
-            pos += data_len;
-        } else if (type == CHUNK_DEFLATE) {
+            c->raw_data = (unsigned char*)patch->data + pos;
+            pos += c->raw_len;
+        } else if (c->type == CHUNK_DEFLATE) {
             // deflate chunks have an additional 60 bytes in their chunk header.
             char* deflate_header = patch->data + pos;
             pos += 60;
             if (pos > patch->size) {
                 printf("failed to read chunk %d deflate header data\n", i);
-                return -1;
+                goto fail;
             }
 
-            size_t src_start = Read8(deflate_header);
-            size_t src_len = Read8(deflate_header+8);
-            size_t patch_offset = Read8(deflate_header+16);
-            size_t expanded_len = Read8(deflate_header+24);
-            size_t target_len = Read8(deflate_header+32);
-            int level = Read4(deflate_header+40);
-            int method = Read4(deflate_header+44);
-            int windowBits = Read4(deflate_header+48);
-            int memLevel = Read4(deflate_header+52);
-            int strategy = Read4(deflate_header+56);
-
-            // Decompress the source data; the chunk header tells us exactly
-            // how big we expect it to be when decompressed.
-
-            // Note: expanded_len will include the bonus data size if
-            // the patch was constructed with bonus data.  The
-            // deflation will come up 'bonus_size' bytes short; these
-            // must be appended from the bonus_data value.
-            size_t bonus_size = (i == 1 && bonus_data != NULL) ? bonus_data->size : 0;
-
-            unsigned char* expanded_source = malloc(expanded_len);
-            if (expanded_source == NULL) {
-                printf("failed to allocate %d bytes for expanded_source\n",
-                       expanded_len);
-                return -1;
-            }
+            c->src_start = Read8(deflate_header);
+            c->src_len = Read8(deflate_header+8);
+            c->patch_offset = Read8(deflate_header+16);
+            c->expanded_len = Read8(deflate_header+24);
+            c->target_len = Read8(deflate_header+32);
+            c->level = Read4(deflate_header+40);
+            c->method = Read4(deflate_header+44);
+            c->windowBits = Read4(deflate_header+48);
+            c->memLevel = Read4(deflate_header+52);
+            c->strategy = Read4(deflate_header+56);
+        } else {
+            printf("patch chunk %d is unknown type %d\n", i, c->type);
+            goto fail;
+        }
+    }
 
-            z_stream strm;
-            strm.zalloc = Z_NULL;
-            strm.zfree = Z_NULL;
-            strm.opaque = Z_NULL;
-            strm.avail_in = src_len;
-            strm.next_in = (unsigned char*)(old_data + src_start);
-            strm.avail_out = expanded_len;
-            strm.next_out = expanded_source;
-
-            int ret;
-            ret = inflateInit2(&strm, -15);
-            if (ret != Z_OK) {
-                printf("failed to init source inflation: %d\n", ret);
-                return -1;
-            }
+    return num_chunks;
 
-            // Because we've provided enough room to accommodate the output
-            // data, we expect one call to inflate() to suffice.
-            ret = inflate(&strm, Z_SYNC_FLUSH);
-            if (ret != Z_STREAM_END) {
-                printf("source inflation returned %d\n", ret);
-                return -1;
-            }
-            // We should have filled the output buffer exactly, except
-            // for the bonus_size.
-            if (strm.avail_out != bonus_size) {
-                printf("source inflation short by %d bytes\n", strm.avail_out-bonus_size);
-                return -1;
-            }
-            inflateEnd(&strm);
+  fail:
+    free(*chunks);
+    *chunks = NULL;
+    return -1;
+}
 
-            if (bonus_size) {
-                memcpy(expanded_source + (expanded_len - bonus_size),
-                       bonus_data->data, bonus_size);
-            }
+// Produce the target data for one chunk, passing it to 'sink' (and
+// 'ctx', if non-NULL).  'index' is the chunk's position in the table;
+// bonus data, if any, belongs to chunk 1.  Return 0 on success.
+static int ApplyChunk(const unsigned char* old_data, ssize_t old_size,
+                      const Value* patch, const PatchChunk* c, int index,
+                      const Value* bonus_data,
+                      SinkFn sink, void* token, SHA_CTX* ctx) {
+    if (c->type == CHUNK_NORMAL) {
+        if (c->src_start + c->src_len > (size_t)old_size) {
+            printf("chunk %d source range is out of bounds\n", index);
+            return -1;
+        }
+        return ApplyBSDiffPatch(old_data + c->src_start, c->src_len,
+                                patch, c->patch_offset, sink, token, ctx);
+    } else if (c->type == CHUNK_RAW) {
+        if (ctx) {
+            SHA_update(ctx, c->raw_data, c->raw_len);
+        }
+        if (sink(c->raw_data, c->raw_len, token) != c->raw_len) {
+            printf("failed to write chunk %d raw data\n", index);
+            return -1;
+        }
+        return 0;
+    }
 
-            // Next, apply the bsdiff patch (in memory) to the uncompressed
-            // data.
-            unsigned char* uncompressed_target_data;
-            ssize_t uncompressed_target_size;
-            if (ApplyBSDiffPatchMem(expanded_source, expanded_len,
-                                    patch, patch_offset,
-                                    &uncompressed_target_data,
-                                    &uncompressed_target_size) != 0) {
-                return -1;
-            }
+    // CHUNK_DEFLATE
 
-            // Now compress the target data and append it to the output.
-
-            // we're done with the expanded_source data buffer, so we'll
-            // reuse that memory to receive the output of deflate.
-            unsigned char* temp_data = expanded_source;
-            ssize_t temp_size = expanded_len;
-            if (temp_size < 32768) {
-                // ... unless the buffer is too small, in which case we'll
-                // allocate a fresh one.
-                free(temp_data);
-                temp_data = malloc(32768);
-                temp_size = 32768;
-            }
+    if (c->src_start + c->src_len > (size_t)old_size) {
+        printf("chunk %d source range is out of bounds\n", index);
+        return -1;
+    }
 
-            // now the deflate stream
-            strm.zalloc = Z_NULL;
-            strm.zfree = Z_NULL;
-            strm.opaque = Z_NULL;
-            strm.avail_in = uncompressed_target_size;
-            strm.next_in = uncompressed_target_data;
-            ret = deflateInit2(&strm, level, method, windowBits, memLevel, strategy);
-            do {
-                strm.avail_out = temp_size;
-                strm.next_out = temp_data;
-                ret = deflate(&strm, Z_FINISH);
-                ssize_t have = temp_size - strm.avail_out;
-
-                if (sink(temp_data, have, token) != have) {
-                    printf("failed to write %ld compressed bytes to output\n",
-                           (long)have);
-                    return -1;
-                }
-                SHA_update(ctx, temp_data, have);
-            } while (ret != Z_STREAM_END);
-            deflateEnd(&strm);
+    // Decompress the source data; the chunk header tells us exactly
+    // how big we expect it to be when decompressed.
+
+    // Note: expanded_len will include the bonus data size if
+    // the patch was constructed with bonus data.  The
+    // deflation will come up 'bonus_size' bytes short; these
+    // must be appended from the bonus_data value.
+    size_t bonus_size = (index == 1 && bonus_data != NULL) ? bonus_data->size : 0;
+
+    unsigned char* expanded_source = malloc(c->expanded_len);
+    if (expanded_source == NULL) {
+        printf("failed to allocate %d bytes for expanded_source\n",
+               c->expanded_len);
+        return -1;
+    }
+
+    z_stream strm;
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    strm.avail_in = c->src_len;
+    strm.next_in = (unsigned char*)(old_data + c->src_start);
+    strm.avail_out = c->expanded_len;
+    strm.next_out = expanded_source;
+
+    int ret;
+    ret = inflateInit2(&strm, -15);
+    if (ret != Z_OK) {
+        printf("failed to init source inflation: %d\n", ret);
+        free(expanded_source);
+        return -1;
+    }
+
+    // Because we've provided enough room to accommodate the output
+    // data, we expect one call to inflate() to suffice.
+    ret = inflate(&strm, Z_SYNC_FLUSH);
+    if (ret != Z_STREAM_END) {
+        printf("source inflation returned %d\n", ret);
+        inflateEnd(&strm);
+        free(expanded_source);
+        return -1;
+    }
+    // We should have filled the output buffer exactly, except
+    // for the bonus_size.
+    if (strm.avail_out != bonus_size) {
+        printf("source inflation short by %d bytes\n", strm.avail_out-bonus_size);
+        inflateEnd(&strm);
+        free(expanded_source);
+        return -1;
+    }
+    inflateEnd(&strm);
+
+    if (bonus_size) {
+        memcpy(expanded_source + (c->expanded_len - bonus_size),
+               bonus_data->data, bonus_size);
+    }
 
+    // Next, apply the bsdiff patch (in memory) to the uncompressed
+    // data.
+    unsigned char* uncompressed_target_data;
+    ssize_t uncompressed_target_size;
+    if (ApplyBSDiffPatchMem(expanded_source, c->expanded_len,
+                            patch, c->patch_offset,
+                            &uncompressed_target_data,
+                            &uncompressed_target_size) != 0) {
+        free(expanded_source);
+        return -1;
+    }
+
+    // Now compress the target data and append it to the output.
+
+    // we're done with the expanded_source data buffer, so we'll
+    // reuse that memory to receive the output of deflate.
+    unsigned char* temp_data = expanded_source;
+    ssize_t temp_size = c->expanded_len;
+    if (temp_size < 32768) {
+        // ... unless the buffer is too small, in which case we'll
+        // allocate a fresh one.
+        free(temp_data);
+        temp_data = malloc(32768);
+        temp_size = 32768;
+    }
+
+    // now the deflate stream
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    strm.avail_in = uncompressed_target_size;
+    strm.next_in = uncompressed_target_data;
+    ret = deflateInit2(&strm, c->level, c->method, c->windowBits,
+                       c->memLevel, c->strategy);
+    do {
+        strm.avail_out = temp_size;
+        strm.next_out = temp_data;
+        ret = deflate(&strm, Z_FINISH);
+        ssize_t have = temp_size - strm.avail_out;
+
+        if (sink(temp_data, have, token) != have) {
+            printf("failed to write %ld compressed bytes to output\n",
+                   (long)have);
+            deflateEnd(&strm);
             free(temp_data);
             free(uncompressed_target_data);
-        } else {
-            printf("patch chunk %d is unknown type %d\n", i, type);
             return -1;
         }
-    }
+        if (ctx) {
+            SHA_update(ctx, temp_data, have);
+        }
+    } while (ret != Z_STREAM_END);
+    deflateEnd(&strm);
 
+    free(temp_data);
+    free(uncompressed_target_data);
     return 0;
 }
+
+// Sink that collects a chunk's output in PatchChunk.out.  The chunk
+// header gives the size of the recompressed data, so this normally
+// allocates once.
+static ssize_t ChunkBufferSink(unsigned char* data, ssize_t len, void* token) {
+    PatchChunk* c = (PatchChunk*)token;
+    if (c->out_size + len > c->out_alloc) {
+        ssize_t alloc = c->out_alloc ? c->out_alloc * 2 : (ssize_t)c->target_len;
+        if (alloc < 32768) alloc = 32768;
+        while (alloc < c->out_size + len) alloc *= 2;
+        unsigned char* out = realloc(c->out, alloc);
+        if (out == NULL) {
+            printf("failed to allocate %ld bytes for chunk output\n",
+                   (long)alloc);
+            return -1;
+        }
+        c->out = out;
+        c->out_alloc = alloc;
+    }
+    memcpy(c->out + c->out_size, data, len);
+    c->out_size += len;
+    return len;
+}
+
+// State shared by the worker pool and the in-order writer.
+typedef struct {
+    const unsigned char* old_data;
+    ssize_t old_size;
+    const Value* patch;
+    const Value* bonus_data;
+    PatchChunk* chunks;
+    int num_chunks;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int next;           // next chunk to look at for a worker
+    size_t buffered;    // output bytes reserved by chunks not yet written
+    int failed;
+} ParallelPatch;
+
+// Most output bytes the workers may hold ahead of the writer.  A chunk
+// bigger than this still runs, but only when nothing else is buffered.
+#define PATCH_BUFFER_LIMIT (16 * 1024 * 1024)
+
+// Workers only take deflate chunks, which are the expensive ones (an
+// inflate, a bsdiff and a deflate); the writer streams normal and raw
+// chunks itself.  Chunks are taken in order, so the chunk the writer
+// is waiting for is never stuck behind the buffer limit: everything
+// before it has been written and released.
+static void* PatchWorker(void* cookie) {
+    ParallelPatch* pp = (ParallelPatch*)cookie;
+    for (;;) {
+        pthread_mutex_lock(&pp->lock);
+        while (pp->next < pp->num_chunks &&
+               pp->chunks[pp->next].type != CHUNK_DEFLATE) {
+            ++pp->next;
+        }
+        while (!pp->failed && pp->next < pp->num_chunks &&
+               pp->buffered > 0 &&
+               pp->buffered + pp->chunks[pp->next].target_len >
+                   PATCH_BUFFER_LIMIT) {
+            pthread_cond_wait(&pp->cond, &pp->lock);
+        }
+        if (pp->failed || pp->next >= pp->num_chunks) {
+            pthread_mutex_unlock(&pp->lock);
+            return NULL;
+        }
+        int i = pp->next++;
+        pp->buffered += pp->chunks[i].target_len;
+        pthread_mutex_unlock(&pp->lock);
+
+        PatchChunk* c = pp->chunks + i;
+        int status = ApplyChunk(pp->old_data, pp->old_size, pp->patch, c, i,
+                                pp->bonus_data, ChunkBufferSink, c, NULL);
+
+        pthread_mutex_lock(&pp->lock);
+        c->status = status;
+        c->done = 1;
+        if (status != 0) pp->failed = 1;
+        pthread_cond_broadcast(&pp->cond);
+        pthread_mutex_unlock(&pp->lock);
+    }
+}
+
+// Number of worker threads to patch deflate chunks with; 1 means patch
+// everything in order on the calling thread.  Defaults to one per
+// online CPU; APPLYPATCH_THREADS overrides that (1 forces serial).
+static int PatchThreadCount(int num_deflate_chunks) {
+    const char* env = getenv("APPLYPATCH_THREADS");
+    long threads = env ? strtol(env, NULL, 10) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > num_deflate_chunks) threads = num_deflate_chunks;
+    if (threads > 16) threads = 16;
+    return threads < 1 ? 1 : threads;
+}
+
+// Patch deflate chunks on a pool of worker threads.  The calling thread
+// goes through the chunks in order, patching normal and raw chunks
+// straight into the sink and writing out deflate chunks as they are
+// finished, so the output is identical to the sequential path.
+static int ApplyChunksParallel(ParallelPatch* pp, int num_threads,
+                               SinkFn sink, void* token, SHA_CTX* ctx) {
+    pthread_t* threads = malloc(num_threads * sizeof(pthread_t));
+    if (threads == NULL) return -1;
+
+    pthread_mutex_init(&pp->lock, NULL);
+    pthread_cond_init(&pp->cond, NULL);
+    pp->next = 0;
+    pp->buffered = 0;
+    pp->failed = 0;
+
+    int started = 0;
+    while (started < num_threads) {
+        if (pthread_create(threads + started, NULL, PatchWorker, pp) != 0) {
+            break;
+        }
+        ++started;
+    }
+    if (started == 0) {
+        printf("failed to start patch threads\n");
+        pp->failed = 1;
+    }
+
+    int result = 0;
+    int i;
+    for (i = 0; i < pp->num_chunks && started > 0; ++i) {
+        PatchChunk* c = pp->chunks + i;
+
+        if (c->type != CHUNK_DEFLATE) {
+            result = ApplyChunk(pp->old_data, pp->old_size, pp->patch, c, i,
+                                pp->bonus_data, sink, token, ctx);
+        } else {
+            pthread_mutex_lock(&pp->lock);
+            while (!c->done && !pp->failed) {
+                pthread_cond_wait(&pp->cond, &pp->lock);
+            }
+            pthread_mutex_unlock(&pp->lock);
+            if (!c->done || c->status != 0) {
+                result = -1;
+                break;
+            }
+
+            SHA_update(ctx, c->out, c->out_size);
+            if (sink(c->out, c->out_size, token) != c->out_size) {
+                printf("failed to write chunk %d output\n", i);
+                result = -1;
+            }
+            free(c->out);
+            c->out = NULL;
+        }
+
+        pthread_mutex_lock(&pp->lock);
+        if (c->type == CHUNK_DEFLATE) pp->buffered -= c->target_len;
+        if (result != 0) pp->failed = 1;
+        pthread_cond_broadcast(&pp->cond);
+        pthread_mutex_unlock(&pp->lock);
+        if (result != 0) break;
+    }
+    if (started == 0) result = -1;
+
+    for (i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    for (i = 0; i < pp->num_chunks; ++i) {
+        free(pp->chunks[i].out);
+    }
+    pthread_cond_destroy(&pp->cond);
+    pthread_mutex_destroy(&pp->lock);
+    free(threads);
+    return result;
+}
+
+/*
+ * Apply the patch given in 'patch_filename' to the source data given
+ * by (old_data, old_size).  Write the patched output to the 'output'
+ * file, and update the SHA context with the output data as well.
+ * Return 0 on success.
+ *
+ * Chunks are independent once the chunk table has been read, so on a
+ * multi-core device deflate chunks are patched (and re-deflated) in
+ * parallel; see PatchThreadCount() and ApplyChunksParallel().
+ */
+int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
+                    const Value* patch,
+                    SinkFn sink, void* token, SHA_CTX* ctx,
+                    const Value* bonus_data) {
+    PatchChunk* chunks;
+    int num_chunks = ReadChunkTable(patch, &chunks);
+    if (num_chunks < 0) {
+        return -1;
+    }
+
+    int result = 0;
+    int num_deflate_chunks = 0;
+    int i;
+    for (i = 0; i < num_chunks; ++i) {
+        if (chunks[i].type == CHUNK_DEFLATE) ++num_deflate_chunks;
+    }
+    int num_threads = PatchThreadCount(num_deflate_chunks);
+    if (num_threads > 1) {
+        ParallelPatch pp;
+        pp.old_data = old_data;
+        pp.old_size = old_size;
+        pp.patch = patch;
+        pp.bonus_data = bonus_data;
+        pp.chunks = chunks;
+        pp.num_chunks = num_chunks;
+        result = ApplyChunksParallel(&pp, num_threads, sink, token, ctx);
+    } else {
+        for (i = 0; i < num_chunks; ++i) {
+            if (ApplyChunk(old_data, old_size, patch, chunks + i, i,
+                           bonus_data, sink, token, ctx) != 0) {
+                result = -1;
+                break;
+            }
+        }
+    }
+
+    free(chunks);
+    return result;
+}
@@ -0,0 +1,589 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Optimization of parsed edify expressions, and a compact binary form
+// of the result that can be shipped alongside a script so the device
+// doesn't have to run the parser.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "expr.h"
+
+// -----------------------------------------------------------------
+//   constant folding
+// -----------------------------------------------------------------
+
+static int IsLiteral(const Expr* e) {
+    return e->fn == Literal;
+}
+
+// Turn 'e' into a literal with the value 'str' (taking ownership of
+// it), keeping its position in the script.
+static Expr* ToLiteral(Expr* e, char* str) {
+    e->fn = Literal;
+    e->name = str;
+    e->argc = 0;
+    e->argv = NULL;
+    return e;
+}
+
+// Replace 'e' by 'with', which takes over e's position in the script
+// (so that assert() still quotes the whole expression).
+static Expr* Replace(Expr* e, Expr* with) {
+    with->start = e->start;
+    with->end = e->end;
+    return with;
+}
+
+// Parse an integer the way less_than_int() does; return 0 if the
+// string isn't one.
+static int ParseInt(const char* s, long* value) {
+    char* end;
+    *value = strtol(s, &end, 10);
+    return s[0] != '\0' && *end == '\0';
+}
+
+static Expr* FoldConcat(Expr* e) {
+    // Merge each run of adjacent literal arguments into one.
+    int i, j, n = 0;
+    for (i = 0; i < e->argc; i = j) {
+        if (!IsLiteral(e->argv[i])) {
+            e->argv[n++] = e->argv[i];
+            j = i + 1;
+            continue;
+        }
+        size_t length = 0;
+        for (j = i; j < e->argc && IsLiteral(e->argv[j]); ++j) {
+            length += strlen(e->argv[j]->name);
+        }
+        if (j == i + 1) {
+            e->argv[n++] = e->argv[i];
+            continue;
+        }
+        char* str = malloc(length + 1);
+        char* p = str;
+        int k;
+        for (k = i; k < j; ++k) {
+            size_t len = strlen(e->argv[k]->name);
+            memcpy(p, e->argv[k]->name, len);
+            p += len;
+        }
+        *p = '\0';
+        Expr* merged = ToLiteral(e->argv[i], str);
+        merged->end = e->argv[j-1]->end;
+        e->argv[n++] = merged;
+    }
+    e->argc = n;
+
+    if (n == 0) {
+        return ToLiteral(e, strdup(""));
+    }
+    if (n == 1 && IsLiteral(e->argv[0])) {
+        return Replace(e, e->argv[0]);
+    }
+    return e;
+}
+
+static Expr* FlattenSequence(Expr* e);
+
+/*
+ * Fold the parts of 'e' that don't depend on anything but literals,
+ * and flatten chains of ';' into a single node that is evaluated by a
+ * loop instead of recursion.  Returns the replacement for 'e' (which
+ * may be 'e' itself, modified in place).  Only the builtins' behavior
+ * is assumed; calls to other functions are never folded.
+ */
+Expr* OptimizeExpr(Expr* e) {
+    if (e == NULL || IsLiteral(e)) return e;
+    if (e->fn == SequenceFn && e->argc == 2) {
+        return FlattenSequence(e);
+    }
+
+    int i;
+    for (i = 0; i < e->argc; ++i) {
+        e->argv[i] = OptimizeExpr(e->argv[i]);
+    }
+
+    if (e->fn == ConcatFn) {
+        return FoldConcat(e);
+    }
+
+    if (e->fn == IfElseFn && (e->argc == 2 || e->argc == 3) &&
+        IsLiteral(e->argv[0])) {
+        if (BooleanString(e->argv[0]->name)) {
+            return Replace(e, e->argv[1]);
+        } else if (e->argc == 3) {
+            return Replace(e, e->argv[2]);
+        } else {
+            return Replace(e, e->argv[0]);
+        }
+    }
+
+    if ((e->fn == LogicalAndFn || e->fn == LogicalOrFn) && e->argc == 2 &&
+        IsLiteral(e->argv[0])) {
+        int b = BooleanString(e->argv[0]->name);
+        if ((e->fn == LogicalAndFn) == b) {
+            return Replace(e, e->argv[1]);
+        } else {
+            return Replace(e, e->argv[0]);
+        }
+    }
+
+    if (e->fn == LogicalNotFn && e->argc == 1 && IsLiteral(e->argv[0])) {
+        return ToLiteral(e, strdup(BooleanString(e->argv[0]->name) ? "" : "t"));
+    }
+
+    if (e->argc == 2 && IsLiteral(e->argv[0]) && IsLiteral(e->argv[1])) {
+        const char* left = e->argv[0]->name;
+        const char* right = e->argv[1]->name;
+        long l_int, r_int;
+        if (e->fn == EqualityFn) {
+            return ToLiteral(e, strdup(strcmp(left, right) == 0 ? "t" : ""));
+        }
+        if (e->fn == InequalityFn) {
+            return ToLiteral(e, strdup(strcmp(left, right) != 0 ? "t" : ""));
+        }
+        if (e->fn == SubstringFn) {
+            return ToLiteral(e, strdup(strstr(right, left) ? "t" : ""));
+        }
+        // Non-integer arguments are left alone so that the warning
+        // still gets logged at run time.
+        if ((e->fn == LessThanIntFn || e->fn == GreaterThanIntFn) &&
+            ParseInt(left, &l_int) && ParseInt(right, &r_int)) {
+            int result = (e->fn == LessThanIntFn) ? l_int < r_int : l_int > r_int;
+            return ToLiteral(e, strdup(result ? "t" : ""));
+        }
+    }
+
+    return e;
+}
+
+/*
+ * Turn a chain of two-argument sequence nodes (which the parser builds
+ * left-nested, one level per statement) into a single SequenceFn node
+ * with all the statements as arguments.  Literal statements other
+ * than the last have no effect and are dropped.
+ */
+static Expr* FlattenSequence(Expr* e) {
+    // Walk down the left spine without recursing; scripts can have
+    // thousands of statements.
+    int count = 1;
+    Expr* left = e;
+    while (left->fn == SequenceFn && left->argc == 2) {
+        left = left->argv[0];
+        ++count;
+    }
+
+    Expr** items = malloc(count * sizeof(Expr*));
+    int i = count;
+    for (left = e; left->fn == SequenceFn && left->argc == 2;
+         left = left->argv[0]) {
+        items[--i] = left->argv[1];
+    }
+    items[0] = left;
+
+    int cap = count;
+    Expr** argv = malloc(cap * sizeof(Expr*));
+    int argc = 0;
+    for (i = 0; i < count; ++i) {
+        Expr* item = OptimizeExpr(items[i]);
+        Expr** add = &item;
+        int num_add = 1;
+        if (item->fn == SequenceFn) {
+            // an already-flattened parenthesized sequence.
+            add = item->argv;
+            num_add = item->argc;
+        }
+        if (argc + num_add > cap) {
+            cap = argc + num_add + count;
+            argv = realloc(argv, cap * sizeof(Expr*));
+        }
+        int j;
+        for (j = 0; j < num_add; ++j) {
+            if (argc > 0 && IsLiteral(argv[argc-1])) {
+                --argc;
+            }
+            argv[argc++] = add[j];
+        }
+    }
+    free(items);
+
+    if (argc == 1) {
+        Expr* only = argv[0];
+        free(argv);
+        return Replace(e, only);
+    }
+    e->argc = argc;
+    e->argv = argv;
+    return e;
+}
+
+// -----------------------------------------------------------------
+//   compiled scripts
+// -----------------------------------------------------------------
+
+// Compiled script format (all integers little-endian):
+//
+//   0   8   "EDIFYC01"
+//   8   4   length of the script source
+//   12  4   FNV-1a hash of the script source
+//   16  4   size S of the string pool
+//   20  S   string pool: NUL-terminated strings, each stored once
+//   20+S 4  number of nodes N
+//   ...     N nodes in preorder, each a kind byte (COMPILED_*)
+//           followed by four varints (7 bits per byte, low first):
+//             offset of the node's string in the pool
+//             number of arguments (which follow it)
+//             start position, relative to the previous node's
+//               (zigzag-encoded, since it may go backwards)
+//             length of the node's source text
+//
+// The source is still needed at run time, for assert() messages; the
+// hash ties a compiled script to the source it came from.
+
+#define COMPILED_MAGIC "EDIFYC01"
+#define COMPILED_HEADER_SIZE 20
+#define COMPILED_MIN_NODE_SIZE 5
+
+#define COMPILED_LITERAL   0   // string is the value
+#define COMPILED_CALL      1   // string is the function name
+#define COMPILED_OPERATOR  2   // string is the operator (see below)
+
+// Operators don't have registered names; these stand in for them.
+// The operator functions index argv without checking argc, so a
+// compiled node must have an argument count in [min_args, max_args]
+// (max_args -1 means no limit).
+static const struct {
+    const char* name;
+    Function fn;
+    int min_args;
+    int max_args;
+} kOperators[] = {
+    { ";",  SequenceFn,   1, -1 },
+    { "+",  ConcatFn,     0, -1 },
+    { "==", EqualityFn,   2,  2 },
+    { "!=", InequalityFn, 2,  2 },
+    { "&&", LogicalAndFn, 2,  2 },
+    { "||", LogicalOrFn,  2,  2 },
+    { "!",  LogicalNotFn, 1,  1 },
+    { "if", IfElseFn,     2,  3 },
+};
+#define NUM_OPERATORS (sizeof(kOperators) / sizeof(kOperators[0]))
+
+static const char kOperatorName[] = "(operator)";
+
+static uint32_t ScriptHash(const char* script, size_t length) {
+    uint32_t h = 2166136261u;
+    size_t i;
+    for (i = 0; i < length; ++i) {
+        h ^= (unsigned char)script[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+typedef struct {
+    unsigned char* data;
+    size_t size;
+    size_t alloc;
+} Buffer;
+
+static void Append(Buffer* b, const void* data, size_t len) {
+    if (b->size + len > b->alloc) {
+        b->alloc = (b->size + len) * 2;
+        b->data = realloc(b->data, b->alloc);
+    }
+    memcpy(b->data + b->size, data, len);
+    b->size += len;
+}
+
+static void Append4(Buffer* b, uint32_t value) {
+    unsigned char buf[4];
+    buf[0] = value;
+    buf[1] = value >> 8;
+    buf[2] = value >> 16;
+    buf[3] = value >> 24;
+    Append(b, buf, 4);
+}
+
+static void AppendVarint(Buffer* b, uint32_t value) {
+    unsigned char buf[5];
+    int n = 0;
+    do {
+        buf[n] = value & 0x7f;
+        value >>= 7;
+        if (value) buf[n] |= 0x80;
+        ++n;
+    } while (value);
+    Append(b, buf, n);
+}
+
+static uint32_t Get4(const unsigned char* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// The string pool, deduplicated with a simple open-addressed hash.
+typedef struct {
+    Buffer pool;
+    uint32_t* slots;   // pool offset + 1, or 0 for empty
+    size_t num_slots;
+    size_t used;
+} StringPool;
+
+static uint32_t Intern(StringPool* sp, const char* str) {
+    if (sp->used * 2 >= sp->num_slots) {
+        size_t old_num = sp->num_slots;
+        uint32_t* old = sp->slots;
+        sp->num_slots = old_num ? old_num * 2 : 256;
+        sp->slots = calloc(sp->num_slots, sizeof(uint32_t));
+        size_t i;
+        for (i = 0; i < old_num; ++i) {
+            if (old[i] == 0) continue;
+            const char* s = (const char*)sp->pool.data + old[i] - 1;
+            size_t h = ScriptHash(s, strlen(s)) & (sp->num_slots - 1);
+            while (sp->slots[h]) h = (h + 1) & (sp->num_slots - 1);
+            sp->slots[h] = old[i];
+        }
+        free(old);
+    }
+
+    size_t len = strlen(str);
+    size_t h = ScriptHash(str, len) & (sp->num_slots - 1);
+    while (sp->slots[h]) {
+        const char* s = (const char*)sp->pool.data + sp->slots[h] - 1;
+        if (strcmp(s, str) == 0) return sp->slots[h] - 1;
+        h = (h + 1) & (sp->num_slots - 1);
+    }
+    uint32_t offset = sp->pool.size;
+    Append(&sp->pool, str, len + 1);
+    sp->slots[h] = offset + 1;
+    ++sp->used;
+    return offset;
+}
+
+static int CompileNode(const Expr* e, StringPool* sp, Buffer* nodes,
+                       uint32_t* count, int* last_start) {
+    unsigned char kind;
+    const char* str = e->name;
+    if (IsLiteral(e)) {
+        kind = COMPILED_LITERAL;
+    } else if (e->name != NULL && strcmp(e->name, kOperatorName) == 0) {
+        kind = COMPILED_OPERATOR;
+        size_t i;
+        for (i = 0; i < NUM_OPERATORS; ++i) {
+            if (kOperators[i].fn == e->fn) break;
+        }
+        if (i == NUM_OPERATORS) {
+            fprintf(stderr, "can't compile unknown operator %p\n", e->fn);
+            return -1;
+        }
+        str = kOperators[i].name;
+    } else {
+        kind = COMPILED_CALL;
+    }
+
+    Append(nodes, &kind, 1);
+    AppendVarint(nodes, Intern(sp, str));
+    AppendVarint(nodes, e->argc);
+    int32_t delta = e->start - *last_start;
+    AppendVarint(nodes, ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31));
+    AppendVarint(nodes, e->end - e->start);
+    *last_start = e->start;
+    ++*count;
+
+    int i;
+    for (i = 0; i < e->argc; ++i) {
+        if (CompileNode(e->argv[i], sp, nodes, count, last_start) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Serialize the (optimized) expression 'root', parsed from 'script',
+ * into a malloc'd buffer.  Returns the buffer and sets *size, or
+ * returns NULL on failure.
+ */
+unsigned char* CompileExpr(const Expr* root, const char* script, size_t* size) {
+    StringPool sp;
+    memset(&sp, 0, sizeof(sp));
+    Buffer nodes;
+    memset(&nodes, 0, sizeof(nodes));
+    uint32_t count = 0;
+    int last_start = 0;
+
+    unsigned char* result = NULL;
+    if (CompileNode(root, &sp, &nodes, &count, &last_start) == 0) {
+        Buffer out;
+        memset(&out, 0, sizeof(out));
+        size_t script_len = strlen(script);
+        Append(&out, COMPILED_MAGIC, 8);
+        Append4(&out, script_len);
+        Append4(&out, ScriptHash(script, script_len));
+        Append4(&out, sp.pool.size);
+        Append(&out, sp.pool.data, sp.pool.size);
+        Append4(&out, count);
+        Append(&out, nodes.data, nodes.size);
+        result = out.data;
+        *size = out.size;
+    }
+
+    free(sp.pool.data);
+    free(sp.slots);
+    free(nodes.data);
+    return result;
+}
+
+typedef struct {
+    const unsigned char* p;
+    const unsigned char* end;
+    const char* pool;
+    uint32_t pool_size;
+    Expr* nodes;
+    uint32_t num_nodes;
+    uint32_t next_node;
+    Expr** args;
+    uint32_t next_arg;
+    int last_start;
+} Loader;
+
+static int GetVarint(Loader* ld, uint32_t* value) {
+    *value = 0;
+    int shift;
+    for (shift = 0; shift < 35 && ld->p < ld->end; shift += 7) {
+        unsigned char c = *ld->p++;
+        *value |= (uint32_t)(c & 0x7f) << shift;
+        if (!(c & 0x80)) return 0;
+    }
+    return -1;
+}
+
+static Expr* LoadNode(Loader* ld) {
+    if (ld->next_node >= ld->num_nodes || ld->p >= ld->end) {
+        return NULL;
+    }
+    Expr* e = ld->nodes + ld->next_node++;
+    unsigned char kind = *ld->p++;
+    uint32_t offset, argc, delta, length;
+    if (GetVarint(ld, &offset) != 0 || GetVarint(ld, &argc) != 0 ||
+        GetVarint(ld, &delta) != 0 || GetVarint(ld, &length) != 0) {
+        return NULL;
+    }
+    e->start = ld->last_start + (int32_t)((delta >> 1) ^ -(delta & 1));
+    e->end = e->start + length;
+    ld->last_start = e->start;
+
+    if (offset >= ld->pool_size) return NULL;
+    const char* str = ld->pool + offset;
+
+    if (kind == COMPILED_LITERAL) {
+        if (argc != 0) return NULL;
+        e->fn = Literal;
+        e->name = (char*)str;
+    } else if (kind == COMPILED_OPERATOR) {
+        size_t i;
+        for (i = 0; i < NUM_OPERATORS; ++i) {
+            if (strcmp(kOperators[i].name, str) == 0) break;
+        }
+        if (i == NUM_OPERATORS) return NULL;
+        if (argc < (uint32_t)kOperators[i].min_args ||
+            (kOperators[i].max_args >= 0 &&
+             argc > (uint32_t)kOperators[i].max_args)) {
+            fprintf(stderr, "compiled script has \"%s\" with %u args\n",
+                    str, argc);
+            return NULL;
+        }
+        e->fn = kOperators[i].fn;
+        e->name = (char*)kOperatorName;
+    } else if (kind == COMPILED_CALL) {
+        e->fn = FindFunction(str);
+        if (e->fn == NULL) {
+            fprintf(stderr, "compiled script calls unknown function \"%s\"\n", str);
+            return NULL;
+        }
+        e->name = (char*)str;
+    } else {
+        return NULL;
+    }
+
+    // Every argument is a distinct node, so there can't be more
+    // arguments than nodes.
+    if (argc > ld->num_nodes - ld->next_arg) return NULL;
+    e->argc = argc;
+    e->argv = argc ? ld->args + ld->next_arg : NULL;
+    ld->next_arg += argc;
+
+    uint32_t i;
+    for (i = 0; i < argc; ++i) {
+        if ((e->argv[i] = LoadNode(ld)) == NULL) return NULL;
+    }
+    return e;
+}
+
+/*
+ * Load a compiled script produced by CompileExpr().  'script' is the
+ * source it must have been compiled from.  Returns NULL if the data is
+ * malformed, doesn't match the script, or calls functions that aren't
+ * registered.  The returned tree points into 'data', which must be kept
+ * around for as long as the tree is used.  (Like a parsed tree, it is
+ * never freed.)
+ */
+Expr* LoadCompiledExpr(const unsigned char* data, size_t size,
+                       const char* script) {
+    if (size < COMPILED_HEADER_SIZE ||
+        memcmp(data, COMPILED_MAGIC, 8) != 0) {
+        return NULL;
+    }
+    size_t script_len = strlen(script);
+    if (Get4(data+8) != script_len ||
+        Get4(data+12) != ScriptHash(script, script_len)) {
+        fprintf(stderr, "compiled script doesn't match its source\n");
+        return NULL;
+    }
+
+    Loader ld;
+    ld.pool_size = Get4(data+16);
+    ld.pool = (const char*)data + COMPILED_HEADER_SIZE;
+    if (ld.pool_size == 0 || ld.pool_size > size - COMPILED_HEADER_SIZE - 4 ||
+        ld.pool[ld.pool_size-1] != '\0') {
+        return NULL;
+    }
+    ld.p = data + COMPILED_HEADER_SIZE + ld.pool_size;
+    ld.end = data + size;
+    ld.num_nodes = Get4(ld.p);
+    ld.p += 4;
+    if (ld.num_nodes == 0 ||
+        ld.num_nodes > (size_t)(ld.end - ld.p) / COMPILED_MIN_NODE_SIZE) {
+        return NULL;
+    }
+
+    ld.nodes = malloc(ld.num_nodes * sizeof(Expr));
+    ld.args = malloc(ld.num_nodes * sizeof(Expr*));
+    ld.next_node = 0;
+    ld.next_arg = 0;
+    ld.last_start = 0;
+    Expr* root = LoadNode(&ld);
+    if (root == NULL || ld.next_node != ld.num_nodes) {
+        free(ld.nodes);
+        free(ld.args);
+        return NULL;
+    }
+    return root;
+}
@@ -25,14 +25,122 @@
 
 // Functions should:
 //
-//    - return a malloc()'d string
-//    - if Evaluate() on any argument returns NULL, return NULL.
+//    - return a Value (usually one made in the evaluation arena, see
+//      below, or a malloc()'d one from StringValue())
+//    - if evaluating any argument returns NULL, return NULL.
 
 int BooleanString(const char* s) {
     return s[0] != '\0';
 }
 
-char* Evaluate(State* state, Expr* expr) {
+// -----------------------------------------------------------------
+//   the evaluation arena
+// -----------------------------------------------------------------
+
+// Values made by the builtins are bump-allocated from a chain of
+// blocks instead of malloc()'d one at a time.  SequenceFn releases
+// everything a statement allocated once the statement is done, so in
+// a script (a long sequence of statements) the arena is effectively
+// scoped to each top-level statement.  FreeValue() of an arena Value
+// does nothing.
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+typedef struct ArenaBlock {
+    struct ArenaBlock* prev;
+    size_t size;
+    size_t used;
+} ArenaBlock;
+
+#define ARENA_DATA(b) ((char*)((b) + 1))
+
+static ArenaBlock* arena = NULL;        // the newest block
+static ArenaBlock* arena_spare = NULL;  // one free block, kept for reuse
+
+typedef struct {
+    ArenaBlock* block;
+    size_t used;
+} ArenaMark;
+
+static void* ArenaAlloc(size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    if (arena == NULL || arena->used + size > arena->size) {
+        ArenaBlock* b;
+        if (size <= ARENA_BLOCK_SIZE && arena_spare != NULL) {
+            b = arena_spare;
+            arena_spare = NULL;
+        } else {
+            size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+            b = malloc(sizeof(ArenaBlock) + block_size);
+            if (b == NULL) return NULL;
+            b->size = block_size;
+        }
+        b->used = 0;
+        b->prev = arena;
+        arena = b;
+    }
+    void* p = ARENA_DATA(arena) + arena->used;
+    arena->used += size;
+    return p;
+}
+
+static ArenaMark ArenaGetMark() {
+    ArenaMark mark;
+    mark.block = arena;
+    mark.used = arena ? arena->used : 0;
+    return mark;
+}
+
+// Free everything allocated since 'mark' was taken.
+static void ArenaRelease(ArenaMark mark) {
+    while (arena != mark.block) {
+        ArenaBlock* b = arena;
+        arena = b->prev;
+        if (arena_spare == NULL && b->size == ARENA_BLOCK_SIZE) {
+            arena_spare = b;
+        } else {
+            free(b);
+        }
+    }
+    if (arena) arena->used = mark.used;
+}
+
+static int ArenaOwns(const void* p) {
+    const ArenaBlock* b;
+    for (b = arena; b != NULL; b = b->prev) {
+        if ((const char*)p >= ARENA_DATA(b) &&
+            (const char*)p < ARENA_DATA(b) + b->used) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+Value* SharedStringValue(const char* str, ssize_t size) {
+    Value* v = ArenaAlloc(sizeof(Value));
+    if (v == NULL) return NULL;
+    v->type = VAL_STRING;
+    v->size = size;
+    v->data = (char*)str;
+    return v;
+}
+
+Value* ArenaStringValue(const char* data, ssize_t size) {
+    Value* v = ArenaAlloc(sizeof(Value) + size + 1);
+    if (v == NULL) return NULL;
+    v->type = VAL_STRING;
+    v->size = size;
+    v->data = (char*)(v + 1);
+    if (data) memcpy(v->data, data, size);
+    v->data[size] = '\0';
+    return v;
+}
+
+static Value* BoolValue(bool b) {
+    return b ? SharedStringValue("t", 1) : SharedStringValue("", 0);
+}
+
+Value* EvaluateString(State* state, Expr* expr) {
     Value* v = expr->fn(expr->name, state, expr->argc, expr->argv);
     if (v == NULL) return NULL;
     if (v->type != VAL_STRING) {
@@ -40,15 +148,46 @@ char* Evaluate(State* state, Expr* expr) {
         FreeValue(v);
         return NULL;
     }
-    char* result = v->data;
-    free(v);
+    return v;
+}
+
+char* Evaluate(State* state, Expr* expr) {
+    Value* v = EvaluateString(state, expr);
+    if (v == NULL) return NULL;
+    char* result;
+    if (ArenaOwns(v)) {
+        result = malloc(v->size + 1);
+        memcpy(result, v->data, v->size);
+        result[v->size] = '\0';
+    } else {
+        result = v->data;
+        free(v);
+    }
     return result;
 }
 
-Value* EvaluateValue(State* state, Expr* expr) {
+// Evaluate without copying: the result may live in the arena.  The
+// builtins use this to pass a result up within the same statement.
+static Value* EvaluateArenaValue(State* state, Expr* expr) {
     return expr->fn(expr->name, state, expr->argc, expr->argv);
 }
 
+Value* EvaluateValue(State* state, Expr* expr) {
+    Value* v = EvaluateArenaValue(state, expr);
+    if (v == NULL || !ArenaOwns(v)) return v;
+    Value* result = malloc(sizeof(Value));
+    result->type = v->type;
+    result->size = v->size;
+    if (v->size >= 0) {
+        result->data = malloc(v->size + 1);
+        memcpy(result->data, v->data, v->size);
+        result->data[v->size] = '\0';
+    } else {
+        result->data = NULL;
+    }
+    return result;
+}
+
 Value* StringValue(char* str) {
     if (str == NULL) return NULL;
     Value* v = malloc(sizeof(Value));
@@ -59,44 +198,46 @@ Value* StringValue(char* str) {
 }
 
 void FreeValue(Value* v) {
-    if (v == NULL) return;
+    if (v == NULL || ArenaOwns(v)) return;
     free(v->data);
     free(v);
 }
 
+// -----------------------------------------------------------------
+//   builtins
+// -----------------------------------------------------------------
+
 Value* ConcatFn(const char* name, State* state, int argc, Expr* argv[]) {
     if (argc == 0) {
-        return StringValue(strdup(""));
+        return SharedStringValue("", 0);
     }
-    char** strings = malloc(argc * sizeof(char*));
+    Value** values = ArenaAlloc(argc * sizeof(Value*));
+    if (values == NULL) return NULL;
+    Value* result = NULL;
+    ssize_t length = 0;
     int i;
     for (i = 0; i < argc; ++i) {
-        strings[i] = NULL;
-    }
-    char* result = NULL;
-    int length = 0;
-    for (i = 0; i < argc; ++i) {
-        strings[i] = Evaluate(state, argv[i]);
-        if (strings[i] == NULL) {
+        values[i] = EvaluateString(state, argv[i]);
+        if (values[i] == NULL) {
             goto done;
         }
-        length += strlen(strings[i]);
+        length += values[i]->size;
     }
 
-    result = malloc(length+1);
-    int p = 0;
-    for (i = 0; i < argc; ++i) {
-        strcpy(result+p, strings[i]);
-        p += strlen(strings[i]);
+    result = ArenaStringValue(NULL, length);
+    if (result != NULL) {
+        char* p = result->data;
+        for (i = 0; i < argc; ++i) {
+            memcpy(p, values[i]->data, values[i]->size);
+            p += values[i]->size;
+        }
     }
-    result[p] = '\0';
 
   done:
-    for (i = 0; i < argc; ++i) {
-        free(strings[i]);
+    while (--i >= 0) {
+        FreeValue(values[i]);
     }
-    free(strings);
-    return StringValue(result);
+    return result;
 }
 
 Value* IfElseFn(const char* name, State* state, int argc, Expr* argv[]) {
@@ -105,20 +246,20 @@ Value* IfElseFn(const char* name, State* state, int argc, Expr* argv[]) {
         state->errmsg = strdup("ifelse expects 2 or 3 arguments");
         return NULL;
     }
-    char* cond = Evaluate(state, argv[0]);
+    Value* cond = EvaluateString(state, argv[0]);
     if (cond == NULL) {
         return NULL;
     }
 
-    if (BooleanString(cond) == true) {
-        free(cond);
-        return EvaluateValue(state, argv[1]);
+    if (BooleanString(cond->data) == true) {
+        FreeValue(cond);
+        return EvaluateArenaValue(state, argv[1]);
     } else {
         if (argc == 3) {
-            free(cond);
-            return EvaluateValue(state, argv[2]);
+            FreeValue(cond);
+            return EvaluateArenaValue(state, argv[2]);
         } else {
-            return StringValue(cond);
+            return cond;
         }
     }
 }
@@ -140,12 +281,12 @@ Value* AbortFn(const char* name, State* state, int argc, Expr* argv[]) {
 Value* AssertFn(const char* name, State* state, int argc, Expr* argv[]) {
     int i;
     for (i = 0; i < argc; ++i) {
-        char* v = Evaluate(state, argv[i]);
+        Value* v = EvaluateString(state, argv[i]);
         if (v == NULL) {
             return NULL;
         }
-        int b = BooleanString(v);
-        free(v);
+        int b = BooleanString(v->data);
+        FreeValue(v);
         if (!b) {
             int prefix_len;
             int len = argv[i]->end - argv[i]->start;
@@ -159,116 +300,124 @@ Value* AssertFn(const char* name, State* state, int argc, Expr* argv[]) {
             return NULL;
         }
     }
-    return StringValue(strdup(""));
+    return SharedStringValue("", 0);
 }
 
 Value* SleepFn(const char* name, State* state, int argc, Expr* argv[]) {
-    char* val = Evaluate(state, argv[0]);
+    Value* val = EvaluateString(state, argv[0]);
     if (val == NULL) {
         return NULL;
     }
-    int v = strtol(val, NULL, 10);
+    int v = strtol(val->data, NULL, 10);
     sleep(v);
-    return StringValue(val);
+    return val;
 }
 
 Value* StdoutFn(const char* name, State* state, int argc, Expr* argv[]) {
     int i;
     for (i = 0; i < argc; ++i) {
-        char* v = Evaluate(state, argv[i]);
+        Value* v = EvaluateString(state, argv[i]);
         if (v == NULL) {
             return NULL;
         }
-        fputs(v, stdout);
-        free(v);
+        fwrite(v->data, 1, v->size, stdout);
+        FreeValue(v);
     }
-    return StringValue(strdup(""));
+    return SharedStringValue("", 0);
 }
 
 Value* LogicalAndFn(const char* name, State* state,
                    int argc, Expr* argv[]) {
-    char* left = Evaluate(state, argv[0]);
+    Value* left = EvaluateString(state, argv[0]);
     if (left == NULL) return NULL;
-    if (BooleanString(left) == true) {
-        free(left);
-        return EvaluateValue(state, argv[1]);
+    if (BooleanString(left->data) == true) {
+        FreeValue(left);
+        return EvaluateArenaValue(state, argv[1]);
     } else {
-        return StringValue(left);
+        return left;
     }
 }
 
 Value* LogicalOrFn(const char* name, State* state,
                    int argc, Expr* argv[]) {
-    char* left = Evaluate(state, argv[0]);
+    Value* left = EvaluateString(state, argv[0]);
     if (left == NULL) return NULL;
-    if (BooleanString(left) == false) {
-        free(left);
-        return EvaluateValue(state, argv[1]);
+    if (BooleanString(left->data) == false) {
+        FreeValue(left);
+        return EvaluateArenaValue(state, argv[1]);
     } else {
-        return StringValue(left);
+        return left;
     }
 }
 
 Value* LogicalNotFn(const char* name, State* state,
                     int argc, Expr* argv[]) {
-    char* val = Evaluate(state, argv[0]);
+    Value* val = EvaluateString(state, argv[0]);
     if (val == NULL) return NULL;
-    bool bv = BooleanString(val);
-    free(val);
-    return StringValue(strdup(bv ? "" : "t"));
+    bool bv = BooleanString(val->data);
+    FreeValue(val);
+    return BoolValue(!bv);
 }
 
 Value* SubstringFn(const char* name, State* state,
                    int argc, Expr* argv[]) {
-    char* needle = Evaluate(state, argv[0]);
+    Value* needle = EvaluateString(state, argv[0]);
     if (needle == NULL) return NULL;
-    char* haystack = Evaluate(state, argv[1]);
+    Value* haystack = EvaluateString(state, argv[1]);
     if (haystack == NULL) {
-        free(needle);
+        FreeValue(needle);
         return NULL;
     }
 
-    char* result = strdup(strstr(haystack, needle) ? "t" : "");
-    free(needle);
-    free(haystack);
-    return StringValue(result);
+    bool result = strstr(haystack->data, needle->data) != NULL;
+    FreeValue(needle);
+    FreeValue(haystack);
+    return BoolValue(result);
 }
 
 Value* EqualityFn(const char* name, State* state, int argc, Expr* argv[]) {
-    char* left = Evaluate(state, argv[0]);
+    Value* left = EvaluateString(state, argv[0]);
     if (left == NULL) return NULL;
-    char* right = Evaluate(state, argv[1]);
+    Value* right = EvaluateString(state, argv[1]);
     if (right == NULL) {
-        free(left);
+        FreeValue(left);
         return NULL;
     }
 
-    char* result = strdup(strcmp(left, right) == 0 ? "t" : "");
-    free(left);
-    free(right);
-    return StringValue(result);
+    bool result = strcmp(left->data, right->data) == 0;
+    FreeValue(left);
+    FreeValue(right);
+    return BoolValue(result);
 }
 
 Value* InequalityFn(const char* name, State* state, int argc, Expr* argv[]) {
-    char* left = Evaluate(state, argv[0]);
+    Value* left = EvaluateString(state, argv[0]);
     if (left == NULL) return NULL;
-    char* right = Evaluate(state, argv[1]);
+    Value* right = EvaluateString(state, argv[1]);
     if (right == NULL) {
-        free(left);
+        FreeValue(left);
         return NULL;
     }
 
-    char* result = strdup(strcmp(left, right) != 0 ? "t" : "");
-    free(left);
-    free(right);
-    return StringValue(result);
+    bool result = strcmp(left->data, right->data) != 0;
+    FreeValue(left);
+    FreeValue(right);
+    return BoolValue(result);
 }
 
+// The parser builds two-argument sequences; OptimizeExpr() flattens
+// chains of them into one node with any number of statements.  Each
+// statement's arena allocations are released as soon as it's done.
 Value* SequenceFn(const char* name, State* state, int argc, Expr* argv[]) {
-    Value* left = EvaluateValue(state, argv[0]);
-    if (left == NULL) return NULL;
-    FreeValue(left);
-    return EvaluateValue(state, argv[1]);
+    int i;
+    for (i = 0; i < argc - 1; ++i) {
+        ArenaMark mark = ArenaGetMark();
+        Value* left = EvaluateArenaValue(state, argv[i]);
+        if (left == NULL) return NULL;
+        FreeValue(left);
+        ArenaRelease(mark);
+    }
+    return EvaluateArenaValue(state, argv[argc-1]);
 }
 
 Value* LessThanIntFn(const char* name, State* state, int argc, Expr* argv[]) {
@@ -278,31 +427,35 @@ Value* LessThanIntFn(const char* name, State* state, int argc, Expr* argv[]) {
         return NULL;
     }
 
-    char* left;
-    char* right;
-    if (ReadArgs(state, argv, 2, &left, &right) < 0) return NULL;
+    Value* left = EvaluateString(state, argv[0]);
+    if (left == NULL) return NULL;
+    Value* right = EvaluateString(state, argv[1]);
+    if (right == NULL) {
+        FreeValue(left);
+        return NULL;
+    }
 
     bool result = false;
     char* end;
 
-    long l_int = strtol(left, &end, 10);
-    if (left[0] == '\0' || *end != '\0') {
-        fprintf(stderr, "[%s] is not an int\n", left);
+    long l_int = strtol(left->data, &end, 10);
+    if (left->data[0] == '\0' || *end != '\0') {
+        fprintf(stderr, "[%s] is not an int\n", left->data);
         goto done;
     }
 
-    long r_int = strtol(right, &end, 10);
-    if (right[0] == '\0' || *end != '\0') {
-        fprintf(stderr, "[%s] is not an int\n", right);
+    long r_int = strtol(right->data, &end, 10);
+    if (right->data[0] == '\0' || *end != '\0') {
+        fprintf(stderr, "[%s] is not an int\n", right->data);
         goto done;
     }
 
     result = l_int < r_int;
 
   done:
-    free(left);
-    free(right);
-    return StringValue(strdup(result ? "t" : ""));
+    FreeValue(left);
+    FreeValue(right);
+    return BoolValue(result);
 }
 
 Value* GreaterThanIntFn(const char* name, State* state,
@@ -320,8 +473,9 @@ Value* GreaterThanIntFn(const char* name, State* state,
     return LessThanIntFn(name, state, 2, temp);
 }
 
+// Literals share the string in the Expr rather than copying it.
 Value* Literal(const char* name, State* state, int argc, Expr* argv[]) {
-    return StringValue(strdup(name));
+    return SharedStringValue(name, strlen(name));
 }
 
 Expr* Build(Function fn, YYLTYPE loc, int count, ...) {
@@ -370,13 +524,19 @@ void FinishRegistration() {
     qsort(fn_table, fn_entries, sizeof(NamedFunction), fn_entry_compare);
 }
 
+static Function unknown_fn = NULL;
+
+void SetUnknownFunction(Function fn) {
+    unknown_fn = fn;
+}
+
 Function FindFunction(const char* name) {
     NamedFunction key;
     key.name = name;
     NamedFunction* nf = bsearch(&key, fn_table, fn_entries,
                                 sizeof(NamedFunction), fn_entry_compare);
     if (nf == NULL) {
-        return NULL;
+        return unknown_fn;
     }
     return nf->fn;
 }
@@ -403,25 +563,24 @@ void RegisterBuiltins() {
 // zero or more char** to put them in).  If any expression evaluates
 // to NULL, free the rest and return -1.  Return 0 on success.
 int ReadArgs(State* state, Expr* argv[], int count, ...) {
-    char** args = malloc(count * sizeof(char*));
     va_list v;
     va_start(v, count);
     int i;
     for (i = 0; i < count; ++i) {
-        args[i] = Evaluate(state, argv[i]);
-        if (args[i] == NULL) {
+        char* arg = Evaluate(state, argv[i]);
+        if (arg == NULL) {
             va_end(v);
+            va_start(v, count);
             int j;
             for (j = 0; j < i; ++j) {
-                free(args[j]);
+                free(*(va_arg(v, char**)));
             }
-            free(args);
+            va_end(v);
             return -1;
         }
-        *(va_arg(v, char**)) = args[i];
+        *(va_arg(v, char**)) = arg;
     }
     va_end(v);
-    free(args);
     return 0;
 }
 
@@ -429,25 +588,24 @@ int ReadArgs(State* state, Expr* argv[], int count, ...) {
 // zero or more Value** to put them in).  If any expression evaluates
 // to NULL, free the rest and return -1.  Return 0 on success.
 int ReadValueArgs(State* state, Expr* argv[], int count, ...) {
-    Value** args = malloc(count * sizeof(Value*));
     va_list v;
     va_start(v, count);
     int i;
     for (i = 0; i < count; ++i) {
-        args[i] = EvaluateValue(state, argv[i]);
-        if (args[i] == NULL) {
+        Value* arg = EvaluateValue(state, argv[i]);
+        if (arg == NULL) {
             va_end(v);
+            va_start(v, count);
             int j;
             for (j = 0; j < i; ++j) {
-                FreeValue(args[j]);
+                FreeValue(*(va_arg(v, Value**)));
             }
-            free(args);
+            va_end(v);
             return -1;
         }
-        *(va_arg(v, Value**)) = args[i];
+        *(va_arg(v, Value**)) = arg;
     }
     va_end(v);
-    free(args);
     return 0;
 }
 
@@ -493,6 +651,31 @@ Value** ReadValueVarArgs(State* state, int argc, Expr* argv[]) {
     return args;
 }
 
+// Evaluate the expressions in argv, which must all be strings,
+// returning an array of them.  The array and the strings live in the
+// evaluation arena, so nothing needs to be freed, but they must not be
+// kept past the end of the current statement.  Returns NULL if any
+// evaluation fails.
+char** ReadArenaArgs(State* state, int argc, Expr* argv[]) {
+    char** args = ArenaAlloc((argc > 0 ? argc : 1) * sizeof(char*));
+    if (args == NULL) return NULL;
+    int i;
+    for (i = 0; i < argc; ++i) {
+        Value* v = EvaluateString(state, argv[i]);
+        if (v == NULL) return NULL;
+        if (!ArenaOwns(v)) {
+            // A malloc()'d result from a non-builtin function; move it
+            // into the arena so the caller doesn't have to free it.
+            Value* copy = ArenaStringValue(v->data, v->size);
+            FreeValue(v);
+            if (copy == NULL) return NULL;
+            v = copy;
+        }
+        args[i] = v->data;
+    }
+    return args;
+}
+
 // Use printf-style arguments to compose an error message to put into
 // *state.  Returns NULL.
 Value* ErrorAbort(State* state, const char* format, ...) {
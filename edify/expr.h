@@ -67,9 +67,15 @@ struct Expr {
 
 // Take one of the Expr*s passed to the function as an argument,
 // evaluate it, return the resulting Value.  The caller takes
-// ownership of the returned Value.
+// ownership of the returned Value (an arena result is copied out),
+// and must release it with FreeValue().
 Value* EvaluateValue(State* state, Expr* expr);
 
+// Like EvaluateValue, but assert that the result is a string.  The
+// result may live in the evaluation arena; it's valid until the end
+// of the current top-level statement.
+Value* EvaluateString(State* state, Expr* expr);
+
 // Take one of the Expr*s passed to the function as an argument,
 // evaluate it, assert that it is a string, and return the resulting
 // char*.  The caller takes ownership of the returned char*.  This is
@@ -100,6 +106,11 @@ Expr* Build(Function fn, YYLTYPE loc, int count, ...);
 Value* IfElseFn(const char* name, State* state, int argc, Expr* argv[]);
 Value* AssertFn(const char* name, State* state, int argc, Expr* argv[]);
 Value* AbortFn(const char* name, State* state, int argc, Expr* argv[]);
+Value* LessThanIntFn(const char* name, State* state, int argc, Expr* argv[]);
+Value* GreaterThanIntFn(const char* name, State* state, int argc, Expr* argv[]);
+
+// True if the string counts as "true" (ie, is nonempty).
+int BooleanString(const char* s);
 
 
 // For setting and getting the global error string (when returning
@@ -129,6 +140,32 @@ void FinishRegistration();
 // exists.
 Function FindFunction(const char* name);
 
+// Make FindFunction() return 'fn' for names that aren't registered.
+// Used when compiling scripts on the host, where the device's
+// functions aren't available; never call the resulting tree.
+void SetUnknownFunction(Function fn);
+
+
+// --- compiled scripts (compile.c) ---
+
+// Fold the parts of a parsed expression that depend only on literals
+// (concatenation, comparisons, if/else and logical operators with
+// constant conditions) and flatten statement sequences so they are
+// evaluated by a loop.  Returns the replacement for 'e'.
+Expr* OptimizeExpr(Expr* e);
+
+// Serialize an expression parsed from 'script' into a compact binary
+// form with a shared string pool.  Returns a malloc'd buffer and sets
+// *size, or returns NULL on failure.
+unsigned char* CompileExpr(const Expr* root, const char* script, size_t* size);
+
+// Rebuild an expression from CompileExpr() output.  Returns NULL if
+// the data is malformed, was compiled from a script other than
+// 'script', or calls unregistered functions.  The tree points into
+// 'data', which must outlive it.
+Expr* LoadCompiledExpr(const unsigned char* data, size_t size,
+                       const char* script);
+
 
 // --- convenience functions for use in functions ---
 
@@ -154,6 +191,13 @@ char** ReadVarArgs(State* state, int argc, Expr* argv[]);
 // Values it contains.
 Value** ReadValueVarArgs(State* state, int argc, Expr* argv[]);
 
+// Evaluate the expressions in argv, which must all be strings,
+// returning an array of them.  The array and the strings live in the
+// evaluation arena: the caller must not free them, nor keep them past
+// the end of the current top-level statement.  Returns NULL if any
+// evaluation fails.
+char** ReadArenaArgs(State* state, int argc, Expr* argv[]);
+
 // Use printf-style arguments to compose an error message to put into
 // *state.  Returns NULL.
 Value* ErrorAbort(State* state, const char* format, ...) __attribute__((format(printf, 2, 3)));
@@ -161,6 +205,16 @@ Value* ErrorAbort(State* state, const char* format, ...) __attribute__((format(p
 // Wrap a string into a Value, taking ownership of the string.
 Value* StringValue(char* str);
 
+// Make a string Value in the evaluation arena holding a copy of
+// 'size' bytes of data (plus a terminating null).  If data is NULL
+// the contents are left for the caller to fill in.
+Value* ArenaStringValue(const char* data, ssize_t size);
+
+// Make a string Value in the evaluation arena that points at str
+// without copying it.  str must outlive the current statement (a
+// literal in the parse tree, or a string constant).
+Value* SharedStringValue(const char* str, ssize_t size);
+
 // Free a Value object.
 void FreeValue(Value* v);
 
@@ -40,33 +40,54 @@ int expect(const char* expr_str, const char* expected, int* errors) {
         return 0;
     }
 
-    State state;
-    state.cookie = NULL;
-    state.script = strdup(expr_str);
-    state.errmsg = NULL;
-
-    result = Evaluate(&state, e);
-    free(state.errmsg);
-    free(state.script);
-    if (result == NULL && expected != NULL) {
-        fprintf(stderr, "error evaluating \"%s\"\n", expr_str);
-        ++*errors;
-        return 0;
-    }
+    // Evaluate the tree as parsed, then optimized, then after a trip
+    // through the compiled form; all three must agree.
+    int pass;
+    for (pass = 0; pass < 3; ++pass) {
+        State state;
+        state.cookie = NULL;
+        state.script = strdup(expr_str);
+        state.errmsg = NULL;
 
-    if (result == NULL && expected == NULL) {
-        return 1;
-    }
+        unsigned char* compiled = NULL;
+        if (pass == 1) {
+            e = OptimizeExpr(e);
+        } else if (pass == 2) {
+            size_t size;
+            compiled = CompileExpr(e, state.script, &size);
+            e = compiled ? LoadCompiledExpr(compiled, size, state.script) : NULL;
+            if (e == NULL) {
+                fprintf(stderr, "error compiling \"%s\"\n", expr_str);
+                ++*errors;
+                free(compiled);
+                free(state.script);
+                return 0;
+            }
+        }
+
+        result = Evaluate(&state, e);
+        free(state.errmsg);
+        free(state.script);
+        if (result == NULL && expected != NULL) {
+            fprintf(stderr, "error evaluating \"%s\" (pass %d)\n", expr_str, pass);
+            ++*errors;
+            return 0;
+        }
+
+        if (result == NULL && expected == NULL) {
+            continue;
+        }
+
+        if (strcmp(result, expected) != 0) {
+            fprintf(stderr, "evaluating \"%s\" (pass %d): expected \"%s\", got \"%s\"\n",
+                    expr_str, pass, expected, result);
+            ++*errors;
+            free(result);
+            return 0;
+        }
 
-    if (strcmp(result, expected) != 0) {
-        fprintf(stderr, "evaluating \"%s\": expected \"%s\", got \"%s\"\n",
-                expr_str, expected, result);
-        ++*errors;
         free(result);
-        return 0;
     }
-
-    free(result);
     return 1;
 }
 
@@ -154,6 +175,15 @@ int test() {
     expect("greater_than_int(x, 3)", "", &errors);
     expect("greater_than_int(3, x)", "", &errors);
 
+    // constant folding must not change short-circuiting or sequencing
+    expect("a; \"\"; b", "b", &errors);
+    expect("(a; b); (c; d)", "d", &errors);
+    expect("a + b + less_than_int(3, 14)", "abt", &errors);
+    expect("if a == a then yes else abort() endif", "yes", &errors);
+    expect("if a == b then abort() endif", "", &errors);
+    expect("concat(a, \"\" || b, ifelse(\"\", x))", "ab", &errors);
+    expect("\"\" && abort(); abort()", NULL, &errors);
+
     printf("\n");
 
     return errors;
@@ -173,6 +203,58 @@ void ExprDump(int depth, Expr* n, char* script) {
     }
 }
 
+// Stands in for device-specific functions when compiling a script.
+Value* DeviceFunction(const char* name, State* state, int argc, Expr* argv[]) {
+    return ErrorAbort(state, "%s() is only available on the device", name);
+}
+
+// Compile the script in 'in' for shipping alongside it in a package
+// (as updater-script.bin).
+int compile(const char* in, const char* out) {
+    FILE* f = fopen(in, "rb");
+    if (f == NULL) {
+        printf("%s: No such file or directory\n", in);
+        return 1;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char* script = malloc(size + 1);
+    if (fread(script, 1, size, f) != size) {
+        printf("%s: read failed\n", in);
+        fclose(f);
+        return 1;
+    }
+    fclose(f);
+    script[size] = '\0';
+
+    SetUnknownFunction(DeviceFunction);
+
+    Expr* root;
+    int error_count = 0;
+    yy_scan_bytes(script, size);
+    int error = yyparse(&root, &error_count);
+    if (error != 0 || error_count > 0) {
+        printf("%d parse errors\n", error_count);
+        return 1;
+    }
+
+    size_t compiled_size;
+    unsigned char* compiled = CompileExpr(OptimizeExpr(root), script,
+                                          &compiled_size);
+    if (compiled == NULL) {
+        return 1;
+    }
+    f = fopen(out, "wb");
+    if (f == NULL || fwrite(compiled, 1, compiled_size, f) != compiled_size) {
+        printf("%s: write failed\n", out);
+        return 1;
+    }
+    fclose(f);
+    printf("compiled %ld bytes of script into %zu bytes\n", size, compiled_size);
+    return 0;
+}
+
 int main(int argc, char** argv) {
     RegisterBuiltins();
     FinishRegistration();
@@ -181,6 +263,10 @@ int main(int argc, char** argv) {
         return test() != 0;
     }
 
+    if (argc == 4 && strcmp(argv[1], "-c") == 0) {
+        return compile(argv[2], argv[3]);
+    }
+
     FILE* f = fopen(argv[1], "r");
     if (f == NULL) {
         printf("%s: %s: No such file or directory\n", argv[0], argv[1]);
@@ -48,7 +48,7 @@ int get_flash_type(const char* partitionType) {
     return type;
 }
 
-static int detect_partition(const char *partitionType, const char *partition)
+int detect_partition(const char *partitionType, const char *partition)
 {
     int type = device_flash_type();
     if (strstr(partition, "/dev/block/mtd") != NULL)
@@ -7,6 +7,7 @@ int erase_raw_partition(const char* partitionType, const char *partition);
 int erase_partition(const char *partition, const char *filesystem);
 int mount_partition(const char *partition, const char *mount_point, const char *filesystem, int read_only);
 int get_partition_device(const char *partition, char *device);
+int detect_partition(const char *partitionType, const char *partition);
 
 #define FLASH_MTD 0
 #define FLASH_MMC 1
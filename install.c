@@ -105,6 +105,26 @@ handle_firmware_update(char* type, char* filename, ZipArchive* zip) {
 
 static const char *LAST_INSTALL_FILE = "/cache/recovery/last_install";
 
+// Write the package's parsed central directory to an unlinked file in
+// /tmp for the update binary to inherit, so it doesn't have to parse
+// the package again.  Returns the fd, or -1 if it couldn't be written.
+static int
+write_package_index(ZipArchive *zip) {
+    char name[] = "/tmp/package_index-XXXXXX";
+    int fd = mkstemp(name);
+    if (fd < 0) {
+        return -1;
+    }
+    unlink(name);
+    int err = mzWriteZipIndex(zip, fd);
+    if (err != 0) {
+        LOGW("Can't write package index (%s)\n", strerror(err));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
 // If the package contains an update binary, extract it and run it.
 static int
 try_update_binary(const char *path, ZipArchive *zip) {
@@ -178,6 +198,12 @@ try_update_binary(const char *path, ZipArchive *zip) {
     //
     //   - the name of the package zip file.
     //
+    // In addition, UPDATE_PACKAGE_INDEX_FD in the environment names an
+    // fd holding the package's central directory as written by
+    // mzWriteZipIndex().  Update binaries that know about it can open
+    // the package with mzOpenZipArchiveWithIndex() instead of parsing
+    // it again; older ones just ignore it.
+    //
 
     char** args = malloc(sizeof(char*) * 5);
     args[0] = binary;
@@ -187,15 +213,26 @@ try_update_binary(const char *path, ZipArchive *zip) {
     args[3] = (char*)path;
     args[4] = NULL;
 
+    int index_fd = write_package_index(zip);
+
     pid_t pid = fork();
     if (pid == 0) {
         setenv("UPDATE_PACKAGE", path, 1);
+        if (index_fd >= 0) {
+            char index_fd_str[12];
+            sprintf(index_fd_str, "%d", index_fd);
+            fcntl(index_fd, F_SETFD, 0);
+            setenv("UPDATE_PACKAGE_INDEX_FD", index_fd_str, 1);
+        }
         close(pipefd[0]);
         execv(binary, args);
         fprintf(stdout, "E:Can't run %s (%s)\n", binary, strerror(errno));
         _exit(-1);
     }
     close(pipefd[1]);
+    if (index_fd >= 0) {
+        close(index_fd);
+    }
 
     char* firmware_type = NULL;
     char* firmware_filename = NULL;
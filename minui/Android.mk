@@ -1,7 +1,7 @@
 LOCAL_PATH := $(call my-dir)
 include $(CLEAR_VARS)
 
-LOCAL_SRC_FILES := events.c resources.c
+LOCAL_SRC_FILES := events.c resources.c blit.c
 ifneq ($(BOARD_CUSTOM_GRAPHICS),)
   LOCAL_SRC_FILES += $(BOARD_CUSTOM_GRAPHICS)
 else
@@ -50,3 +50,25 @@ ifeq ($(TARGET_PREBUILT_KERNEL),)
 endif
 
 include $(BUILD_STATIC_LIBRARY)
+
+# Host tool that pre-decodes res/images into one bundle recovery can
+# mmap at startup (see resbundle.h); the PNGs stay as the fallback.
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := mkresbundle.c
+LOCAL_C_INCLUDES += external/libpng external/zlib
+LOCAL_STATIC_LIBRARIES := libpng libz
+LOCAL_MODULE := mkresbundle
+LOCAL_MODULE_TAGS := optional
+include $(BUILD_HOST_EXECUTABLE)
+
+# Only the stock images go in; a device that overrides one ships a PNG
+# whose crc32 no longer matches, and recovery decodes that PNG instead.
+RECOVERY_RES_BUNDLE := $(TARGET_RECOVERY_ROOT_OUT)/res/images.bundle
+RECOVERY_RES_BUNDLE_IMAGES := $(sort $(wildcard $(LOCAL_PATH)/../res/images/*.png))
+$(RECOVERY_RES_BUNDLE): MKRESBUNDLE := $(LOCAL_INSTALLED_MODULE)
+$(RECOVERY_RES_BUNDLE): $(LOCAL_INSTALLED_MODULE) $(RECOVERY_RES_BUNDLE_IMAGES)
+	@echo "Resource bundle: $@"
+	@mkdir -p $(dir $@)
+	$(hide) $(MKRESBUNDLE) $@ $(filter %.png,$^)
+
+ALL_DEFAULT_INSTALLED_MODULES += $(RECOVERY_RES_BUNDLE)
@@ -0,0 +1,181 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "blit.h"
+
+/* Pixel layouts as pixelflinger stores them: RGBX_8888 is the bytes
+ * r, g, b, x; BGRA_8888 is b, g, r, a; RGB_565 is r in the top bits of
+ * a 16-bit word.  Sources from res_create_surface() are r, g, b, a.
+ */
+#if defined(RECOVERY_BGRA)
+typedef uint32_t pixel_t;
+#define PACK(r, g, b)   ((uint32_t)(b) | ((g) << 8) | ((r) << 16) | 0xff000000u)
+#define RED(p)          (((p) >> 16) & 0xff)
+#define GREEN(p)        (((p) >> 8) & 0xff)
+#define BLUE(p)         ((p) & 0xff)
+#define SAME_AS_RGBX    0
+#elif defined(RECOVERY_RGBX)
+typedef uint32_t pixel_t;
+#define PACK(r, g, b)   ((uint32_t)(r) | ((g) << 8) | ((b) << 16) | 0xff000000u)
+#define RED(p)          ((p) & 0xff)
+#define GREEN(p)        (((p) >> 8) & 0xff)
+#define BLUE(p)         (((p) >> 16) & 0xff)
+#define SAME_AS_RGBX    1
+#else
+typedef uint16_t pixel_t;
+#define PACK(r, g, b)   ((((r) >> 3) << 11) | (((g) >> 2) << 5) | ((b) >> 3))
+#define RED(p)          ((((p) >> 8) & 0xf8) | (((p) >> 13) & 0x07))
+#define GREEN(p)        ((((p) >> 3) & 0xfc) | (((p) >> 9) & 0x03))
+#define BLUE(p)         ((((p) << 3) & 0xf8) | (((p) >> 2) & 0x07))
+#define SAME_AS_RGBX    0
+#endif
+
+/* (s * a + d * (255 - a)) / 255, rounded */
+static inline unsigned blend(unsigned s, unsigned d, unsigned a)
+{
+    unsigned x = s * a + d * (255 - a) + 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+static inline pixel_t blend_pixel(pixel_t d, unsigned r, unsigned g,
+                                  unsigned b, unsigned a)
+{
+    return PACK(blend(r, RED(d), a), blend(g, GREEN(d), a),
+                blend(b, BLUE(d), a));
+}
+
+static inline pixel_t *row_at(GGLSurface *s, int x, int y)
+{
+    return (pixel_t *) s->data + y * s->stride + x;
+}
+
+void blit_set_color(BlitColor *c, unsigned char r, unsigned char g,
+                    unsigned char b, unsigned char a)
+{
+    c->r = r;
+    c->g = g;
+    c->b = b;
+    c->a = a;
+    c->pixel = PACK(r, g, b);
+}
+
+void blit_fill(GGLSurface *dst, int x1, int y1, int x2, int y2,
+               const BlitColor *c)
+{
+    int w = x2 - x1;
+    int x, y;
+
+    if (w <= 0 || y2 <= y1 || c->a == 0)
+        return;
+
+    if (c->a == 255) {
+        /* build one row, then copy it down; memcpy is what the C
+         * library has the vectorized loops for */
+        pixel_t *first = row_at(dst, x1, y1);
+        pixel_t pixel = c->pixel;
+        for (x = 0; x < w; x++)
+            first[x] = pixel;
+        for (y = y1 + 1; y < y2; y++)
+            memcpy(row_at(dst, x1, y), first, w * sizeof(pixel_t));
+        return;
+    }
+
+    for (y = y1; y < y2; y++) {
+        pixel_t *d = row_at(dst, x1, y);
+        for (x = 0; x < w; x++)
+            d[x] = blend_pixel(d[x], c->r, c->g, c->b, c->a);
+    }
+}
+
+int blit_image(GGLSurface *dst, const GGLSurface *src, int sx, int sy,
+               int x1, int y1, int x2, int y2)
+{
+    int opaque;
+    int x, y, w;
+
+    if (src->format == GGL_PIXEL_FORMAT_RGBX_8888) {
+        opaque = 1;
+    } else if (src->format == GGL_PIXEL_FORMAT_RGBA_8888) {
+        opaque = 0;
+    } else {
+        return -1;
+    }
+
+    /* keep to the part of the rectangle src covers */
+    if (sx < 0) {
+        x1 -= sx;
+        sx = 0;
+    }
+    if (sy < 0) {
+        y1 -= sy;
+        sy = 0;
+    }
+    if (x2 - x1 > (int) src->width - sx)
+        x2 = x1 + (int) src->width - sx;
+    if (y2 - y1 > (int) src->height - sy)
+        y2 = y1 + (int) src->height - sy;
+    w = x2 - x1;
+    if (w <= 0 || y2 <= y1)
+        return 0;
+
+    for (y = y1; y < y2; y++) {
+        const unsigned char *s = src->data + ((sy + y - y1) * src->stride + sx) * 4;
+        pixel_t *d = row_at(dst, x1, y);
+
+        if (opaque) {
+#if SAME_AS_RGBX
+            memcpy(d, s, w * sizeof(pixel_t));
+#else
+            for (x = 0; x < w; x++, s += 4)
+                d[x] = PACK(s[0], s[1], s[2]);
+#endif
+            continue;
+        }
+
+        for (x = 0; x < w; x++, s += 4) {
+            unsigned a = s[3];
+            if (a == 255)
+                d[x] = PACK(s[0], s[1], s[2]);
+            else if (a != 0)
+                d[x] = blend_pixel(d[x], s[0], s[1], s[2], a);
+        }
+    }
+    return 0;
+}
+
+void blit_mask(GGLSurface *dst, const GGLSurface *mask, int mx, int my,
+               int x1, int y1, int x2, int y2, const BlitColor *c)
+{
+    int x, y;
+    int w = x2 - x1;
+    pixel_t pixel = c->pixel;
+
+    for (y = y1; y < y2; y++) {
+        const unsigned char *m = mask->data + (my + y - y1) * mask->stride + mx;
+        pixel_t *d = row_at(dst, x1, y);
+
+        for (x = 0; x < w; x++) {
+            unsigned a = m[x];
+            if (a == 255)
+                d[x] = pixel;
+            else if (a != 0)
+                d[x] = blend_pixel(d[x], c->r, c->g, c->b, a);
+        }
+    }
+}
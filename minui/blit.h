@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MINUI_BLIT_H_
+#define _MINUI_BLIT_H_
+
+#include <stdint.h>
+
+#include <pixelflinger/pixelflinger.h>
+
+/* Software drawing into a surface in the framebuffer pixel format
+ * (RGB_565 by default, RGBX_8888 or BGRA_8888 with RECOVERY_RGBX or
+ * RECOVERY_BGRA), standing in for the pixelflinger paths the graphics
+ * code used with blending set to SRC_ALPHA, ONE_MINUS_SRC_ALPHA.
+ *
+ * The rectangle x1,y1 - x2,y2 (x2 and y2 exclusive) is where to draw
+ * in 'dst'; the caller has already clipped it to the surface.
+ */
+
+typedef struct {
+    unsigned char r, g, b, a;
+    uint32_t pixel;             /* r, g, b packed in the dst format */
+} BlitColor;
+
+void blit_set_color(BlitColor *c, unsigned char r, unsigned char g,
+                    unsigned char b, unsigned char a);
+
+/* Fill with c, blending it if it isn't opaque. */
+void blit_fill(GGLSurface *dst, int x1, int y1, int x2, int y2,
+               const BlitColor *c);
+
+/* Copy from src, its pixel (sx, sy) landing on (x1, y1); the part of
+ * the rectangle src doesn't cover is left alone.  RGBA_8888 sources are
+ * blended by their alpha.  Returns -1, having drawn nothing, when src
+ * isn't RGBX_8888 or RGBA_8888.
+ */
+int blit_image(GGLSurface *dst, const GGLSurface *src, int sx, int sy,
+               int x1, int y1, int x2, int y2);
+
+/* Paint c's r, g and b through the A_8 coverage mask, its pixel
+ * (mx, my) landing on (x1, y1) (c's own alpha is ignored, as with a
+ * GGL_REPLACE alpha texture).
+ */
+void blit_mask(GGLSurface *dst, const GGLSurface *mask, int mx, int my,
+               int x1, int y1, int x2, int y2, const BlitColor *c);
+
+#endif
@@ -16,9 +16,15 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <dirent.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
 #include <sys/poll.h>
+#include <sys/stat.h>
 
 #include <linux/input.h>
 
@@ -27,6 +33,10 @@
 
 #define MAX_DEVICES 16
 #define MAX_MISC_FDS 16
+#define MAX_FDS (MAX_DEVICES + MAX_MISC_FDS)
+
+/* input events taken from a device with each read() */
+#define EV_BATCH 64
 
 #define BITS_PER_LONG (sizeof(unsigned long) * 8)
 #define BITS_TO_LONGS(x) (((x) + BITS_PER_LONG - 1) / BITS_PER_LONG)
@@ -34,17 +44,33 @@
 #define test_bit(bit, array) \
     ((array)[(bit)/BITS_PER_LONG] & (1 << ((bit) % BITS_PER_LONG)))
 
+/* Everything epoll reports an fd with points straight at its fd_info,
+ * so dispatching doesn't scan the fds that aren't ready.  Slots
+ * 0..MAX_DEVICES-1 are input devices, the rest are from ev_add_fd().
+ */
 struct fd_info {
+    int fd;                     /* -1 when the slot is free */
     ev_callback cb;
     void *data;
+    /* events read from the device but not handed out yet */
+    struct input_event queue[EV_BATCH];
+    unsigned queue_head;
+    unsigned queue_len;
+    unsigned taken;             /* events handed out, ever */
 };
 
-static struct pollfd ev_fds[MAX_DEVICES + MAX_MISC_FDS];
-static struct fd_info ev_fdinfo[MAX_DEVICES + MAX_MISC_FDS];
+static struct fd_info ev_fdinfo[MAX_FDS];
+static struct epoll_event ev_ready[MAX_FDS + 1];
+static int ev_ready_count = 0;
+
+static int epoll_fd = -1;
+static int inotify_fd = -1;             /* watches /dev/input */
 
-static unsigned ev_count = 0;
-static unsigned ev_dev_count = 0;
-static unsigned ev_misc_count = 0;
+static ev_callback ev_input_cb;
+static void *ev_input_data;
+
+/* set while ev_dispatch() is calling fd_info's callback */
+static struct fd_info *ev_current;
 
 #define VIBRATOR_TIMEOUT_FILE	"/sys/class/timed_output/vibrator/enable"
 
@@ -68,43 +94,154 @@ int vibrate(int timeout_ms) {
     return 0;
 }
 
+static int ev_setup(void)
+{
+    int i;
+
+    if (epoll_fd >= 0)
+        return 0;
+    epoll_fd = epoll_create(MAX_FDS + 1);
+    if (epoll_fd < 0)
+        return -1;
+    for (i = 0; i < MAX_FDS; i++)
+        ev_fdinfo[i].fd = -1;
+    return 0;
+}
+
+static int add_fd(int first, int last, int fd, ev_callback cb, void *data)
+{
+    struct epoll_event event;
+    int i;
+
+    for (i = first; i < last; i++) {
+        struct fd_info *info = &ev_fdinfo[i];
+        if (info->fd >= 0)
+            continue;
+
+        event.events = EPOLLIN;
+        event.data.ptr = info;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+            return -1;
+        info->fd = fd;
+        info->cb = cb;
+        info->data = data;
+        info->queue_head = info->queue_len = 0;
+        return 0;
+    }
+    return -1;
+}
+
+static void remove_fd(struct fd_info *info)
+{
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, info->fd, NULL);
+    close(info->fd);
+    info->fd = -1;
+    info->queue_len = 0;
+}
+
+/* A device created between adding the inotify watch and scanning
+ * /dev/input is seen by both; don't open it twice. */
+static int device_is_open(dev_t rdev)
+{
+    struct stat st;
+    int i;
+
+    for (i = 0; i < MAX_DEVICES; i++) {
+        if (ev_fdinfo[i].fd >= 0 && fstat(ev_fdinfo[i].fd, &st) == 0 &&
+            st.st_rdev == rdev)
+            return 1;
+    }
+    return 0;
+}
+
+static void open_device(int dir_fd, const char *name)
+{
+    unsigned long ev_bits[BITS_TO_LONGS(EV_MAX)];
+    struct stat st;
+    int fd;
+
+    if(strncmp(name,"event",5)) return;
+    fd = openat(dir_fd, name, O_RDONLY | O_NONBLOCK);
+    if(fd < 0) return;
+
+    if (fstat(fd, &st) < 0 || device_is_open(st.st_rdev)) {
+        close(fd);
+        return;
+    }
+
+    /* read the evbits of the input device */
+    if (ioctl(fd, EVIOCGBIT(0, sizeof(ev_bits)), ev_bits) < 0) {
+        close(fd);
+        return;
+    }
+
+    /* TODO: add ability to specify event masks. For now, just assume
+     * that only EV_KEY and EV_REL event types are ever needed. */
+    if (!test_bit(EV_KEY, ev_bits) && !test_bit(EV_REL, ev_bits) && !test_bit(EV_ABS, ev_bits)) {
+        close(fd);
+        return;
+    }
+
+    if (add_fd(0, MAX_DEVICES, fd, ev_input_cb, ev_input_data) < 0)
+        close(fd);
+}
+
+/* Pick up devices plugged in (or that showed up late) after ev_init(). */
+static void handle_hotplug(void)
+{
+    char buf[512] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int dir_fd;
+    ssize_t r;
+
+    r = read(inotify_fd, buf, sizeof(buf));
+    if (r <= 0)
+        return;
+
+    dir_fd = open("/dev/input", O_RDONLY | O_DIRECTORY);
+    if (dir_fd < 0)
+        return;
+    ssize_t off = 0;
+    while (off + (ssize_t) sizeof(struct inotify_event) <= r) {
+        struct inotify_event *ie = (struct inotify_event *) (buf + off);
+        if (ie->len > 0 && (ie->mask & IN_CREATE))
+            open_device(dir_fd, ie->name);
+        off += sizeof(struct inotify_event) + ie->len;
+    }
+    close(dir_fd);
+}
+
 int ev_init(ev_callback input_cb, void *data)
 {
     DIR *dir;
     struct dirent *de;
-    int fd;
+
+    if (ev_setup() < 0)
+        return -1;
+    ev_input_cb = input_cb;
+    ev_input_data = data;
+
+    /* watch before scanning, so a device can't slip in between */
+    inotify_fd = inotify_init();
+    if (inotify_fd >= 0) {
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = NULL;
+        if (inotify_add_watch(inotify_fd, "/dev/input", IN_CREATE) < 0 ||
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, inotify_fd, &event) < 0) {
+            close(inotify_fd);
+            inotify_fd = -1;
+        } else {
+            fcntl(inotify_fd, F_SETFL, O_NONBLOCK);
+        }
+    }
 
     dir = opendir("/dev/input");
     if(dir != 0) {
         while((de = readdir(dir))) {
-            unsigned long ev_bits[BITS_TO_LONGS(EV_MAX)];
-
 //            fprintf(stderr,"/dev/input/%s\n", de->d_name);
-            if(strncmp(de->d_name,"event",5)) continue;
-            fd = openat(dirfd(dir), de->d_name, O_RDONLY);
-            if(fd < 0) continue;
-
-            /* read the evbits of the input device */
-            if (ioctl(fd, EVIOCGBIT(0, sizeof(ev_bits)), ev_bits) < 0) {
-                close(fd);
-                continue;
-            }
-
-            /* TODO: add ability to specify event masks. For now, just assume
-             * that only EV_KEY and EV_REL event types are ever needed. */
-            if (!test_bit(EV_KEY, ev_bits) && !test_bit(EV_REL, ev_bits) && !test_bit(EV_ABS, ev_bits)) {
-                close(fd);
-                continue;
-            }
-
-            ev_fds[ev_count].fd = fd;
-            ev_fds[ev_count].events = POLLIN;
-            ev_fdinfo[ev_count].cb = input_cb;
-            ev_fdinfo[ev_count].data = data;
-            ev_count++;
-            ev_dev_count++;
-            if (ev_dev_count == (MAX_DEVICES + MAX_MISC_FDS)) break;
+            open_device(dirfd(dir), de->d_name);
         }
+        closedir(dir);
     }
 
     return 0;
@@ -112,59 +249,117 @@ int ev_init(ev_callback input_cb, void *data)
 
 int ev_add_fd(int fd, ev_callback cb, void *data)
 {
-    if (ev_misc_count == MAX_MISC_FDS || cb == NULL)
+    if (cb == NULL || ev_setup() < 0)
         return -1;
 
-    ev_fds[ev_count].fd = fd;
-    ev_fds[ev_count].events = POLLIN;
-    ev_fdinfo[ev_count].cb = cb;
-    ev_fdinfo[ev_count].data = data;
-    ev_count++;
-    ev_misc_count++;
-    return 0;
+    return add_fd(MAX_DEVICES, MAX_FDS, fd, cb, data);
 }
 
 void ev_exit(void)
 {
-    while (ev_count > 0) {
-        close(ev_fds[--ev_count].fd);
+    int i;
+
+    for (i = 0; i < MAX_FDS; i++) {
+        if (ev_fdinfo[i].fd >= 0)
+            remove_fd(&ev_fdinfo[i]);
     }
-    ev_misc_count = 0;
-    ev_dev_count = 0;
+    if (inotify_fd >= 0) {
+        close(inotify_fd);
+        inotify_fd = -1;
+    }
+    if (epoll_fd >= 0) {
+        close(epoll_fd);
+        epoll_fd = -1;
+    }
+    ev_ready_count = 0;
 }
 
 int ev_wait(int timeout)
 {
     int r;
 
-    r = poll(ev_fds, ev_count, timeout);
-    if (r <= 0)
+    if (epoll_fd < 0)
         return -1;
+    r = epoll_wait(epoll_fd, ev_ready, MAX_FDS + 1, timeout);
+    if (r <= 0) {
+        ev_ready_count = 0;
+        return -1;
+    }
+    ev_ready_count = r;
     return 0;
 }
 
 void ev_dispatch(void)
 {
-    unsigned n;
-    int ret;
+    int n;
+
+    for (n = 0; n < ev_ready_count; n++) {
+        struct fd_info *info = ev_ready[n].data.ptr;
+        /* EPOLLIN, EPOLLERR and EPOLLHUP have the values of their
+         * poll() counterparts */
+        short revents = ev_ready[n].events;
+        unsigned taken;
+
+        if (info == NULL) {
+            handle_hotplug();
+            continue;
+        }
+        if (info->fd < 0 || info->cb == NULL)
+            continue;
+        if (!(revents & EPOLLIN)) {
+            /* an unplugged device; it won't come back on this fd */
+            if (info < ev_fdinfo + MAX_DEVICES &&
+                (revents & (EPOLLERR | EPOLLHUP)))
+                remove_fd(info);
+            continue;
+        }
 
-    for (n = 0; n < ev_count; n++) {
-        ev_callback cb = ev_fdinfo[n].cb;
-        if (cb && (ev_fds[n].revents & ev_fds[n].events))
-            cb(ev_fds[n].fd, ev_fds[n].revents, ev_fdinfo[n].data);
+        /* Keep calling back while the callback is taking events out of
+         * what the last read() brought in, so one wakeup handles a
+         * whole batch. */
+        ev_current = info;
+        do {
+            taken = info->taken;
+            info->cb(info->fd, revents, info->data);
+        } while (info->fd >= 0 && info->queue_len > 0 && info->taken != taken);
+        ev_current = NULL;
     }
+    ev_ready_count = 0;
 }
 
 int ev_get_input(int fd, short revents, struct input_event *ev)
 {
-    int r;
+    struct fd_info *info = ev_current;
+    ssize_t r;
+
+    if (info == NULL || info->fd != fd) {
+        /* not called back from ev_dispatch(); read just the one */
+        if (revents & POLLIN) {
+            r = read(fd, ev, sizeof(*ev));
+            if (r == sizeof(*ev))
+                return 0;
+        }
+        return -1;
+    }
 
-    if (revents & POLLIN) {
-        r = read(fd, ev, sizeof(*ev));
-        if (r == sizeof(*ev))
-            return 0;
+    if (info->queue_len == 0) {
+        if (!(revents & POLLIN))
+            return -1;
+        r = read(fd, info->queue, sizeof(info->queue));
+        if (r < (ssize_t) sizeof(*ev)) {
+            /* unplugged */
+            if (r == 0 || (r < 0 && errno == ENODEV))
+                remove_fd(info);
+            return -1;
+        }
+        info->queue_head = 0;
+        info->queue_len = r / sizeof(*ev);
     }
-    return -1;
+
+    *ev = info->queue[info->queue_head++];
+    info->queue_len--;
+    info->taken++;
+    return 0;
 }
 
 int ev_sync_key_state(ev_set_key_callback set_key_cb, void *data)
@@ -174,17 +369,24 @@ int ev_sync_key_state(ev_set_key_callback set_key_cb, void *data)
     unsigned i;
     int ret;
 
-    for (i = 0; i < ev_dev_count; i++) {
+    if (epoll_fd < 0)
+        return 0;
+
+    for (i = 0; i < MAX_DEVICES; i++) {
         int code;
+        int fd = ev_fdinfo[i].fd;
+
+        if (fd < 0)
+            continue;
 
         memset(key_bits, 0, sizeof(key_bits));
         memset(ev_bits, 0, sizeof(ev_bits));
 
-        ret = ioctl(ev_fds[i].fd, EVIOCGBIT(0, sizeof(ev_bits)), ev_bits);
+        ret = ioctl(fd, EVIOCGBIT(0, sizeof(ev_bits)), ev_bits);
         if (ret < 0 || !test_bit(EV_KEY, ev_bits))
             continue;
 
-        ret = ioctl(ev_fds[i].fd, EVIOCGKEY(sizeof(key_bits)), key_bits);
+        ret = ioctl(fd, EVIOCGKEY(sizeof(key_bits)), key_bits);
         if (ret < 0)
             continue;
 
@@ -15,6 +15,7 @@
  */
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
 
@@ -37,6 +38,7 @@
 #endif
 
 #include "minui.h"
+#include "blit.h"
 
 #if defined(RECOVERY_BGRA)
 #define PIXEL_FORMAT GGL_PIXEL_FORMAT_BGRA_8888
@@ -69,6 +71,25 @@ static int overscan_percent = OVERSCAN_PERCENT;
 static int overscan_offset_x = 0;
 static int overscan_offset_y = 0;
 
+/* A rectangle in memory surface coordinates (overscan included), with
+ * x2 and y2 exclusive.  Empty when x1 >= x2 or y1 >= y2.
+ */
+typedef struct {
+    int x1, y1, x2, y2;
+} GRRect;
+
+/* What was drawn since the last flip, and what the flip before that
+ * one copied out.  With double buffering the back buffer is two frames
+ * old, so a flip has to bring both over.
+ */
+static GRRect gr_damage;
+static GRRect gr_prev_damage;
+
+static GRRect gr_clip;
+static bool gr_clip_enabled = false;
+
+static BlitColor gr_blit_color;
+
 static int gr_fb_fd = -1;
 static int gr_vt_fd = -1;
 
@@ -190,31 +211,154 @@ static void set_active_framebuffer(unsigned n)
     }
 }
 
+static bool rect_empty(const GRRect *r)
+{
+    return r->x1 >= r->x2 || r->y1 >= r->y2;
+}
+
+static void rect_union(GRRect *r, const GRRect *o)
+{
+    if (rect_empty(o)) return;
+    if (rect_empty(r)) {
+        *r = *o;
+        return;
+    }
+    if (o->x1 < r->x1) r->x1 = o->x1;
+    if (o->y1 < r->y1) r->y1 = o->y1;
+    if (o->x2 > r->x2) r->x2 = o->x2;
+    if (o->y2 > r->y2) r->y2 = o->y2;
+}
+
+static void rect_intersect(GRRect *r, const GRRect *o)
+{
+    if (o->x1 > r->x1) r->x1 = o->x1;
+    if (o->y1 > r->y1) r->y1 = o->y1;
+    if (o->x2 < r->x2) r->x2 = o->x2;
+    if (o->y2 < r->y2) r->y2 = o->y2;
+}
+
+static void set_full_damage(GRRect *r)
+{
+    r->x1 = 0;
+    r->y1 = 0;
+    r->x2 = vi.xres;
+    r->y2 = vi.yres;
+}
+
+/* Clip r to the memory surface and the clip rectangle, and record that
+ * what's left of it is about to be drawn on.  Returns false if nothing
+ * is left, in which case the caller can skip the drawing altogether.
+ */
+static bool gr_damage_rect(GRRect *r)
+{
+    GRRect screen;
+
+    set_full_damage(&screen);
+    rect_intersect(r, &screen);
+    if (gr_clip_enabled)
+        rect_intersect(r, &gr_clip);
+    if (rect_empty(r))
+        return false;
+
+    rect_union(&gr_damage, r);
+    return true;
+}
+
+void gr_set_clip(int x, int y, int w, int h)
+{
+    GGLContext *gl = gr_context;
+
+    x += overscan_offset_x;
+    y += overscan_offset_y;
+
+    gr_clip.x1 = x;
+    gr_clip.y1 = y;
+    gr_clip.x2 = x + w;
+    gr_clip.y2 = y + h;
+    gr_clip_enabled = true;
+
+    gl->scissor(gl, x, y, w, h);
+    gl->enable(gl, GGL_SCISSOR_TEST);
+}
+
+void gr_clear_clip(void)
+{
+    GGLContext *gl = gr_context;
+
+    gr_clip_enabled = false;
+    gl->disable(gl, GGL_SCISSOR_TEST);
+}
+
+#ifdef BOARD_HAS_FLIPPED_SCREEN
+#if PIXEL_SIZE == 4
+typedef uint32_t fb_pixel_t;
+#else
+typedef uint16_t fb_pixel_t;
+#endif
+
+/* For devices with physically inverted screens: copy rows y1 to y2 of
+ * the in-memory surface to 'fb' turned 180 degrees, row y landing
+ * backwards on row yres-1-y.  The memory surface itself stays the right
+ * way up, so only the damaged rows need to go out.
+ */
+static void copy_rotated(GGLSurface *fb, int y1, int y2)
+{
+    const int w = vi.xres;
+    int x, y;
+
+    for (y = y1; y < y2; y++) {
+        const fb_pixel_t *src = (const fb_pixel_t *) gr_mem_surface.data +
+                                y * gr_mem_surface.stride;
+        fb_pixel_t *dst = (fb_pixel_t *) fb->data +
+                          (vi.yres - 1 - y) * fb->stride + w - 1;
+
+        /* four at a time, so the compiler can turn each group into a
+         * vector load, reverse and store */
+        for (x = 0; x + 4 <= w; x += 4) {
+            dst[-x] = src[x];
+            dst[-x - 1] = src[x + 1];
+            dst[-x - 2] = src[x + 2];
+            dst[-x - 3] = src[x + 3];
+        }
+        for (; x < w; x++)
+            dst[-x] = src[x];
+    }
+}
+#endif
+
 void gr_flip(void)
 {
     GGLContext *gl = gr_context;
+    GRRect copy = gr_damage;
+
+    /* nothing was drawn, so the front buffer is already up to date */
+    if (rect_empty(&gr_damage))
+        return;
 
     /* swap front and back buffers */
-    if (double_buffering)
+    if (double_buffering) {
         gr_active_fb = (gr_active_fb + 1) & 1;
+        rect_union(&copy, &gr_prev_damage);
+    }
 
 #ifdef BOARD_HAS_FLIPPED_SCREEN
-    /* flip buffer 180 degrees for devices with physicaly inverted screens */
-    unsigned int i;
-    for (i = 1; i < (vi.xres * vi.yres); i++) {
-        unsigned short tmp = gr_mem_surface.data[i];
-        gr_mem_surface.data[i] = gr_mem_surface.data[(vi.xres * vi.yres *2) - i];
-        gr_mem_surface.data[(vi.xres * vi.yres *2) - i] = tmp;
-    }
+    copy_rotated(&gr_framebuffer[gr_active_fb], copy.y1, copy.y2);
+#else
+    /* copy the damaged rows from the in-memory surface to the buffer
+     * we're about to make active.  Whole rows are contiguous, so this
+     * stays a single memcpy. */
+    size_t offset = copy.y1 * fi.line_length;
+    memcpy(gr_framebuffer[gr_active_fb].data + offset,
+           gr_mem_surface.data + offset,
+           (copy.y2 - copy.y1) * fi.line_length);
 #endif
 
-    /* copy data from the in-memory surface to the buffer we're about
-     * to make active. */
-    memcpy(gr_framebuffer[gr_active_fb].data, gr_mem_surface.data,
-           fi.line_length * vi.yres);
-
     /* inform the display driver */
     set_active_framebuffer(gr_active_fb);
+
+    gr_prev_damage = gr_damage;
+    gr_damage.x1 = gr_damage.x2 = 0;
+    gr_damage.y1 = gr_damage.y2 = 0;
 }
 
 void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a)
@@ -226,6 +370,7 @@ void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a
     color[2] = ((b << 8) | b) + 1;
     color[3] = ((a << 8) | a) + 1;
     gl->color4xv(gl, color);
+    blit_set_color(&gr_blit_color, r, g, b, a);
 }
 
 int gr_measure(const char *s)
@@ -241,7 +386,6 @@ void gr_font_size(int *x, int *y)
 
 int gr_text(int x, int y, const char *s, int bold)
 {
-    GGLContext *gl = gr_context;
     GRFont *font = gr_font;
     unsigned off;
 
@@ -250,17 +394,14 @@ int gr_text(int x, int y, const char *s, int bold)
 
     y -= font->ascent;
 
-    gl->bindTexture(gl, &font->texture);
-    gl->texEnvi(gl, GGL_TEXTURE_ENV, GGL_TEXTURE_ENV_MODE, GGL_REPLACE);
-    gl->texGeni(gl, GGL_S, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
-    gl->texGeni(gl, GGL_T, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
-    gl->enable(gl, GGL_TEXTURE_2D);
-
     while((off = *s++)) {
         off -= 32;
         if (off < 96) {
-            gl->texCoord2i(gl, (off * font->cwidth) - x, 0 - y);
-            gl->recti(gl, x, y, x + font->cwidth, y + font->cheight);
+            GRRect r = { x, y, x + font->cwidth, y + font->cheight };
+            if (gr_damage_rect(&r))
+                blit_mask(&gr_mem_surface, &font->texture,
+                          off * font->cwidth + r.x1 - x, r.y1 - y,
+                          r.x1, r.y1, r.x2, r.y2, &gr_blit_color);
         }
         x += font->cwidth;
     }
@@ -277,6 +418,14 @@ void gr_texticon(int x, int y, gr_surface icon) {
     x += overscan_offset_x;
     y += overscan_offset_y;
 
+    GRRect r = { x, y, x + gr_get_width(icon), y + gr_get_height(icon) };
+    if (!gr_damage_rect(&r))
+        return;
+    if (blit_image(&gr_mem_surface, (GGLSurface*) icon, r.x1 - x, r.y1 - y,
+                   r.x1, r.y1, r.x2, r.y2) == 0)
+        return;
+
+    /* a texture format the software blitter doesn't know */
     gl->bindTexture(gl, (GGLSurface*) icon);
     gl->texEnvi(gl, GGL_TEXTURE_ENV, GGL_TEXTURE_ENV_MODE, GGL_REPLACE);
     gl->texGeni(gl, GGL_S, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
@@ -298,9 +447,11 @@ void gr_fill(int x1, int y1, int x2, int y2)
     x2 += overscan_offset_x;
     y2 += overscan_offset_y;
 
-    GGLContext *gl = gr_context;
-    gl->disable(gl, GGL_TEXTURE_2D);
-    gl->recti(gl, x1, y1, x2, y2);
+    GRRect r = { x1, y1, x2, y2 };
+    if (!gr_damage_rect(&r))
+        return;
+
+    blit_fill(&gr_mem_surface, r.x1, r.y1, r.x2, r.y2, &gr_blit_color);
 }
 
 void gr_blit(gr_surface source, int sx, int sy, int w, int h, int dx, int dy) {
@@ -312,6 +463,14 @@ void gr_blit(gr_surface source, int sx, int sy, int w, int h, int dx, int dy) {
     dx += overscan_offset_x;
     dy += overscan_offset_y;
 
+    GRRect r = { dx, dy, dx + w, dy + h };
+    if (!gr_damage_rect(&r))
+        return;
+    if (blit_image(&gr_mem_surface, (GGLSurface*) source,
+                   sx + r.x1 - dx, sy + r.y1 - dy, r.x1, r.y1, r.x2, r.y2) == 0)
+        return;
+
+    /* a texture format the software blitter doesn't know */
     gl->bindTexture(gl, (GGLSurface*) source);
     gl->texEnvi(gl, GGL_TEXTURE_ENV, GGL_TEXTURE_ENV_MODE, GGL_REPLACE);
     gl->texGeni(gl, GGL_S, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
@@ -389,6 +548,10 @@ int gr_init(void)
 
     get_memory_surface(&gr_mem_surface);
 
+    /* the first flip has to fill both framebuffers */
+    set_full_damage(&gr_damage);
+    set_full_damage(&gr_prev_damage);
+
     fprintf(stderr, "framebuffer: fd %d (%d x %d)\n",
             gr_fb_fd, gr_framebuffer[0].width, gr_framebuffer[0].height);
 
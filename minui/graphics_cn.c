@@ -38,6 +38,7 @@
 #endif
 
 #include "minui.h"
+#include "blit.h"
 
 #if defined(RECOVERY_BGRA)
 #define PIXEL_FORMAT GGL_PIXEL_FORMAT_BGRA_8888
@@ -63,6 +64,7 @@ typedef struct {
     void** fontdata;
     unsigned count;
     unsigned *unicodemap;
+    unsigned short **pages;     /* see build_glyph_pages() */
     unsigned char *cwidth;
     unsigned char *cheight;
     unsigned ascent;
@@ -79,6 +81,25 @@ static int overscan_percent = OVERSCAN_PERCENT;
 static int overscan_offset_x = 0;
 static int overscan_offset_y = 0;
 
+/* A rectangle in memory surface coordinates (overscan included), with
+ * x2 and y2 exclusive.  Empty when x1 >= x2 or y1 >= y2.
+ */
+typedef struct {
+    int x1, y1, x2, y2;
+} GRRect;
+
+/* What was drawn since the last flip, and what the flip before that
+ * one copied out.  With double buffering the back buffer is two frames
+ * old, so a flip has to bring both over.
+ */
+static GRRect gr_damage;
+static GRRect gr_prev_damage;
+
+static GRRect gr_clip;
+static bool gr_clip_enabled = false;
+
+static BlitColor gr_blit_color;
+
 static int gr_fb_fd = -1;
 static int gr_vt_fd = -1;
 
@@ -222,21 +243,113 @@ static void set_active_framebuffer(unsigned n)
     }
 }
 
+static bool rect_empty(const GRRect *r)
+{
+    return r->x1 >= r->x2 || r->y1 >= r->y2;
+}
+
+static void rect_union(GRRect *r, const GRRect *o)
+{
+    if (rect_empty(o)) return;
+    if (rect_empty(r)) {
+        *r = *o;
+        return;
+    }
+    if (o->x1 < r->x1) r->x1 = o->x1;
+    if (o->y1 < r->y1) r->y1 = o->y1;
+    if (o->x2 > r->x2) r->x2 = o->x2;
+    if (o->y2 > r->y2) r->y2 = o->y2;
+}
+
+static void rect_intersect(GRRect *r, const GRRect *o)
+{
+    if (o->x1 > r->x1) r->x1 = o->x1;
+    if (o->y1 > r->y1) r->y1 = o->y1;
+    if (o->x2 < r->x2) r->x2 = o->x2;
+    if (o->y2 < r->y2) r->y2 = o->y2;
+}
+
+static void set_full_damage(GRRect *r)
+{
+    r->x1 = 0;
+    r->y1 = 0;
+    r->x2 = vi.xres;
+    r->y2 = vi.yres;
+}
+
+/* Clip r to the memory surface and the clip rectangle, and record that
+ * what's left of it is about to be drawn on.  Returns false if nothing
+ * is left, in which case the caller can skip the drawing altogether.
+ */
+static bool gr_damage_rect(GRRect *r)
+{
+    GRRect screen;
+
+    set_full_damage(&screen);
+    rect_intersect(r, &screen);
+    if (gr_clip_enabled)
+        rect_intersect(r, &gr_clip);
+    if (rect_empty(r))
+        return false;
+
+    rect_union(&gr_damage, r);
+    return true;
+}
+
+void gr_set_clip(int x, int y, int w, int h)
+{
+    GGLContext *gl = gr_context;
+
+    x += overscan_offset_x;
+    y += overscan_offset_y;
+
+    gr_clip.x1 = x;
+    gr_clip.y1 = y;
+    gr_clip.x2 = x + w;
+    gr_clip.y2 = y + h;
+    gr_clip_enabled = true;
+
+    gl->scissor(gl, x, y, w, h);
+    gl->enable(gl, GGL_SCISSOR_TEST);
+}
+
+void gr_clear_clip(void)
+{
+    GGLContext *gl = gr_context;
+
+    gr_clip_enabled = false;
+    gl->disable(gl, GGL_SCISSOR_TEST);
+}
+
 void gr_flip(void)
 {
     GGLContext *gl = gr_context;
+    GRRect copy = gr_damage;
+
+    /* nothing was drawn, so the front buffer is already up to date */
+    if (rect_empty(&gr_damage))
+        return;
 
     /* swap front and back buffers */
-    if (double_buffering)
+    if (double_buffering) {
         gr_active_fb = (gr_active_fb + 1) & 1;
+        rect_union(&copy, &gr_prev_damage);
+    }
 
-    /* copy data from the in-memory surface to the buffer we're about
-     * to make active. */
-    memcpy(gr_framebuffer[gr_active_fb].data, gr_mem_surface.data,
-           fi.line_length * vi.yres);
+    /* copy the damaged rows from the in-memory surface to the buffer
+     * we're about to make active.  Whole rows are contiguous, so this
+     * stays a single memcpy. */
+    size_t offset = copy.y1 * fi.line_length;
+    memcpy(gr_framebuffer[gr_active_fb].data + offset,
+           gr_mem_surface.data + offset,
+           (copy.y2 - copy.y1) * fi.line_length);
 
     /* inform the display driver */
     set_active_framebuffer(gr_active_fb);
+
+    gr_prev_damage = gr_damage;
+    gr_damage.x1 = gr_damage.x2 = 0;
+    gr_damage.y1 = gr_damage.y2 = 0;
 }
 
 void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a)
@@ -248,6 +361,7 @@ void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a
     color[2] = ((b << 8) | b) + 1;
     color[3] = ((a << 8) | a) + 1;
     gl->color4xv(gl, color);
+    blit_set_color(&gr_blit_color, r, g, b, a);
 }
 
 struct utf8_table {
@@ -299,18 +413,76 @@ utf8_mbtowc(wchar_t *p, const char *s, int n)
 	return -nc;
 }
 
+/* Longest sequence utf8_mbtowc() decodes.  The strings it's given are
+ * NUL-terminated and a NUL never passes for a continuation byte, so
+ * this bound is safe without measuring the rest of the string.
+ */
+#define UTF8_MAX_LEN 6
+
+#define GLYPH_PAGE_SHIFT 8
+#define GLYPH_PAGE_SIZE (1 << GLYPH_PAGE_SHIFT)
+#define GLYPH_NUM_PAGES (0x10000 >> GLYPH_PAGE_SHIFT)
+
+/* Index unicodemap as a two-level table over the BMP: pages[cp >> 8]
+ * is NULL when no glyph falls in that block of 256 code points, and
+ * otherwise holds glyph id + 1 for each of them (0 for none).  A
+ * GB2312 font fills under a hundred of the 256 pages.
+ */
+static void build_glyph_pages(GRFont *gfont)
+{
+    unsigned i;
+
+    gfont->pages = calloc(GLYPH_NUM_PAGES, sizeof(*gfont->pages));
+    if (gfont->pages == NULL)
+        return;
+
+    for (i = 0; i < gfont->count; i++) {
+        unsigned unicode = gfont->unicodemap[i];
+        if (unicode >= 0x10000)
+            continue;
+        unsigned short **page = &gfont->pages[unicode >> GLYPH_PAGE_SHIFT];
+        if (*page == NULL) {
+            *page = calloc(GLYPH_PAGE_SIZE, sizeof(**page));
+            if (*page == NULL)
+                continue;
+        }
+        /* the first glyph listed for a code point wins, as before */
+        if ((*page)[unicode & (GLYPH_PAGE_SIZE - 1)] == 0)
+            (*page)[unicode & (GLYPH_PAGE_SIZE - 1)] = i + 1;
+    }
+}
+
+/* Glyph id for a code point, 0 (the space) if the font lacks it. */
+static unsigned lookup_glyph(GRFont *gfont, unsigned unicode)
+{
+    unsigned i;
+
+    if (gfont->pages != NULL) {
+        const unsigned short *page;
+        if (unicode >= 0x10000)
+            return 0;
+        page = gfont->pages[unicode >> GLYPH_PAGE_SHIFT];
+        if (page == NULL || page[unicode & (GLYPH_PAGE_SIZE - 1)] == 0)
+            return 0;
+        return page[unicode & (GLYPH_PAGE_SIZE - 1)] - 1;
+    }
+
+    /* no index (out of memory at init); fall back to a scan */
+    for (i = 0; i < gfont->count; i++) {
+        if (unicode == gfont->unicodemap[i])
+            return i;
+    }
+    return 0;
+}
+
 int getCharID(const char* s, void* pFont)
 {
-	unsigned i, unicode;
+	wchar_t unicode;
 	GRFont *gfont = (GRFont*) pFont;
 	if (!gfont)  gfont = gr_font;
-	utf8_mbtowc(&unicode, s, strlen(s));
-	for (i = 0; i < gfont->count; i++)
-	{
-		if (unicode == gfont->unicodemap[i])
-		return i;
-	}
-	return 0;
+	if (utf8_mbtowc(&unicode, s, UTF8_MAX_LEN) <= 0)
+		return 0;
+	return lookup_glyph(gfont, unicode);
 }
 
 
@@ -338,10 +510,10 @@ int gr_measure(const char *s)
     int n, l;
     wchar_t ch;
      if (!fnt)   fnt = gr_font;
-    l = utf8_mbtowc(&ch, s, strlen(s));
+    l = utf8_mbtowc(&ch, s, UTF8_MAX_LEN);
 	//fprintf(stdout, "unicode: %d\n", l);
 	if(l <= 0 ) return 0; 
-	n = fnt->cwidth[getCharID(s,NULL)];
+	n = fnt->cwidth[lookup_glyph(fnt, ch)];
     return n;
 }
 
@@ -353,9 +525,9 @@ void gr_font_size(int *x, int *y)
 
 int gr_text(int x, int y, const char *s, int bold)
 {
-    GGLContext *gl = gr_context;
     GRFont *gfont = NULL;
-    unsigned off, width, height, n;
+    unsigned off, width, height;
+    int n;
     wchar_t ch;
 
     /* Handle default font */
@@ -364,31 +536,31 @@ int gr_text(int x, int y, const char *s, int bold)
     y += overscan_offset_y;
     y -= gfont->ascent;
     // fprintf(stderr, "gr_text: x=%d,y=%d,w=%s\n", x, y, s);
-    gl->texEnvi(gl, GGL_TEXTURE_ENV, GGL_TEXTURE_ENV_MODE, GGL_REPLACE);
-    gl->texGeni(gl, GGL_S, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
-    gl->texGeni(gl, GGL_T, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
-    gl->enable(gl, GGL_TEXTURE_2D);
 
     while(*s) {
         if(*((unsigned char*)(s)) < 0x20) {
             s++;
             continue;
         }
-		off = getCharID(s,NULL);
-        n = utf8_mbtowc(&ch, s, strlen(s));
+        /* decode each character once, without rescanning the string */
+        n = utf8_mbtowc(&ch, s, UTF8_MAX_LEN);
         if(n <= 0)
             break;
         s += n;
+		off = lookup_glyph(gfont, ch);
 		width = gfont->cwidth[off];
 		height = gfont->cheight[off];
-        memcpy(&font_ftex, &gfont->texture, sizeof(font_ftex));
-        font_ftex.width = width;
-        font_ftex.height = height;
-        font_ftex.stride = width;
-        font_ftex.data = gfont->fontdata[off];
-        gl->bindTexture(gl, &font_ftex);
-	    gl->texCoord2i(gl, 0 - x, 0 - y);
-        gl->recti(gl, x, y, x + width, y + height);
+        /* glyphs outside the clip rectangle are skipped */
+        GRRect r = { x, y, x + width, y + height };
+        if (gr_damage_rect(&r)) {
+            memcpy(&font_ftex, &gfont->texture, sizeof(font_ftex));
+            font_ftex.width = width;
+            font_ftex.height = height;
+            font_ftex.stride = width;
+            font_ftex.data = gfont->fontdata[off];
+            blit_mask(&gr_mem_surface, &font_ftex, r.x1 - x, r.y1 - y,
+                      r.x1, r.y1, r.x2, r.y2, &gr_blit_color);
+        }
         x += width;
     }
 
@@ -404,6 +576,14 @@ void gr_texticon(int x, int y, gr_surface icon) {
     x += overscan_offset_x;
     y += overscan_offset_y;
 
+    GRRect r = { x, y, x + gr_get_width(icon), y + gr_get_height(icon) };
+    if (!gr_damage_rect(&r))
+        return;
+    if (blit_image(&gr_mem_surface, (GGLSurface*) icon, r.x1 - x, r.y1 - y,
+                   r.x1, r.y1, r.x2, r.y2) == 0)
+        return;
+
+    /* a texture format the software blitter doesn't know */
     gl->bindTexture(gl, (GGLSurface*) icon);
     gl->texEnvi(gl, GGL_TEXTURE_ENV, GGL_TEXTURE_ENV_MODE, GGL_REPLACE);
     gl->texGeni(gl, GGL_S, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
@@ -425,9 +605,11 @@ void gr_fill(int x1, int y1, int x2, int y2)
     x2 += overscan_offset_x;
     y2 += overscan_offset_y;
 
-    GGLContext *gl = gr_context;
-    gl->disable(gl, GGL_TEXTURE_2D);
-    gl->recti(gl, x1, y1, x2, y2);
+    GRRect r = { x1, y1, x2, y2 };
+    if (!gr_damage_rect(&r))
+        return;
+
+    blit_fill(&gr_mem_surface, r.x1, r.y1, r.x2, r.y2, &gr_blit_color);
 }
 
 void gr_blit(gr_surface source, int sx, int sy, int w, int h, int dx, int dy) {
@@ -439,6 +621,14 @@ void gr_blit(gr_surface source, int sx, int sy, int w, int h, int dx, int dy) {
     dx += overscan_offset_x;
     dy += overscan_offset_y;
 
+    GRRect r = { dx, dy, dx + w, dy + h };
+    if (!gr_damage_rect(&r))
+        return;
+    if (blit_image(&gr_mem_surface, (GGLSurface*) source,
+                   sx + r.x1 - dx, sy + r.y1 - dy, r.x1, r.y1, r.x2, r.y2) == 0)
+        return;
+
+    /* a texture format the software blitter doesn't know */
     gl->bindTexture(gl, (GGLSurface*) source);
     gl->texEnvi(gl, GGL_TEXTURE_ENV, GGL_TEXTURE_ENV_MODE, GGL_REPLACE);
     gl->texGeni(gl, GGL_S, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
@@ -516,6 +706,7 @@ static void gr_init_font(void)
     gr_font->cwidth = width;
     gr_font->cheight = height;
     gr_font->fontdata = font_data;
+    build_glyph_pages(gr_font);
     gr_font->ascent = font.cheight;
     //gr_font->ascent = 0;
 }
@@ -545,6 +736,10 @@ int gr_init(void)
 
     get_memory_surface(&gr_mem_surface);
 
+    /* the first flip has to fill both framebuffers */
+    set_full_damage(&gr_damage);
+    set_full_damage(&gr_prev_damage);
+
     fprintf(stderr, "framebuffer: fd %d (%d x %d)\n",
             gr_fb_fd, gr_framebuffer[0].width, gr_framebuffer[0].height);
 
@@ -28,6 +28,8 @@ void gr_exit(void);
 int gr_fb_width(void);
 int gr_fb_height(void);
 gr_pixel *gr_fb_data(void);
+// Copies to the display only the rows drawn on since the last flip,
+// and does nothing if nothing was drawn.
 void gr_flip(void);
 void gr_fb_blank(bool blank);
 
@@ -37,6 +39,13 @@ int gr_text(int x, int y, const char *s, int bold);
 int gr_measure(const char *s);
 void gr_font_size(int *x, int *y);
 
+// Limit drawing to the given rectangle (same coordinates as gr_fill)
+// until gr_clear_clip(), so part of the screen can be redrawn by
+// repeating the full sequence of drawing calls.  BOARD_CUSTOM_GRAPHICS
+// backends may leave these out; callers must then redraw everything.
+void gr_set_clip(int x, int y, int w, int h);
+void gr_clear_clip(void);
+
 void gr_blit(gr_surface source, int sx, int sy, int w, int h, int dx, int dy);
 unsigned int gr_get_width(gr_surface surface);
 unsigned int gr_get_height(gr_surface surface);
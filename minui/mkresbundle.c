@@ -0,0 +1,217 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Host tool: decode the recovery PNGs once at build time and write
+ * them out as a resource bundle (see resbundle.h).
+ *
+ *   mkresbundle <output> <image.png>...
+ *
+ * Images the PNG loader in resources.c wouldn't accept either are left
+ * out with a warning; recovery then falls back to (and fails on) the
+ * PNG itself, just as it did without a bundle.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <png.h>
+#include <zlib.h>
+
+#include "resbundle.h"
+
+typedef struct {
+    ResBundleEntry entry;
+    unsigned char* pixels;
+} Image;
+
+/* crc32 of everything left in 'fp' */
+static int file_crc32(FILE* fp, uint32_t* crc)
+{
+    unsigned char buffer[4096];
+    uLong c = crc32(0L, Z_NULL, 0);
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), fp)) > 0)
+        c = crc32(c, buffer, n);
+    if (ferror(fp))
+        return -1;
+    *crc = c;
+    return 0;
+}
+
+static int decode_png(const char* path, Image* image)
+{
+    unsigned char header[8];
+    png_structp png_ptr = NULL;
+    png_infop info_ptr = NULL;
+    int result = -1;
+    uint32_t crc;
+
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL || file_crc32(fp, &crc) < 0) {
+        fprintf(stderr, "mkresbundle: can't read %s\n", path);
+        goto exit;
+    }
+    rewind(fp);
+    if (fread(header, 1, sizeof(header), fp) != sizeof(header) ||
+        png_sig_cmp(header, 0, sizeof(header))) {
+        fprintf(stderr, "mkresbundle: %s is not a PNG\n", path);
+        goto exit;
+    }
+
+    png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (png_ptr == NULL)
+        goto exit;
+    info_ptr = png_create_info_struct(png_ptr);
+    if (info_ptr == NULL)
+        goto exit;
+    if (setjmp(png_jmpbuf(png_ptr))) {
+        fprintf(stderr, "mkresbundle: error decoding %s\n", path);
+        goto exit;
+    }
+
+    png_init_io(png_ptr, fp);
+    png_set_sig_bytes(png_ptr, sizeof(header));
+    png_read_info(png_ptr, info_ptr);
+
+    png_uint_32 width = png_get_image_width(png_ptr, info_ptr);
+    png_uint_32 height = png_get_image_height(png_ptr, info_ptr);
+    int color_type = png_get_color_type(png_ptr, info_ptr);
+    int bit_depth = png_get_bit_depth(png_ptr, info_ptr);
+    int channels = png_get_channels(png_ptr, info_ptr);
+
+    /* the same formats res_create_surface() takes */
+    if (!(bit_depth == 8 &&
+          ((channels == 3 && color_type == PNG_COLOR_TYPE_RGB) ||
+           (channels == 4 && color_type == PNG_COLOR_TYPE_RGBA) ||
+           (channels == 1 && color_type == PNG_COLOR_TYPE_PALETTE)))) {
+        fprintf(stderr, "mkresbundle: %s: unsupported PNG format, skipped\n", path);
+        goto exit;
+    }
+
+    if (color_type == PNG_COLOR_TYPE_PALETTE)
+        png_set_palette_to_rgb(png_ptr);
+    if (png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS))
+        png_set_tRNS_to_alpha(png_ptr);
+    png_read_update_info(png_ptr, info_ptr);
+    int out_channels = png_get_channels(png_ptr, info_ptr);
+
+    size_t stride = 4 * width;
+    image->pixels = malloc(stride * height);
+    if (image->pixels == NULL)
+        goto exit;
+
+    png_uint_32 y;
+    for (y = 0; y < height; ++y) {
+        unsigned char* pRow = image->pixels + y * stride;
+        png_read_row(png_ptr, pRow, NULL);
+        if (out_channels == 3) {
+            int x;
+            for (x = width - 1; x >= 0; x--) {
+                pRow[x * 4 + 3] = 0xff;
+                pRow[x * 4 + 2] = pRow[x * 3 + 2];
+                pRow[x * 4 + 1] = pRow[x * 3 + 1];
+                pRow[x * 4    ] = pRow[x * 3    ];
+            }
+        }
+    }
+
+    image->entry.png_crc = crc;
+    image->entry.width = width;
+    image->entry.height = height;
+    image->entry.format = (channels == 3) ? RES_BUNDLE_RGBX : RES_BUNDLE_RGBA;
+    result = 0;
+
+exit:
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    if (fp != NULL)
+        fclose(fp);
+    return result;
+}
+
+static int compare_images(const void* a, const void* b)
+{
+    return strcmp(((const Image*) a)->entry.name, ((const Image*) b)->entry.name);
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <output> <image.png>...\n", argv[0]);
+        return 1;
+    }
+
+    Image* images = calloc(argc, sizeof(Image));
+    int count = 0;
+    int i;
+    for (i = 2; i < argc; ++i) {
+        Image* image = &images[count];
+        const char* base = strrchr(argv[i], '/');
+        base = base ? base + 1 : argv[i];
+        size_t len = strlen(base);
+        if (len > 4 && strcmp(base + len - 4, ".png") == 0)
+            len -= 4;
+        if (len >= RES_BUNDLE_NAME_MAX) {
+            fprintf(stderr, "mkresbundle: %s: name too long, skipped\n", argv[i]);
+            continue;
+        }
+        memcpy(image->entry.name, base, len);
+        if (decode_png(argv[i], image) == 0)
+            count++;
+        else
+            memset(image, 0, sizeof(*image));
+    }
+
+    /* sorted, so the loader can bsearch() the index */
+    qsort(images, count, sizeof(Image), compare_images);
+
+    uint32_t offset = sizeof(ResBundleHeader) + count * sizeof(ResBundleEntry);
+    for (i = 0; i < count; ++i) {
+        offset = (offset + RES_BUNDLE_ALIGN - 1) & ~(RES_BUNDLE_ALIGN - 1);
+        images[i].entry.offset = offset;
+        offset += images[i].entry.width * images[i].entry.height * 4;
+    }
+
+    FILE* out = fopen(argv[1], "wb");
+    if (out == NULL) {
+        fprintf(stderr, "mkresbundle: can't create %s\n", argv[1]);
+        return 1;
+    }
+
+    ResBundleHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, RES_BUNDLE_MAGIC, sizeof(header.magic));
+    header.version = RES_BUNDLE_VERSION;
+    header.count = count;
+    fwrite(&header, sizeof(header), 1, out);
+    for (i = 0; i < count; ++i)
+        fwrite(&images[i].entry, sizeof(ResBundleEntry), 1, out);
+    for (i = 0; i < count; ++i) {
+        static const unsigned char zeros[RES_BUNDLE_ALIGN];
+        fwrite(zeros, 1, images[i].entry.offset - ftell(out), out);
+        fwrite(images[i].pixels, 4, images[i].entry.width * images[i].entry.height, out);
+        free(images[i].pixels);
+    }
+
+    if (ferror(out) | fclose(out)) {
+        fprintf(stderr, "mkresbundle: error writing %s\n", argv[1]);
+        unlink(argv[1]);
+        return 1;
+    }
+    free(images);
+    return 0;
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MINUI_RESBUNDLE_H_
+#define _MINUI_RESBUNDLE_H_
+
+#include <stdint.h>
+
+/* Layout of the resource bundle mkresbundle writes at build time and
+ * res_create_surface() maps at run time, so that the recovery images
+ * don't have to be decoded from PNG on every boot.
+ *
+ * The file is a header, then 'count' entries sorted by name, then the
+ * pixels of each image.  Pixels are stored exactly as the PNG loader
+ * hands them out: 4 bytes per pixel in r, g, b, a order, 'width'
+ * pixels per row, each image starting on a RES_BUNDLE_ALIGN boundary.
+ * All integers are little-endian, like every target recovery runs on.
+ */
+
+#define RES_BUNDLE_PATH     "/res/images.bundle"
+#define RES_BUNDLE_MAGIC    "MINUIRES"
+#define RES_BUNDLE_VERSION  2
+#define RES_BUNDLE_ALIGN    16
+#define RES_BUNDLE_NAME_MAX 48
+
+/* values of ResBundleEntry.format */
+#define RES_BUNDLE_RGBX     0   /* alpha is always 0xff */
+#define RES_BUNDLE_RGBA     1
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+} ResBundleHeader;
+
+typedef struct {
+    char name[RES_BUNDLE_NAME_MAX];     /* without .png, NUL-terminated */
+    uint32_t png_crc;       /* crc32 of the PNG this was made from */
+    uint32_t width;
+    uint32_t height;
+    uint32_t format;
+    uint32_t offset;        /* of the pixels, from the start of the file */
+    uint32_t reserved;
+} ResBundleEntry;
+
+#endif
@@ -15,6 +15,7 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <fcntl.h>
@@ -22,6 +23,7 @@
 
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 
 #include <linux/fb.h>
@@ -30,8 +32,10 @@
 #include <pixelflinger/pixelflinger.h>
 
 #include <png.h>
+#include <zlib.h>
 
 #include "minui.h"
+#include "resbundle.h"
 
 // libpng gives "undefined reference to 'pow'" errors, and I have no
 // idea how to convince the build system to link with -lm.  We don't
@@ -41,6 +45,119 @@ double pow(double x, double y) {
     return x;
 }
 
+// The pre-decoded images from RES_BUNDLE_PATH, mapped on first use
+// and left mapped; surfaces made from it point straight into the map.
+static struct {
+    int tried;
+    const unsigned char* base;
+    size_t size;
+    const ResBundleEntry* entries;
+    uint32_t count;
+} gBundle;
+
+static void open_bundle(void) {
+    gBundle.tried = 1;
+
+    int fd = open(RES_BUNDLE_PATH, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(ResBundleHeader)) {
+        close(fd);
+        return;
+    }
+    void* base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "can't map %s\n", RES_BUNDLE_PATH);
+        return;
+    }
+
+    const ResBundleHeader* header = (const ResBundleHeader*) base;
+    if (memcmp(header->magic, RES_BUNDLE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != RES_BUNDLE_VERSION ||
+        header->count > (st.st_size - sizeof(ResBundleHeader)) / sizeof(ResBundleEntry)) {
+        fprintf(stderr, "%s is not a resource bundle; using PNGs\n", RES_BUNDLE_PATH);
+        munmap(base, st.st_size);
+        return;
+    }
+
+    gBundle.base = (const unsigned char*) base;
+    gBundle.size = st.st_size;
+    gBundle.entries = (const ResBundleEntry*) (header + 1);
+    gBundle.count = header->count;
+}
+
+// crc32 of the file at 'path'; returns -1 if it can't be read.
+static int file_crc32(const char* path, uint32_t* crc) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    unsigned char buffer[4096];
+    uLong c = crc32(0L, Z_NULL, 0);
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+        c = crc32(c, buffer, n);
+    }
+    close(fd);
+    if (n < 0) {
+        return -1;
+    }
+    *crc = c;
+    return 0;
+}
+
+static int compare_entry(const void* name, const void* entry) {
+    return strncmp((const char*) name, ((const ResBundleEntry*) entry)->name,
+                   RES_BUNDLE_NAME_MAX);
+}
+
+// Make a surface for 'name' out of the bundle.  Returns 0 if it isn't
+// there (or is stale, when the PNG next to it isn't the one it was made
+// from), in which case the caller decodes the PNG instead.
+static int bundle_surface(const char* name, const char* pngPath, gr_surface* pSurface) {
+    if (!gBundle.tried) {
+        open_bundle();
+    }
+    if (gBundle.base == NULL) {
+        return 0;
+    }
+
+    const ResBundleEntry* entry = bsearch(name, gBundle.entries, gBundle.count,
+                                          sizeof(ResBundleEntry), compare_entry);
+    if (entry == NULL) {
+        return 0;
+    }
+    size_t pixelSize = (size_t) entry->width * entry->height * 4;
+    if (entry->offset > gBundle.size || pixelSize > gBundle.size - entry->offset) {
+        return 0;
+    }
+    // A device tree that overrides an image leaves a different PNG
+    // behind; don't show the stale copy.  Checksumming the PNG is still
+    // far cheaper than decoding it.
+    uint32_t crc;
+    if (file_crc32(pngPath, &crc) == 0 && crc != entry->png_crc) {
+        return 0;
+    }
+
+    GGLSurface* surface = malloc(sizeof(GGLSurface));
+    if (surface == NULL) {
+        return 0;
+    }
+    surface->version = sizeof(GGLSurface);
+    surface->width = entry->width;
+    surface->height = entry->height;
+    surface->stride = entry->width; /* Yes, pixels, not bytes */
+    surface->data = (GGLubyte*) (gBundle.base + entry->offset);
+    surface->format = (entry->format == RES_BUNDLE_RGBX) ?
+            GGL_PIXEL_FORMAT_RGBX_8888 : GGL_PIXEL_FORMAT_RGBA_8888;
+
+    *pSurface = (gr_surface) surface;
+    return 1;
+}
+
 int res_create_surface(const char* name, gr_surface* pSurface) {
     char resPath[256];
     GGLSurface* surface = NULL;
@@ -53,6 +170,10 @@ int res_create_surface(const char* name, gr_surface* pSurface) {
 
     snprintf(resPath, sizeof(resPath)-1, "/res/images/%s.png", name);
     resPath[sizeof(resPath)-1] = '\0';
+    if (bundle_surface(name, resPath, pSurface)) {
+        return 0;
+    }
+
     FILE* fp = fopen(resPath, "rb");
     if (fp == NULL) {
         result = -1;
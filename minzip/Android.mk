@@ -6,6 +6,7 @@ LOCAL_SRC_FILES := \
 	SysUtil.c \
 	DirUtil.c \
 	Inlines.c \
+	LabelCache.c \
 	Zip.c
 
 LOCAL_C_INCLUDES := \
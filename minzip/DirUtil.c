@@ -25,6 +25,7 @@
 #include <limits.h>
 
 #include "DirUtil.h"
+#include "LabelCache.h"
 
 typedef enum { DMISSING, DDIR, DILLEGAL } DirStatus;
 
@@ -148,7 +149,7 @@ dirCreateHierarchy(const char *path, int mode,
             char *secontext = NULL;
 
             if (sehnd) {
-                selabel_lookup(sehnd, &secontext, cpath, mode);
+                labelLookup(sehnd, &secontext, cpath, mode);
                 setfscreatecon(secontext);
             }
 
@@ -0,0 +1,387 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Per-directory cache of SELinux file labels.
+ *
+ * selabel_lookup() runs the file_contexts regexes against every path,
+ * but when a package extracts thousands of files into a handful of
+ * directories almost all of them come out with their directory's
+ * default label.  Each spec's literal prefix (the part of the regex
+ * before the first metacharacter) tells us which entries of a
+ * directory it can single out:
+ *
+ *   /system/bin/foo         only "foo"
+ *   /system/bin/foo(/.*)?   only "foo" (and things under it)
+ *   /system/bin/foo.*       any entry whose name starts with "foo"
+ *   /system(/.*)?           everything in /system/bin alike
+ *   /system/.*\.so          can't tell; no caching in /system/bin
+ *
+ * Entries not singled out by any spec all get the same label, so one
+ * real lookup per (directory, mode) answers for all of them.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOG_TAG "minzip"
+#include "Log.h"
+#include "Hash.h"
+#include "LabelCache.h"
+
+typedef enum {
+    SPEC_EXACT,         /* no metacharacters at all */
+    SPEC_SUBTREE,       /* prefix(/.*)? and friends */
+    SPEC_REGEX,         /* anything else */
+} SpecKind;
+
+typedef struct {
+    char*       prefix;
+    size_t      prefixLen;
+    SpecKind    kind;
+} LabelSpec;
+
+/* A name (or, with isPrefix, any name starting with it) that some
+ * spec treats differently from the rest of its directory.
+ */
+typedef struct {
+    const char* name;
+    size_t      nameLen;
+    bool        isPrefix;
+} SpecialName;
+
+#define MAX_CACHED_MODES 4
+
+typedef struct {
+    int         mode;
+    int         ret;
+    int         err;
+    char*       con;
+} CachedLabel;
+
+typedef struct {
+    char*       dir;
+    size_t      dirLen;
+    bool        uncacheable;    /* some regex could match any entry */
+    SpecialName* special;
+    int         numSpecial;
+    CachedLabel labels[MAX_CACHED_MODES];
+    int         numLabels;
+} DirLabels;
+
+static struct {
+    struct selabel_handle* sehnd;
+    LabelSpec*  specs;
+    int         numSpecs;
+    HashTable*  dirs;
+    unsigned int hits;
+    unsigned int misses;
+} gCache;
+
+static const char* kSubtreeSuffixes[] = { "(/.*)?", "(/.*)", "/.*" };
+
+static void addSpec(const char* regex, size_t len)
+{
+    size_t prefixLen = strcspn(regex, ".^$?*+|[](){}\\");
+    if (prefixLen > len) prefixLen = len;
+
+    SpecKind kind = SPEC_REGEX;
+    if (prefixLen == len) {
+        kind = SPEC_EXACT;
+    } else if (strchr("?*{", regex[prefixLen]) != NULL) {
+        /* The quantifier applies to the last literal, which may then
+         * be absent: "/system/bin/sux?" matches "su" too.
+         */
+        if (prefixLen > 0) prefixLen--;
+    } else {
+        unsigned int i;
+        for (i = 0; i < sizeof(kSubtreeSuffixes)/sizeof(kSubtreeSuffixes[0]); i++) {
+            const char* suffix = kSubtreeSuffixes[i];
+            if (len - prefixLen == strlen(suffix) &&
+                memcmp(regex + prefixLen, suffix, len - prefixLen) == 0) {
+                kind = SPEC_SUBTREE;
+                break;
+            }
+        }
+    }
+
+    LabelSpec* spec = &gCache.specs[gCache.numSpecs++];
+    spec->prefix = (char*) malloc(prefixLen + 1);
+    memcpy(spec->prefix, regex, prefixLen);
+    spec->prefix[prefixLen] = '\0';
+    spec->prefixLen = prefixLen;
+    spec->kind = kind;
+}
+
+static void freeDirLabels(void* data)
+{
+    DirLabels* pDir = (DirLabels*) data;
+    int i;
+    for (i = 0; i < pDir->numLabels; i++) {
+        free(pDir->labels[i].con);
+    }
+    free(pDir->special);
+    free(pDir->dir);
+    free(pDir);
+}
+
+/*
+ * (This is a mzHashTableLookup callback.)
+ *
+ * Compare two DirLabels structs, by directory.
+ */
+static int hashcmpDirLabels(const void* vdir1, const void* vdir2)
+{
+    const DirLabels* dir1 = (const DirLabels*) vdir1;
+    const DirLabels* dir2 = (const DirLabels*) vdir2;
+
+    if (dir1->dirLen != dir2->dirLen)
+        return dir1->dirLen - dir2->dirLen;
+    return memcmp(dir1->dir, dir2->dir, dir1->dirLen);
+}
+
+static unsigned int computeDirHash(const char* dir, size_t dirLen)
+{
+    unsigned int hash = 2;
+
+    while (dirLen--)
+        hash = hash * 31 + *dir++;
+
+    return hash;
+}
+
+/*
+ * Work out which entries of "dir" (dirLen bytes, no trailing slash)
+ * the specs single out.
+ */
+static void classifyDir(DirLabels* pDir)
+{
+    const char* dir = pDir->dir;
+    size_t dirLen = pDir->dirLen;
+    int i;
+
+    for (i = 0; i < gCache.numSpecs; i++) {
+        const LabelSpec* spec = &gCache.specs[i];
+        const char* p = spec->prefix;
+        size_t n = spec->prefixLen;
+
+        if (n > dirLen && memcmp(p, dir, dirLen) == 0 && p[dirLen] == '/') {
+            /* The spec starts inside dir.  It only matters here if it
+             * can match an entry directly in dir.
+             */
+            const char* name = p + dirLen + 1;
+            size_t nameLen = n - dirLen - 1;
+            if (memchr(name, '/', nameLen) != NULL) {
+                continue;
+            }
+            bool isPrefix = (spec->kind == SPEC_REGEX);
+            if (isPrefix && nameLen == 0) {
+                pDir->uncacheable = true;
+                return;
+            }
+            SpecialName* special = &pDir->special[pDir->numSpecial++];
+            special->name = name;
+            special->nameLen = nameLen;
+            special->isPrefix = isPrefix;
+        } else if (spec->kind == SPEC_REGEX && n <= dirLen &&
+                memcmp(p, dir, n) == 0) {
+            /* A regex whose fixed part ends above dir; it might pick
+             * out any of dir's entries.
+             */
+            pDir->uncacheable = true;
+            return;
+        }
+    }
+}
+
+static DirLabels* findDir(const char* dir, size_t dirLen)
+{
+    DirLabels key;
+    key.dir = (char*) dir;
+    key.dirLen = dirLen;
+    unsigned int hash = computeDirHash(dir, dirLen);
+
+    DirLabels* pDir = (DirLabels*) mzHashTableLookup(gCache.dirs, hash, &key,
+            hashcmpDirLabels, false);
+    if (pDir != NULL) {
+        return pDir;
+    }
+
+    pDir = (DirLabels*) calloc(1, sizeof(DirLabels));
+    if (pDir == NULL) {
+        return NULL;
+    }
+    pDir->dir = (char*) malloc(dirLen + 1);
+    pDir->special = (SpecialName*) malloc(gCache.numSpecs * sizeof(SpecialName));
+    if (pDir->dir == NULL || (pDir->special == NULL && gCache.numSpecs > 0)) {
+        freeDirLabels(pDir);
+        return NULL;
+    }
+    memcpy(pDir->dir, dir, dirLen);
+    pDir->dir[dirLen] = '\0';
+    pDir->dirLen = dirLen;
+    classifyDir(pDir);
+    /* only a few specs ever apply to one directory */
+    if (pDir->numSpecial == 0) {
+        free(pDir->special);
+        pDir->special = NULL;
+    } else if (pDir->numSpecial < gCache.numSpecs) {
+        SpecialName* special = (SpecialName*) realloc(pDir->special,
+                pDir->numSpecial * sizeof(SpecialName));
+        if (special != NULL) {
+            pDir->special = special;
+        }
+    }
+
+    mzHashTableLookup(gCache.dirs, hash, pDir, hashcmpDirLabels, true);
+    return pDir;
+}
+
+static bool isSpecial(const DirLabels* pDir, const char* name)
+{
+    size_t nameLen = strlen(name);
+    int i;
+
+    for (i = 0; i < pDir->numSpecial; i++) {
+        const SpecialName* special = &pDir->special[i];
+        if (special->isPrefix ? nameLen >= special->nameLen
+                              : nameLen == special->nameLen) {
+            if (memcmp(name, special->name, special->nameLen) == 0) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+bool labelCacheInit(struct selabel_handle *sehnd, const char *fileContexts)
+{
+    labelCacheFree();
+    if (sehnd == NULL) {
+        return false;
+    }
+
+    FILE* fp = fopen(fileContexts, "r");
+    if (fp == NULL) {
+        LOGW("Can't open %s for the label cache: %s\n",
+                fileContexts, strerror(errno));
+        return false;
+    }
+
+    int capacity = 256;
+    gCache.specs = (LabelSpec*) malloc(capacity * sizeof(LabelSpec));
+    char line[1024];
+    while (gCache.specs != NULL && fgets(line, sizeof(line), fp) != NULL) {
+        char* regex = line + strspn(line, " \t");
+        size_t len = strcspn(regex, " \t\r\n");
+        if (len == 0 || regex[0] == '#') {
+            continue;
+        }
+        if (gCache.numSpecs == capacity) {
+            capacity *= 2;
+            LabelSpec* specs = (LabelSpec*) realloc(gCache.specs,
+                    capacity * sizeof(LabelSpec));
+            if (specs == NULL) {
+                break;
+            }
+            gCache.specs = specs;
+        }
+        regex[len] = '\0';
+        addSpec(regex, len);
+    }
+    fclose(fp);
+
+    gCache.dirs = mzHashTableCreate(64, freeDirLabels);
+    if (gCache.specs == NULL || gCache.dirs == NULL) {
+        labelCacheFree();
+        return false;
+    }
+    gCache.sehnd = sehnd;
+    LOGI("Label cache: %d specs from %s\n", gCache.numSpecs, fileContexts);
+    return true;
+}
+
+void labelCacheFree(void)
+{
+    int i;
+    if (gCache.dirs != NULL) {
+        mzHashTableFree(gCache.dirs);
+    }
+    for (i = 0; i < gCache.numSpecs; i++) {
+        free(gCache.specs[i].prefix);
+    }
+    free(gCache.specs);
+    memset(&gCache, 0, sizeof(gCache));
+}
+
+int labelLookup(struct selabel_handle *sehnd, char **con,
+        const char *path, int mode)
+{
+    const char* slash = strrchr(path, '/');
+    if (gCache.dirs == NULL || sehnd != gCache.sehnd || slash == NULL) {
+        return selabel_lookup(sehnd, con, path, mode);
+    }
+
+    DirLabels* pDir = findDir(path, slash - path);
+    if (pDir == NULL || pDir->uncacheable || isSpecial(pDir, slash + 1)) {
+        gCache.misses++;
+        return selabel_lookup(sehnd, con, path, mode);
+    }
+
+    int i;
+    for (i = 0; i < pDir->numLabels; i++) {
+        CachedLabel* label = &pDir->labels[i];
+        if (label->mode == mode) {
+            gCache.hits++;
+            if (label->ret != 0) {
+                errno = label->err;
+                return label->ret;
+            }
+            *con = strdup(label->con);
+            if (*con == NULL) {
+                errno = ENOMEM;
+                return -1;
+            }
+            return 0;
+        }
+    }
+
+    gCache.misses++;
+    int ret = selabel_lookup(sehnd, con, path, mode);
+    if (pDir->numLabels < MAX_CACHED_MODES) {
+        CachedLabel* label = &pDir->labels[pDir->numLabels];
+        label->mode = mode;
+        label->ret = ret;
+        label->err = errno;
+        label->con = NULL;
+        if (ret == 0) {
+            label->con = strdup(*con);
+            if (label->con == NULL) {
+                return ret;
+            }
+        }
+        pDir->numLabels++;
+    }
+    return ret;
+}
+
+void labelCacheStats(unsigned int *hits, unsigned int *misses)
+{
+    *hits = gCache.hits;
+    *misses = gCache.misses;
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MINZIP_LABELCACHE_H_
+#define MINZIP_LABELCACHE_H_
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <selinux/selinux.h>
+#include <selinux/label.h>
+
+/* Read the path specs in fileContexts (the file sehnd was opened
+ * from) so that labelLookup() can reuse one selabel_lookup() result
+ * for all the entries of a directory whenever no spec tells those
+ * entries apart.  Without this, labelLookup() is plain
+ * selabel_lookup().
+ *
+ * Returns false (and leaves the cache off) if the file can't be read.
+ */
+bool labelCacheInit(struct selabel_handle *sehnd, const char *fileContexts);
+
+/* Drop the cache and the loaded specs.
+ */
+void labelCacheFree(void);
+
+/* Same contract as selabel_lookup(): on success *con is set to a
+ * context the caller must freecon(), and 0 is returned.
+ */
+int labelLookup(struct selabel_handle *sehnd, char **con,
+        const char *path, int mode);
+
+/* Lookups answered from the cache, and lookups that went to
+ * selabel_lookup(), since labelCacheInit().
+ */
+void labelCacheStats(unsigned int *hits, unsigned int *misses);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MINZIP_LABELCACHE_H_ */
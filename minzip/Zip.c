@@ -9,6 +9,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdint.h>     // for uintptr_t
 #include <stdlib.h>
 #include <sys/stat.h>   // for S_ISLNK()
@@ -19,6 +20,7 @@
 #include "Bits.h"
 #include "Log.h"
 #include "DirUtil.h"
+#include "LabelCache.h"
 
 #undef NDEBUG   // do this after including Log.h
 #include <assert.h>
@@ -413,6 +415,190 @@ bail:
     return result;
 }
 
+/*
+ * A parsed central directory, as written by mzWriteZipIndex().  The
+ * header identifies the file it was made from; the entries follow,
+ * in pEntries order, with names stored as offsets into the file.
+ */
+#define ZIP_INDEX_MAGIC "MZIDX01"
+
+typedef struct {
+    char        magic[8];
+    uint64_t    dev;
+    uint64_t    ino;
+    uint64_t    size;
+    int64_t     mtime;
+    uint32_t    numEntries;
+    uint32_t    entrySize;
+} ZipIndexHeader;
+
+typedef struct {
+    uint32_t    nameOffset;
+    uint32_t    fileNameLen;
+    uint32_t    offset;
+    uint32_t    compLen;
+    uint32_t    uncompLen;
+    uint32_t    modTime;
+    uint32_t    crc32;
+    uint32_t    externalFileAttributes;
+    uint16_t    compression;
+    uint16_t    versionMadeBy;
+} ZipIndexEntry;
+
+static void fillIndexHeader(ZipIndexHeader* pHeader, const struct stat* st,
+        unsigned int numEntries)
+{
+    memset(pHeader, 0, sizeof(*pHeader));
+    memcpy(pHeader->magic, ZIP_INDEX_MAGIC, sizeof(ZIP_INDEX_MAGIC));
+    pHeader->dev = st->st_dev;
+    pHeader->ino = st->st_ino;
+    pHeader->size = st->st_size;
+    pHeader->mtime = st->st_mtime;
+    pHeader->numEntries = numEntries;
+    pHeader->entrySize = sizeof(ZipIndexEntry);
+}
+
+static bool readFully(int fd, void* buf, size_t len, off_t offset)
+{
+    char* p = (char*) buf;
+    while (len > 0) {
+        ssize_t got = pread(fd, p, len, offset);
+        if (got <= 0) {
+            if (got < 0 && errno == EINTR)
+                continue;
+            return false;
+        }
+        p += got;
+        len -= got;
+        offset += got;
+    }
+    return true;
+}
+
+/*
+ * Fill in "pArchive" from an index instead of parsing the central
+ * directory.  Everything read from the index is bounds-checked against
+ * the mapping, but the local headers aren't touched, which is what
+ * makes this cheap on big archives: parsing has to fault in a page of
+ * the file for every entry.
+ *
+ * Returns "true" on success.
+ */
+static bool loadZipIndex(ZipArchive* pArchive, const MemMapping* pMap,
+        int indexFd)
+{
+    ZipIndexHeader header, expect;
+    ZipIndexEntry* records = NULL;
+    struct stat st;
+    unsigned int i;
+    bool result = false;
+
+    if (fstat(pArchive->fd, &st) != 0 ||
+        !readFully(indexFd, &header, sizeof(header), 0)) {
+        goto bail;
+    }
+    fillIndexHeader(&expect, &st, header.numEntries);
+    if (memcmp(&header, &expect, sizeof(header)) != 0 ||
+        header.numEntries == 0 || header.numEntries > 0xffff) {
+        LOGW("Zip index doesn't match archive; parsing instead\n");
+        goto bail;
+    }
+
+    records = (ZipIndexEntry*) malloc(header.numEntries * sizeof(ZipIndexEntry));
+    if (records == NULL ||
+        !readFully(indexFd, records, header.numEntries * sizeof(ZipIndexEntry),
+                   sizeof(header))) {
+        goto bail;
+    }
+
+    pArchive->numEntries = header.numEntries;
+    pArchive->pEntries = (ZipEntry*) calloc(header.numEntries, sizeof(ZipEntry));
+    pArchive->pHash = mzHashTableCreate(mzHashSize(header.numEntries), NULL);
+    if (pArchive->pEntries == NULL || pArchive->pHash == NULL)
+        goto bail;
+
+    for (i = 0; i < header.numEntries; i++) {
+        const ZipIndexEntry* rec = &records[i];
+        ZipEntry* pEntry = &pArchive->pEntries[i];
+
+        if ((size_t)rec->nameOffset + rec->fileNameLen > pMap->length ||
+            (size_t)rec->offset + rec->compLen > pMap->length ||
+            rec->offset + rec->compLen < rec->offset) {
+            LOGW("Bad zip index entry (at %d)\n", i);
+            goto bail;
+        }
+        pEntry->fileName = (const char*) pMap->addr + rec->nameOffset;
+        pEntry->fileNameLen = rec->fileNameLen;
+        if (!validFilename(pEntry->fileName, pEntry->fileNameLen)) {
+            LOGW("Invalid filename in zip index (at %d)\n", i);
+            goto bail;
+        }
+        pEntry->offset = rec->offset;
+        pEntry->compLen = rec->compLen;
+        pEntry->uncompLen = rec->uncompLen;
+        pEntry->compression = rec->compression;
+        pEntry->modTime = rec->modTime;
+        pEntry->crc32 = rec->crc32;
+        pEntry->versionMadeBy = rec->versionMadeBy;
+        pEntry->externalFileAttributes = rec->externalFileAttributes;
+
+        addEntryToHashTable(pArchive->pHash, pEntry);
+    }
+
+    result = true;
+
+bail:
+    free(records);
+    if (!result) {
+        free(pArchive->pEntries);
+        pArchive->pEntries = NULL;
+        pArchive->numEntries = 0;
+        mzHashTableFree(pArchive->pHash);
+        pArchive->pHash = NULL;
+    }
+    return result;
+}
+
+int mzWriteZipIndex(const ZipArchive* pArchive, int fd)
+{
+    ZipIndexHeader header;
+    ZipIndexEntry* records;
+    struct stat st;
+    unsigned int i;
+    int err = 0;
+
+    if (fstat(pArchive->fd, &st) != 0)
+        return errno;
+    fillIndexHeader(&header, &st, pArchive->numEntries);
+
+    records = (ZipIndexEntry*) calloc(pArchive->numEntries, sizeof(ZipIndexEntry));
+    if (records == NULL)
+        return ENOMEM;
+    for (i = 0; i < pArchive->numEntries; i++) {
+        const ZipEntry* pEntry = &pArchive->pEntries[i];
+        ZipIndexEntry* rec = &records[i];
+
+        rec->nameOffset = pEntry->fileName - (const char*) pArchive->map.addr;
+        rec->fileNameLen = pEntry->fileNameLen;
+        rec->offset = pEntry->offset;
+        rec->compLen = pEntry->compLen;
+        rec->uncompLen = pEntry->uncompLen;
+        rec->modTime = pEntry->modTime;
+        rec->crc32 = pEntry->crc32;
+        rec->externalFileAttributes = pEntry->externalFileAttributes;
+        rec->compression = pEntry->compression;
+        rec->versionMadeBy = pEntry->versionMadeBy;
+    }
+
+    size_t len = pArchive->numEntries * sizeof(ZipIndexEntry);
+    if (write(fd, &header, sizeof(header)) != (ssize_t) sizeof(header) ||
+        write(fd, records, len) != (ssize_t) len) {
+        err = errno ? errno : EIO;
+    }
+    free(records);
+    return err;
+}
+
 /*
  * Open a Zip archive and scan out the contents.
  *
@@ -425,9 +611,13 @@ bail:
  * we don't want to be too noisy about failures.  (Do we want a "quiet"
  * flag?)
  *
+ * If indexFd is not -1 it is tried first (see mzWriteZipIndex()); the
+ * central directory is only parsed if it doesn't describe this file.
+ *
  * On success, we fill out the contents of "pArchive".
  */
-int mzOpenZipArchive(const char* fileName, ZipArchive* pArchive)
+static int openZipArchive(const char* fileName, int indexFd,
+        ZipArchive* pArchive)
 {
     MemMapping map;
     int err;
@@ -456,7 +646,9 @@ int mzOpenZipArchive(const char* fileName, ZipArchive* pArchive)
         goto bail;
     }
 
-    if (!parseZipArchive(pArchive, &map)) {
+    if (indexFd >= 0 && loadZipIndex(pArchive, &map, indexFd)) {
+        LOGV("Loaded '%s' from index\n", fileName);
+    } else if (!parseZipArchive(pArchive, &map)) {
         err = -1;
         LOGV("Parsing '%s' failed\n", fileName);
         goto bail;
@@ -474,6 +666,17 @@ bail:
     return err;
 }
 
+int mzOpenZipArchive(const char* fileName, ZipArchive* pArchive)
+{
+    return openZipArchive(fileName, -1, pArchive);
+}
+
+int mzOpenZipArchiveWithIndex(const char* fileName, int indexFd,
+        ZipArchive* pArchive)
+{
+    return openZipArchive(fileName, indexFd, pArchive);
+}
+
 /*
  * Close a ZipArchive, closing the file and freeing the contents.
  *
@@ -522,68 +725,105 @@ bool mzIsZipEntrySymlink(const ZipEntry* pEntry)
     return false;
 }
 
+/*
+ * Size of the buffer that inflated data is collected in before it is
+ * handed to a ProcessZipEntryContentsFunction.  Larger chunks mean fewer
+ * callbacks (and fewer write() calls when extracting to a file).
+ */
+#define INFLATE_BUF_SIZE (256 * 1024)
+
+/*
+ * Return a pointer to the compressed data of an entry inside the
+ * archive mapping.  parseZipArchive() has already verified that
+ * [offset, offset + compLen) lies within the map.
+ */
+static const unsigned char* entryDataPtr(const ZipArchive *pArchive,
+    const ZipEntry *pEntry)
+{
+    return (const unsigned char*)pArchive->map.addr + pEntry->offset;
+}
+
 /* Call processFunction on the uncompressed data of a STORED entry.
+ *
+ * The data is already in the archive mapping, so hand it over in place
+ * instead of read()ing it into a bounce buffer.
  */
 static bool processStoredEntry(const ZipArchive *pArchive,
     const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
     void *cookie)
 {
+    const unsigned char* data = entryDataPtr(pArchive, pEntry);
     size_t bytesLeft = pEntry->compLen;
     while (bytesLeft > 0) {
-        unsigned char buf[32 * 1024];
-        ssize_t n;
-        size_t count;
-        bool ret;
-
-        count = bytesLeft;
-        if (count > sizeof(buf)) {
-            count = sizeof(buf);
-        }
-        n = read(pArchive->fd, buf, count);
-        if (n < 0 || (size_t)n != count) {
-            LOGE("Can't read %zu bytes from zip file: %ld\n", count, n);
-            return false;
+        size_t count = bytesLeft;
+        if (count > INT_MAX) {
+            count = INT_MAX;
         }
-        ret = processFunction(buf, n, cookie);
-        if (!ret) {
+        if (!processFunction(data, count, cookie)) {
             return false;
         }
+        data += count;
         bytesLeft -= count;
     }
     return true;
 }
 
-static bool processDeflatedEntry(const ZipArchive *pArchive,
-    const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
-    void *cookie)
-{
-    long result = -1;
-    unsigned char readBuf[32 * 1024];
-    unsigned char procBuf[32 * 1024];
+/*
+ * Inflate state that is kept around between entries, so that packages
+ * with thousands of small files don't pay for inflateInit2()/inflateEnd()
+ * and a fresh output buffer on every entry.  There is one per thread;
+ * it is released when the thread exits.
+ */
+typedef struct {
     z_stream zstream;
+    unsigned char* buf;
+    bool inUse;
+} Inflater;
+
+static pthread_key_t gInflaterKey;
+static pthread_once_t gInflaterOnce = PTHREAD_ONCE_INIT;
+
+static void freeInflater(void* arg)
+{
+    Inflater* pInflater = (Inflater*) arg;
+    if (pInflater != NULL) {
+        inflateEnd(&pInflater->zstream);
+        free(pInflater->buf);
+        free(pInflater);
+    }
+}
+
+static void createInflaterKey(void)
+{
+    pthread_key_create(&gInflaterKey, freeInflater);
+}
+
+static Inflater* createInflater(void)
+{
+    Inflater* pInflater;
     int zerr;
-    long compRemaining;
 
-    compRemaining = pEntry->compLen;
+    pInflater = (Inflater*) calloc(1, sizeof(Inflater));
+    if (pInflater == NULL) {
+        return NULL;
+    }
+    pInflater->buf = (unsigned char*) malloc(INFLATE_BUF_SIZE);
+    if (pInflater->buf == NULL) {
+        LOGE("Can't allocate %d bytes for inflate\n", INFLATE_BUF_SIZE);
+        free(pInflater);
+        return NULL;
+    }
 
-    /*
-     * Initialize the zlib stream.
-     */
-    memset(&zstream, 0, sizeof(zstream));
-    zstream.zalloc = Z_NULL;
-    zstream.zfree = Z_NULL;
-    zstream.opaque = Z_NULL;
-    zstream.next_in = NULL;
-    zstream.avail_in = 0;
-    zstream.next_out = (Bytef*) procBuf;
-    zstream.avail_out = sizeof(procBuf);
-    zstream.data_type = Z_UNKNOWN;
+    pInflater->zstream.zalloc = Z_NULL;
+    pInflater->zstream.zfree = Z_NULL;
+    pInflater->zstream.opaque = Z_NULL;
+    pInflater->zstream.data_type = Z_UNKNOWN;
 
     /*
      * Use the undocumented "negative window bits" feature to tell zlib
      * that there's no zlib header waiting for it.
      */
-    zerr = inflateInit2(&zstream, -MAX_WBITS);
+    zerr = inflateInit2(&pInflater->zstream, -MAX_WBITS);
     if (zerr != Z_OK) {
         if (zerr == Z_VERSION_ERROR) {
             LOGE("Installed zlib is not compatible with linked version (%s)\n",
@@ -591,44 +831,94 @@ static bool processDeflatedEntry(const ZipArchive *pArchive,
         } else {
             LOGE("Call to inflateInit2 failed (zerr=%d)\n", zerr);
         }
+        free(pInflater->buf);
+        free(pInflater);
+        return NULL;
+    }
+    return pInflater;
+}
+
+/*
+ * Get this thread's inflater, ready for a new stream.  If it is already
+ * busy (a process function extracting another entry), a private one is
+ * returned instead; releaseInflater() frees that one.
+ */
+static Inflater* acquireInflater(void)
+{
+    Inflater* pInflater;
+
+    pthread_once(&gInflaterOnce, createInflaterKey);
+    pInflater = (Inflater*) pthread_getspecific(gInflaterKey);
+    if (pInflater != NULL && pInflater->inUse) {
+        return createInflater();
+    }
+    if (pInflater != NULL && inflateReset(&pInflater->zstream) != Z_OK) {
+        pthread_setspecific(gInflaterKey, NULL);
+        freeInflater(pInflater);
+        pInflater = NULL;
+    }
+    if (pInflater == NULL) {
+        pInflater = createInflater();
+        if (pInflater == NULL) {
+            return NULL;
+        }
+        pthread_setspecific(gInflaterKey, pInflater);
+    }
+    pInflater->inUse = true;
+    return pInflater;
+}
+
+static void releaseInflater(Inflater* pInflater)
+{
+    if (pInflater == pthread_getspecific(gInflaterKey)) {
+        pInflater->inUse = false;
+    } else {
+        freeInflater(pInflater);
+    }
+}
+
+static bool processDeflatedEntry(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
+    void *cookie)
+{
+    long result = -1;
+    Inflater* pInflater;
+    unsigned char* procBuf;
+    z_stream* zstream;
+    int zerr;
+
+    pInflater = acquireInflater();
+    if (pInflater == NULL) {
         goto bail;
     }
+    procBuf = pInflater->buf;
+    zstream = &pInflater->zstream;
+
+    /*
+     * The compressed data is fed straight from the archive mapping, so
+     * there is no input buffer to refill.
+     */
+    zstream->next_in = (Bytef*) entryDataPtr(pArchive, pEntry);
+    zstream->avail_in = pEntry->compLen;
+    zstream->next_out = (Bytef*) procBuf;
+    zstream->avail_out = INFLATE_BUF_SIZE;
 
     /*
      * Loop while we have data.
      */
     do {
-        /* read as much as we can */
-        if (zstream.avail_in == 0) {
-            long getSize = (compRemaining > (long)sizeof(readBuf)) ?
-                        (long)sizeof(readBuf) : compRemaining;
-            LOGVV("+++ reading %ld bytes (%ld left)\n",
-                getSize, compRemaining);
-
-            int cc = read(pArchive->fd, readBuf, getSize);
-            if (cc != (int) getSize) {
-                LOGW("inflate read failed (%d vs %ld)\n", cc, getSize);
-                goto z_bail;
-            }
-
-            compRemaining -= getSize;
-
-            zstream.next_in = readBuf;
-            zstream.avail_in = getSize;
-        }
-
         /* uncompress the data */
-        zerr = inflate(&zstream, Z_NO_FLUSH);
+        zerr = inflate(zstream, Z_NO_FLUSH);
         if (zerr != Z_OK && zerr != Z_STREAM_END) {
             LOGD("zlib inflate call failed (zerr=%d)\n", zerr);
             goto z_bail;
         }
 
         /* write when we're full or when we're done */
-        if (zstream.avail_out == 0 ||
-            (zerr == Z_STREAM_END && zstream.avail_out != sizeof(procBuf)))
+        if (zstream->avail_out == 0 ||
+            (zerr == Z_STREAM_END && zstream->avail_out != INFLATE_BUF_SIZE))
         {
-            long procSize = zstream.next_out - procBuf;
+            long procSize = zstream->next_out - procBuf;
             LOGVV("+++ processing %d bytes\n", (int) procSize);
             bool ret = processFunction(procBuf, procSize, cookie);
             if (!ret) {
@@ -636,18 +926,18 @@ static bool processDeflatedEntry(const ZipArchive *pArchive,
                 goto z_bail;
             }
 
-            zstream.next_out = procBuf;
-            zstream.avail_out = sizeof(procBuf);
+            zstream->next_out = procBuf;
+            zstream->avail_out = INFLATE_BUF_SIZE;
         }
     } while (zerr == Z_OK);
 
     assert(zerr == Z_STREAM_END);       /* other errors should've been caught */
 
     // success!
-    result = zstream.total_out;
+    result = zstream->total_out;
 
 z_bail:
-    inflateEnd(&zstream);        /* free up any allocated structures */
+    releaseInflater(pInflater);
 
 bail:
     if (result != pEntry->uncompLen) {
@@ -674,13 +964,6 @@ bool mzProcessZipEntryContents(const ZipArchive *pArchive,
     void *cookie)
 {
     bool ret = false;
-    off_t oldOff;
-
-    /* save current offset */
-    oldOff = lseek(pArchive->fd, 0, SEEK_CUR);
-
-    /* Seek to the beginning of the entry's compressed data. */
-    lseek(pArchive->fd, pEntry->offset, SEEK_SET);
 
     switch (pEntry->compression) {
     case STORED:
@@ -695,8 +978,6 @@ bool mzProcessZipEntryContents(const ZipArchive *pArchive,
         break;
     }
 
-    /* restore file offset */
-    lseek(pArchive->fd, oldOff, SEEK_SET);
     return ret;
 }
 
@@ -797,10 +1078,29 @@ static bool writeProcessFunction(const unsigned char *data, int dataLen,
 
 /*
  * Uncompress "pEntry" in "pArchive" to "fd" at the current offset.
+ *
+ * STORED entries are written straight out of the archive mapping with
+ * as few write() calls as the kernel allows; there is no intermediate
+ * copy.
  */
 bool mzExtractZipEntryToFile(const ZipArchive *pArchive,
     const ZipEntry *pEntry, int fd)
 {
+    if (pEntry->compression == STORED) {
+        if (pEntry->compLen != pEntry->uncompLen) {
+            LOGE("Stored entry '%.*s' has mismatched sizes (%ld vs %ld)\n",
+                    pEntry->fileNameLen, pEntry->fileName,
+                    pEntry->compLen, pEntry->uncompLen);
+            return false;
+        }
+        if (!processStoredEntry(pArchive, pEntry, writeProcessFunction,
+                                (void*)fd)) {
+            LOGE("Can't extract entry to file.\n");
+            return false;
+        }
+        return true;
+    }
+
     bool ret = mzProcessZipEntryContents(pArchive, pEntry, writeProcessFunction,
                                          (void*)fd);
     if (!ret) {
@@ -810,6 +1110,22 @@ bool mzExtractZipEntryToFile(const ZipArchive *pArchive,
     return true;
 }
 
+/*
+ * Uncompress a batch of entries, pEntries[i] to fds[i], back to back on
+ * this thread's inflater.  Stops at the first failure.
+ */
+int mzExtractZipEntriesToFiles(const ZipArchive *pArchive,
+    const ZipEntry * const *pEntries, const int *fds, int count)
+{
+    int i;
+    for (i = 0; i < count; i++) {
+        if (!mzExtractZipEntryToFile(pArchive, pEntries[i], fds[i])) {
+            break;
+        }
+    }
+    return i;
+}
+
 typedef struct {
     unsigned char* buffer;
     long len;
@@ -927,6 +1243,57 @@ static const char *targetEntryPath(MzPathHelper *helper, ZipEntry *pEntry)
  *
  * Returns true on success, false on failure.
  */
+/*
+ * Regular files that mzExtractRecursive() has created but not yet
+ * filled in; they are extracted together by finishExtractBatch().
+ */
+#define EXTRACT_BATCH_SIZE 16
+
+typedef struct {
+    const ZipEntry *pEntries[EXTRACT_BATCH_SIZE];
+    int fds[EXTRACT_BATCH_SIZE];
+    char *paths[EXTRACT_BATCH_SIZE];
+    int count;
+} ExtractBatch;
+
+/*
+ * Extract the pending files (or, if "extract" is false, just give up
+ * on them), close them, and report each finished one to "callback".
+ * Returns false if anything went wrong.
+ */
+static bool finishExtractBatch(const ZipArchive *pArchive,
+    ExtractBatch *pBatch, bool extract, const struct utimbuf *timestamp,
+    void (*callback)(const char *fn, void *), void *cookie)
+{
+    int done = 0;
+    bool ok = extract;
+    int i;
+
+    if (extract) {
+        done = mzExtractZipEntriesToFiles(pArchive, pBatch->pEntries,
+                pBatch->fds, pBatch->count);
+    }
+    for (i = 0; i < pBatch->count; i++) {
+        const char *targetFile = pBatch->paths[i];
+        close(pBatch->fds[i]);
+        if (ok && i == done) {
+            LOGE("Error extracting \"%s\"\n", targetFile);
+            ok = false;
+        }
+        if (ok && timestamp != NULL && utime(targetFile, timestamp)) {
+            LOGE("Error touching \"%s\"\n", targetFile);
+            ok = false;
+        }
+        if (ok) {
+            LOGD("Extracted file \"%s\"\n", targetFile);
+            if (callback != NULL) callback(targetFile, cookie);
+        }
+        free(pBatch->paths[i]);
+    }
+    pBatch->count = 0;
+    return ok;
+}
+
 bool mzExtractRecursive(const ZipArchive *pArchive,
                         const char *zipDir, const char *targetDir,
                         int flags, const struct utimbuf *timestamp,
@@ -977,6 +1344,9 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
     helper.buf = NULL;
     helper.bufLen = 0;
 
+    ExtractBatch batch;
+    batch.count = 0;
+
     /* Walk through the entries and extract anything whose path begins
      * with zpath.
 //TODO: since the entries are sorted, binary search for the first match
@@ -1044,6 +1414,12 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
 #define UNZIP_DIRMODE 0755
 #define UNZIP_FILEMODE 0644
         if (pEntry->fileName[pEntry->fileNameLen-1] == '/') {
+            /* Keep the callbacks in archive order. */
+            if (!finishExtractBatch(pArchive, &batch, true, timestamp,
+                                    callback, cookie)) {
+                ok = false;
+                break;
+            }
             if (!(flags & MZ_EXTRACT_FILES_ONLY)) {
                 int ret = dirCreateHierarchy(
                         targetFile, UNZIP_DIRMODE, timestamp, false, sehnd);
@@ -1076,6 +1452,11 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
                  * The relative target of the symlink is in the
                  * data section of this entry.
                  */
+                if (!finishExtractBatch(pArchive, &batch, true, timestamp,
+                                        callback, cookie)) {
+                    ok = false;
+                    break;
+                }
                 if (pEntry->uncompLen == 0) {
                     LOGE("Symlink entry \"%s\" has no target\n",
                             targetFile);
@@ -1118,7 +1499,7 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
                 char *secontext = NULL;
 
                 if (sehnd) {
-                    selabel_lookup(sehnd, &secontext, targetFile, UNZIP_FILEMODE);
+                    labelLookup(sehnd, &secontext, targetFile, UNZIP_FILEMODE);
                     setfscreatecon(secontext);
                 }
 
@@ -1136,26 +1517,34 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
                     break;
                 }
 
-                bool ok = mzExtractZipEntryToFile(pArchive, pEntry, fd);
-                close(fd);
-                if (!ok) {
-                    LOGE("Error extracting \"%s\"\n", targetFile);
+                /* Queue it; the data is written (and the callback
+                 * made) when the batch is finished.
+                 */
+                char *path = strdup(targetFile);
+                if (path == NULL) {
+                    close(fd);
                     ok = false;
                     break;
                 }
-
-                if (timestamp != NULL && utime(targetFile, timestamp)) {
-                    LOGE("Error touching \"%s\"\n", targetFile);
+                batch.pEntries[batch.count] = pEntry;
+                batch.fds[batch.count] = fd;
+                batch.paths[batch.count] = path;
+                if (++batch.count == EXTRACT_BATCH_SIZE &&
+                        !finishExtractBatch(pArchive, &batch, true, timestamp,
+                                            callback, cookie)) {
                     ok = false;
                     break;
                 }
-
-                LOGD("Extracted file \"%s\"\n", targetFile);
+                continue;
             }
         }
 
         if (callback != NULL) callback(targetFile, cookie);
     }
+    if (!finishExtractBatch(pArchive, &batch, ok, timestamp,
+                            callback, cookie)) {
+        ok = false;
+    }
 
     free(helper.buf);
     free(zpath);
@@ -70,6 +70,21 @@ typedef struct {
  */
 int mzOpenZipArchive(const char* fileName, ZipArchive* pArchive);
 
+/*
+ * Like mzOpenZipArchive(), but take the entry list from an index that
+ * mzWriteZipIndex() wrote to indexFd, if it was made from this same
+ * file.  Falls back to parsing the central directory otherwise.
+ */
+int mzOpenZipArchiveWithIndex(const char* fileName, int indexFd,
+        ZipArchive* pArchive);
+
+/*
+ * Write the parsed entry list of an open archive to fd, so that another
+ * process can open the same file with mzOpenZipArchiveWithIndex()
+ * without parsing it again.  Returns 0 or an errno value.
+ */
+int mzWriteZipIndex(const ZipArchive* pArchive, int fd);
+
 /*
  * Close archive, releasing resources associated with it.
  *
@@ -175,6 +190,20 @@ bool mzIsZipEntryIntact(const ZipArchive *pArchive, const ZipEntry *pEntry);
 bool mzExtractZipEntryToFile(const ZipArchive *pArchive,
     const ZipEntry *pEntry, int fd);
 
+/*
+ * Inflate and write a batch of entries, pEntries[i] to fds[i].
+ *
+ * Deflated entries are inflated with a per-thread z_stream that is
+ * inflateReset() between entries rather than set up from scratch, so
+ * a batch pays for inflateInit2() at most once.  mzExtractRecursive()
+ * extracts regular files this way.
+ *
+ * Returns the number of entries written; if that is less than count,
+ * pEntries[result] failed and the rest weren't attempted.
+ */
+int mzExtractZipEntriesToFiles(const ZipArchive *pArchive,
+    const ZipEntry * const *pEntries, const int *fds, int count);
+
 /*
  * Inflate and write an entry to a memory buffer, which must be long
  * enough to hold mzGetZipEntryUncomplen(pEntry) bytes.
@@ -35,7 +35,10 @@
 #include "recovery_ui.h"
 #include "voldclient/voldclient.h"
 
-extern int __system(const char *command);
+// A BOARD_CUSTOM_GRAPHICS backend may predate clipping; without it,
+// partial redraws fall back to redrawing the whole screen.
+extern void gr_set_clip(int x, int y, int w, int h) __attribute__((weak));
+extern void gr_clear_clip(void) __attribute__((weak));
 
 #if defined(BOARD_HAS_NO_SELECT_BUTTON) || defined(BOARD_TOUCH_RECOVERY)
 static int gShowBackButton = 1;
@@ -109,10 +112,43 @@ static double gProgressScopeTime, gProgressScopeDuration;
 // Set to 1 when both graphics pages are the same (except for the progress bar)
 static int gPagesIdentical = 0;
 
+// Set when what's on screen no longer matches the UI state (it changed
+// without a redraw), so the next update must redraw everything instead
+// of just the parts it knows about.
+static int gScreenStale = 1;
+
+// What's on screen, so updates can tell which parts of it changed.
+static int gDrawnInstallingFrame = -1;
+static int log_start_row = 0, log_drawn_rows = 0;
+static char log_drawn[MAX_ROWS][MAX_COLS];
+
+// Bounding box of the parts of the screen draw_dirty_locked() will redraw.
+static int dirty_x1, dirty_y1, dirty_x2, dirty_y2;
+static int has_dirty = 0;
+
+// The log text and the progress fraction are updated by whatever thread
+// is doing the work, holding only gStateMutex, which is never held while
+// drawing.  render_thread() picks the changes up under gUpdateMutex and
+// draws them at most ui_parameters.update_fps times a second, so slow
+// drawing never holds up the work.  When nothing is animating it sleeps
+// on gRenderCond until gRenderRequested says there is something to draw.
+static pthread_mutex_t gStateMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gRenderCond = PTHREAD_COND_INITIALIZER;
+static int gRenderRequested = 0;
+static int gLogChanged = 0;
+static float gProgressPending = 0;
+
 // Log text overlay, displayed when a magic key is pressed
 static char text[MAX_ROWS][MAX_COLS];
 static int text_cols = 0, text_rows = 0;
 static int text_col = 0, text_row = 0, text_top = 0;
+// Set by ui_delete_line(): the last complete line stays on screen until
+// the next ui_print() writes over it.
+static int text_overwrite = 0;
+
+// The copy of text[] that gets drawn, taken under gUpdateMutex.
+static char log_view[MAX_ROWS][MAX_COLS];
+static int log_view_row = 0;
 static int show_text = 0;
 static int show_text_ever = 0;   // has show_text ever been 1?
 
@@ -133,6 +169,7 @@ static unsigned long key_last_repeat[KEY_MAX + 1], key_press_time[KEY_MAX + 1];
 static volatile char key_pressed[KEY_MAX + 1];
 
 static void update_screen_locked(void);
+static void sample_batt_level(void);
 
 // Return the current time as a double (including fractions of a second).
 static double now() {
@@ -148,6 +185,7 @@ static double now() {
 // Should only be called with gUpdateMutex locked.
 static void draw_install_overlay_locked(int frame) {
     if (gInstallationOverlay == NULL) return;
+    gDrawnInstallingFrame = frame;
     gr_surface surface = gInstallationOverlay[frame];
     int iconWidth = gr_get_width(surface);
     int iconHeight = gr_get_height(surface);
@@ -189,6 +227,17 @@ static void draw_background_locked(int icon)
     }
 }
 
+// Where draw_progress_locked() puts the progress bar.
+static void get_progress_rect(int *dx, int *dy, int *width, int *height)
+{
+    int iconHeight = gr_get_height(gBackgroundIcon[BACKGROUND_ICON_INSTALLING]);
+    *width = gr_get_width(gProgressBarEmpty);
+    *height = gr_get_height(gProgressBarEmpty);
+
+    *dx = (gr_fb_width() - *width)/2;
+    *dy = (3*gr_fb_height() + iconHeight - 2 * *height)/4;
+}
+
 // Draw the progress bar (if any) on the screen.  Does not flip pages.
 // Should only be called with gUpdateMutex locked.
 static void draw_progress_locked()
@@ -198,12 +247,8 @@ static void draw_progress_locked()
     }
 
     if (gProgressBarType != PROGRESSBAR_TYPE_NONE) {
-        int iconHeight = gr_get_height(gBackgroundIcon[BACKGROUND_ICON_INSTALLING]);
-        int width = gr_get_width(gProgressBarEmpty);
-        int height = gr_get_height(gProgressBarEmpty);
-
-        int dx = (gr_fb_width() - width)/2;
-        int dy = (3*gr_fb_height() + iconHeight - 2*height)/4;
+        int dx, dy, width, height;
+        get_progress_rect(&dx, &dy, &width, &height);
 
         // Erase behind the progress bar (in case this was a progress-only update)
         gr_color(0, 0, 0, 255);
@@ -272,6 +317,29 @@ static void draw_text_line(int row, const char* t, int align) {
 #define NORMAL_TEXT_COLOR 200, 200, 200, 255
 #define HEADER_TEXT_COLOR NORMAL_TEXT_COLOR
 
+// Index in log_view[] of the line shown on the first of 'rows' log
+// rows; the last one shows the line before the one being written.
+static int log_first_line(int rows)
+{
+    return (log_view_row + MAX_ROWS - rows) % MAX_ROWS;
+}
+
+// Take a copy of the log text for drawing.  Returns 1 if it changed.
+// Should only be called with gUpdateMutex locked.
+static int sync_log_view_locked(void)
+{
+    int changed;
+    pthread_mutex_lock(&gStateMutex);
+    changed = gLogChanged;
+    if (changed) {
+        memcpy(log_view, text, sizeof(text));
+        log_view_row = text_row;
+        gLogChanged = 0;
+    }
+    pthread_mutex_unlock(&gStateMutex);
+    return changed;
+}
+
 // Redraw everything on the screen.  Does not flip pages.
 // Should only be called with gUpdateMutex locked.
 static void draw_screen_locked(void)
@@ -349,47 +417,208 @@ static void draw_screen_locked(void)
         }
 
         gr_color(NORMAL_TEXT_COLOR);
-        int cur_row = text_row;
         int available_rows = total_rows - row - 1;
         int start_row = row + 1;
-        if (available_rows < MAX_ROWS)
-            cur_row = (cur_row + (MAX_ROWS - available_rows)) % MAX_ROWS;
-        else
+        if (available_rows >= MAX_ROWS) {
+            available_rows = MAX_ROWS;
             start_row = total_rows - MAX_ROWS;
+        }
+        if (available_rows < 0) available_rows = 0;
+        int cur_row = log_first_line(available_rows);
 
         int r;
-        for (r = 0; r < (available_rows < MAX_ROWS ? available_rows : MAX_ROWS); r++) {
-            draw_text_line(start_row + r, text[(cur_row + r) % MAX_ROWS], LEFT_ALIGN);
+        for (r = 0; r < available_rows; r++) {
+            draw_text_line(start_row + r, log_view[(cur_row + r) % MAX_ROWS], LEFT_ALIGN);
         }
+        log_start_row = start_row;
+        log_drawn_rows = available_rows;
+    } else {
+        log_drawn_rows = 0;
     }
     draw_virtualkeys_locked(); //added to draw the virtual keys
 }
 
+// Note what the log rows show after a full redraw.
+static void remember_log_rows(void)
+{
+    int first = log_first_line(log_drawn_rows);
+    int r;
+    for (r = 0; r < log_drawn_rows; r++) {
+        strcpy(log_drawn[r], log_view[(first + r) % MAX_ROWS]);
+    }
+}
+
+// Redraw everything on the screen.  Does not flip pages.
+// Should only be called with gUpdateMutex locked.
+static void redraw_screen_locked(void)
+{
+    draw_screen_locked();
+    remember_log_rows();
+    gScreenStale = 0;
+    has_dirty = 0;
+}
+
 // Redraw everything on the screen and flip the screen (make it visible).
 // Should only be called with gUpdateMutex locked.
 static void update_screen_locked(void)
 {
     if (!ui_has_initialized) return;
-    draw_screen_locked();
+    sync_log_view_locked();
+    redraw_screen_locked();
     gr_flip();
 }
 
-// Updates only the progress bar, if possible, otherwise redraws the screen.
+// Mark part of the screen for the next draw_dirty_locked().
+static void add_dirty(int x, int y, int w, int h)
+{
+    if (!has_dirty) {
+        dirty_x1 = x;
+        dirty_y1 = y;
+        dirty_x2 = x + w;
+        dirty_y2 = y + h;
+        has_dirty = 1;
+        return;
+    }
+    if (x < dirty_x1) dirty_x1 = x;
+    if (y < dirty_y1) dirty_y1 = y;
+    if (x + w > dirty_x2) dirty_x2 = x + w;
+    if (y + h > dirty_y2) dirty_y2 = y + h;
+}
+
+// The installation animation has moved on since it was last drawn.
+static void add_dirty_install_overlay(void)
+{
+    if (gCurrentIcon != BACKGROUND_ICON_INSTALLING ||
+        gInstallationOverlay == NULL ||
+        gInstallingFrame == gDrawnInstallingFrame) return;
+    gr_surface surface = gInstallationOverlay[gInstallingFrame];
+    add_dirty(ui_parameters.install_overlay_offset_x,
+              ui_parameters.install_overlay_offset_y,
+              gr_get_width(surface), gr_get_height(surface));
+}
+
+// Redraw just the marked parts of the screen; when flipped, only the
+// rows they cover are copied to the framebuffer.  Does not flip pages.
 // Should only be called with gUpdateMutex locked.
-static void update_progress_locked(void)
+static void draw_dirty_locked(void)
 {
-    if (!ui_has_initialized) return;
-    if (show_text || !gPagesIdentical) {
-        draw_screen_locked();    // Must redraw the whole screen
+    if (!has_dirty) return;
+    if (gr_set_clip == NULL || gr_clear_clip == NULL) {
+        redraw_screen_locked();
+        return;
+    }
+    has_dirty = 0;
+
+    // A partial redraw leaves the rest of the screen as it was.
+    int pages_identical = gPagesIdentical;
+    gr_set_clip(dirty_x1, dirty_y1, dirty_x2 - dirty_x1, dirty_y2 - dirty_y1);
+    draw_screen_locked();
+    gr_clear_clip();
+    gPagesIdentical = pages_identical;
+}
+
+// Draws only the progress bar, if possible, otherwise redraws the screen.
+// Does not flip pages.
+// Should only be called with gUpdateMutex locked.
+static void draw_progress_update_locked(void)
+{
+    if (gScreenStale || !gPagesIdentical || (show_text && gRainbowMode)) {
+        redraw_screen_locked();  // Must redraw the whole screen
         gPagesIdentical = 1;
+    } else if (show_text) {
+        // Redraw the progress bar area along with the text over it
+        if (gProgressBarType != PROGRESSBAR_TYPE_NONE) {
+            int dx, dy, width, height;
+            get_progress_rect(&dx, &dy, &width, &height);
+            add_dirty(dx, dy, width, height);
+        }
+        add_dirty_install_overlay();
+        draw_dirty_locked();
     } else {
         draw_progress_locked();  // Draw only the progress bar and overlays
     }
+}
+
+// Updates only the progress bar, if possible, otherwise redraws the screen.
+// Should only be called with gUpdateMutex locked.
+static void update_progress_locked(void)
+{
+    if (!ui_has_initialized) return;
+    draw_progress_update_locked();
     gr_flip();
 }
 
-// Keeps the progress bar updated, even when the process is otherwise busy.
-static void *progress_thread(void *cookie)
+// Draws what changed in the log view: just the log rows that now read
+// differently, and nothing at all while the log is hidden.  Does not
+// flip pages.
+// Should only be called with gUpdateMutex locked.
+static void draw_log_update_locked(void)
+{
+    if (gScreenStale || (show_text && gRainbowMode)) {
+        redraw_screen_locked();
+        return;
+    }
+
+    int first = log_first_line(log_drawn_rows);
+    int r;
+    for (r = 0; r < log_drawn_rows; r++) {
+        const char* line = log_view[(first + r) % MAX_ROWS];
+        if (strcmp(line, log_drawn[r]) != 0) {
+            // glyphs can reach a pixel or two outside their row
+            add_dirty(0, (log_start_row + r) * CHAR_HEIGHT - 2,
+                      gr_fb_width(), CHAR_HEIGHT + 4);
+            strcpy(log_drawn[r], line);
+        }
+    }
+    // the screen used to be redrawn on every line, which also kept the
+    // installation animation going
+    add_dirty_install_overlay();
+    draw_dirty_locked();
+}
+
+// Ask render_thread() for a frame.  Call with gStateMutex locked.
+static void request_render_locked(void)
+{
+    gRenderRequested = 1;
+    pthread_cond_signal(&gRenderCond);
+}
+
+// Wake render_thread() after changing whether something animates
+// (the background icon, the progress bar type or show_text).  May be
+// called with gUpdateMutex locked.
+static void wake_render_thread(void)
+{
+    pthread_mutex_lock(&gStateMutex);
+    request_render_locked();
+    pthread_mutex_unlock(&gStateMutex);
+}
+
+// Take up the fraction passed to ui_set_progress() since the last
+// frame.  Returns 1 if the bar needs redrawing.
+// Should only be called with gUpdateMutex locked.
+static int apply_pending_progress_locked(void)
+{
+    pthread_mutex_lock(&gStateMutex);
+    float fraction = gProgressPending;
+    pthread_mutex_unlock(&gStateMutex);
+
+    if (gProgressBarType == PROGRESSBAR_TYPE_NORMAL && fraction > gProgress) {
+        // Skip updates that aren't visibly different.
+        int width = gr_get_width(gProgressBarIndeterminate[0]);
+        float scale = width * gProgressScopeSize;
+        if ((int) (gProgress * scale) != (int) (fraction * scale)) {
+            gProgress = fraction;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Draws the log and progress changes made by other threads, and keeps the
+// progress bar animated, even when the process is otherwise busy.  While
+// nothing animates the thread sleeps until it is asked for a frame, so a
+// static screen costs no CPU.
+static void *render_thread(void *cookie)
 {
     double interval = 1.0 / ui_parameters.update_fps;
     for (;;) {
@@ -397,6 +626,7 @@ static void *progress_thread(void *cookie)
         pthread_mutex_lock(&gUpdateMutex);
 
         int redraw = 0;
+        int animating = 0;
 
         // update the installation animation, if active
         // skip this if we have a text overlay (too expensive to update)
@@ -406,12 +636,14 @@ static void *progress_thread(void *cookie)
             gInstallingFrame =
                 (gInstallingFrame + 1) % ui_parameters.installing_frames;
             redraw = 1;
+            animating = 1;
         }
 
         // update the progress bar animation, if active
         // skip this if we have a text overlay (too expensive to update)
         if (gProgressBarType == PROGRESSBAR_TYPE_INDETERMINATE && !show_text) {
             redraw = 1;
+            animating = 1;
         }
 
         // move the progress bar forward on timed intervals, if configured
@@ -424,14 +656,32 @@ static void *progress_thread(void *cookie)
                 gProgress = progress;
                 redraw = 1;
             }
+            if (progress < 1.0) animating = 1;
         }
 
-        if (redraw) update_progress_locked();
+        if (apply_pending_progress_locked()) redraw = 1;
+
+        // Everything that changed goes out in one flip.
+        int log_changed = sync_log_view_locked();
+        if (redraw) draw_progress_update_locked();
+        if (log_changed) draw_log_update_locked();
+        gr_flip();
 
         pthread_mutex_unlock(&gUpdateMutex);
-        double end = now();
-        // minimum of 20ms delay between frames
-        double delay = interval - (end-start);
+
+        // Nothing to animate: wait for ui_print() and friends to ask for
+        // a frame.  Requests made while drawing are still pending here.
+        pthread_mutex_lock(&gStateMutex);
+        if (!animating) {
+            while (!gRenderRequested)
+                pthread_cond_wait(&gRenderCond, &gStateMutex);
+        }
+        gRenderRequested = 0;
+        pthread_mutex_unlock(&gStateMutex);
+
+        // minimum of 20ms delay between frames, which also lets a burst
+        // of log lines go out in one frame
+        double delay = (animating ? interval : 0) - (now() - start);
         if (delay < 0.02) delay = 0.02;
         usleep((long)(delay * 1000000));
     }
@@ -638,6 +888,7 @@ static int input_callback(int fd, short revents, void *data)
         show_text = !show_text;
         if (show_text) show_text_ever = 1;
         update_screen_locked();
+        wake_render_thread();
         pthread_mutex_unlock(&gUpdateMutex);
     }
 
@@ -747,13 +998,14 @@ void ui_init(void)
     }
 
     pthread_t t;
-    pthread_create(&t, NULL, progress_thread, NULL);
+    pthread_create(&t, NULL, render_thread, NULL);
     pthread_create(&t, NULL, input_thread, NULL);
 }
 
 char *ui_copy_image(int icon, int *width, int *height, int *bpp) {
     pthread_mutex_lock(&gUpdateMutex);
     draw_background_locked(icon);
+    gScreenStale = 1;
     *width = gr_fb_width();
     *height = gr_fb_height();
     *bpp = sizeof(gr_pixel) * 8;
@@ -773,6 +1025,7 @@ void ui_set_background(int icon)
     pthread_mutex_lock(&gUpdateMutex);
     gCurrentIcon = icon;
     update_screen_locked();
+    wake_render_thread();
     pthread_mutex_unlock(&gUpdateMutex);
 }
 
@@ -782,6 +1035,7 @@ void ui_show_indeterminate_progress()
     if (gProgressBarType != PROGRESSBAR_TYPE_INDETERMINATE) {
         gProgressBarType = PROGRESSBAR_TYPE_INDETERMINATE;
         update_progress_locked();
+        wake_render_thread();
     }
     pthread_mutex_unlock(&gUpdateMutex);
 }
@@ -795,25 +1049,23 @@ void ui_show_progress(float portion, int seconds)
     gProgressScopeTime = now();
     gProgressScopeDuration = seconds;
     gProgress = 0;
+    pthread_mutex_lock(&gStateMutex);
+    gProgressPending = 0;
+    request_render_locked();
+    pthread_mutex_unlock(&gStateMutex);
     update_progress_locked();
     pthread_mutex_unlock(&gUpdateMutex);
 }
 
+// The bar moves on the next frame drawn by render_thread().
 void ui_set_progress(float fraction)
 {
-    pthread_mutex_lock(&gUpdateMutex);
     if (fraction < 0.0) fraction = 0.0;
     if (fraction > 1.0) fraction = 1.0;
-    if (gProgressBarType == PROGRESSBAR_TYPE_NORMAL && fraction > gProgress) {
-        // Skip updates that aren't visibly different.
-        int width = gr_get_width(gProgressBarIndeterminate[0]);
-        float scale = width * gProgressScopeSize;
-        if ((int) (gProgress * scale) != (int) (fraction * scale)) {
-            gProgress = fraction;
-            update_progress_locked();
-        }
-    }
-    pthread_mutex_unlock(&gUpdateMutex);
+    pthread_mutex_lock(&gStateMutex);
+    gProgressPending = fraction;
+    request_render_locked();
+    pthread_mutex_unlock(&gStateMutex);
 }
 
 void ui_reset_progress()
@@ -823,30 +1075,36 @@ void ui_reset_progress()
     gProgressScopeStart = gProgressScopeSize = 0;
     gProgressScopeTime = gProgressScopeDuration = 0;
     gProgress = 0;
+    pthread_mutex_lock(&gStateMutex);
+    gProgressPending = 0;
+    pthread_mutex_unlock(&gStateMutex);
     update_screen_locked();
     pthread_mutex_unlock(&gUpdateMutex);
 }
 
-static long delta_milliseconds(struct timeval from, struct timeval to) {
-    long delta_sec = (to.tv_sec - from.tv_sec)*1000;
-    long delta_usec = (to.tv_usec - from.tv_usec)/1000;
-    return (delta_sec + delta_usec);
-}
-
-static struct timeval lastupdate = (struct timeval) {0};
-static int ui_nice = 0;
-static int ui_niced = 0;
+// ui_nice_print() used to skip lines printed less than 100ms apart so
+// they wouldn't each cost a screen redraw.  Printing doesn't draw any
+// more, so nothing is skipped and ui_was_niced() is always 0.
 void ui_set_nice(int enabled) {
-    ui_nice = enabled;
 }
-#define NICE_INTERVAL 100
 int ui_was_niced() {
-    return ui_niced;
+    return 0;
 }
 int ui_get_text_cols() {
     return text_cols;
 }
 
+// Back up onto the last complete line so the next text replaces it.
+// Should only be called with gStateMutex locked.
+static void take_back_line_locked(void)
+{
+    text[text_row][0] = '\0';
+    text_row = (text_row - 1 + text_rows) % text_rows;
+    text_col = 0;
+    text_overwrite = 0;
+}
+
+// Adds to the log only; render_thread() draws it on its next frame.
 void ui_print(const char *fmt, ...)
 {
     char buf[256];
@@ -858,27 +1116,14 @@ void ui_print(const char *fmt, ...)
     if (ui_log_stdout)
         fputs(buf, stdout);
 
-    // if we are running 'ui nice' mode, we do not want to force a screen update
-    // for this line if not necessary.
-    ui_niced = 0;
-    if (ui_nice) {
-        struct timeval curtime;
-        gettimeofday(&curtime, NULL);
-        long ms = delta_milliseconds(lastupdate, curtime);
-        if (ms < NICE_INTERVAL && ms >= 0) {
-            ui_niced = 1;
-            return;
-        }
-    }
-
     // This can get called before ui_init(), so be careful.
-    pthread_mutex_lock(&gUpdateMutex);
-    gettimeofday(&lastupdate, NULL);
+    pthread_mutex_lock(&gStateMutex);
     if (text_rows > 0 && text_cols > 0) {
         char *ptr;
 #ifdef USE_CHINESE_FONT
         int fwidth = 0, fwidth_sum = 0;
 #endif
+        if (text_overwrite) take_back_line_locked();
         for (ptr = buf; *ptr != '\0'; ++ptr) {
 #ifdef USE_CHINESE_FONT
             fwidth = gr_measure(&*ptr);
@@ -898,31 +1143,87 @@ void ui_print(const char *fmt, ...)
             if (*ptr != '\n') text[text_row][text_col++] = *ptr;
         }
         text[text_row][text_col] = '\0';
-        update_screen_locked();
+        gLogChanged = 1;
+        request_render_locked();
     }
-    pthread_mutex_unlock(&gUpdateMutex);
+    pthread_mutex_unlock(&gStateMutex);
 }
 
+// How far back from the end of the log ui_printlogtail() looks for
+// the lines it wants.
+#define LOG_TAIL_MAX_BYTES (64 * 1024)
+
+// Shows the last nb_lines lines of the log.  They are read straight
+// from the end of the file, without a tail process or a temp file, and
+// ui_print() only queues them, so they all go out in one frame.
 void ui_printlogtail(int nb_lines) {
-    char * log_data;
-    char tmp[PATH_MAX];
-    FILE * f;
-    int line=0;
+    char *buf = NULL;
+    char *start;
+    size_t len = 0;
+    size_t want = 4096;
+    off_t end;
+    int fd;
+
+    if (nb_lines <= 0)
+        return;
+    fd = open("/tmp/recovery.log", O_RDONLY);
+    if (fd < 0)
+        return;
+    end = lseek(fd, 0, SEEK_END);
+
+    // Read backwards in growing chunks until the chunk holds nb_lines
+    // whole lines, or is the whole file.
+    for (;;) {
+        len = end < (off_t) want ? (size_t) end : want;
+        char *p = realloc(buf, len + 1);
+        if (p == NULL) {
+            free(buf);
+            close(fd);
+            return;
+        }
+        buf = p;
+        if (pread(fd, buf, len, end - len) != (ssize_t) len) {
+            free(buf);
+            close(fd);
+            return;
+        }
+        buf[len] = '\0';
+
+        // the newline ending the last line doesn't start another one
+        int lines = 0;
+        char *q = buf + len;
+        if (q > buf && q[-1] == '\n') q--;
+        start = NULL;
+        while (q > buf) {
+            if (*--q == '\n' && ++lines == nb_lines) {
+                start = q + 1;
+                break;
+            }
+        }
+        if (start != NULL)
+            break;
+        if ((off_t) len == end || want >= LOG_TAIL_MAX_BYTES) {
+            start = buf;
+            break;
+        }
+        want *= 2;
+    }
+    close(fd);
+
     //don't log output to recovery.log
     ui_log_stdout=0;
-    sprintf(tmp, "tail -n %d /tmp/recovery.log > /tmp/tail.log", nb_lines);
-    __system(tmp);
-    f = fopen("/tmp/tail.log", "rb");
-    if (f != NULL) {
-        while (line < nb_lines) {
-            log_data = fgets(tmp, PATH_MAX, f);
-            if (log_data == NULL) break;
-            ui_print("%s", tmp);
-            line++;
+    while (*start != '\0') {
+        char *nl = strchr(start, '\n');
+        if (nl == NULL) {
+            ui_print("%s", start);
+            break;
         }
-        fclose(f);
+        *nl = '\0';
+        ui_print("%s\n", start);
+        start = nl + 1;
     }
     ui_log_stdout=1;
+    free(buf);
 }
 
 #define MENU_ITEM_HEADER " > "
@@ -930,6 +1231,7 @@ void ui_printlogtail(int nb_lines) {
 
 int ui_start_menu(const char** headers, char** items, int initial_selection) {
     int i;
+    sample_batt_level();
     pthread_mutex_lock(&gUpdateMutex);
     if (text_rows > 0 && text_cols > 0) {
         for (i = 0; i < text_rows; ++i) {
@@ -1029,26 +1331,78 @@ void ui_show_text(int visible)
     show_text = visible;
     if (show_text) show_text_ever = 1;
     update_screen_locked();
+    wake_render_thread();
     pthread_mutex_unlock(&gUpdateMutex);
 }
 
-// Return true if USB is connected.
-static int usb_connected() {
-    int fd = open("/sys/class/android_usb/android0/state", O_RDONLY);
-    if (fd < 0) {
-        printf("failed to open /sys/class/android_usb/android0/state: %s\n",
-               strerror(errno));
-        return 0;
+// sysfs attributes are opened once and re-read with pread(), which
+// makes the kernel regenerate the value without another path lookup.
+typedef struct {
+    const char *paths[3];       // alternatives; the first that opens wins
+    int fd;                     // -1 until one of them opens
+    int warned;
+} StatusFile;
+
+static StatusFile gBattCapacityFile = {
+    { "/sys/class/power_supply/battery/capacity",
+      "/sys/devices/platform/android-battery/power_supply/android-battery/capacity",
+      NULL },
+    -1, 0
+};
+
+static StatusFile gUsbStateFile = {
+    { "/sys/class/android_usb/android0/state", NULL },
+    -1, 0
+};
+
+// Battery level shown in the menu header, as of the last
+// sample_batt_level().  Drawing only ever reads this.
+static int gBattLevel = 0;
+
+// Reads the current value of 'sf' into buf, NUL-terminated.  Returns
+// its length, or -1 if the attribute can't be read.
+static int read_status_file(StatusFile *sf, char *buf, size_t size)
+{
+    int i;
+    if (sf->fd < 0) {
+        for (i = 0; sf->paths[i] != NULL && sf->fd < 0; i++)
+            sf->fd = open(sf->paths[i], O_RDONLY);
+        if (sf->fd < 0) {
+            if (!sf->warned)
+                printf("failed to open %s: %s\n", sf->paths[0], strerror(errno));
+            sf->warned = 1;
+            return -1;
+        }
+    }
+    ssize_t len = pread(sf->fd, buf, size - 1, 0);
+    if (len < 0) {
+        printf("failed to read %s: %s\n", sf->paths[0], strerror(errno));
+        return -1;
     }
+    buf[len] = '\0';
+    return len;
+}
 
-    char buf;
+// Called when a menu comes up and from the key wait loop every
+// REFRESH_TIME_USB_INTERVAL seconds, never from the draw path.
+static void sample_batt_level(void)
+{
+    char value[8];
+    if (read_status_file(&gBattCapacityFile, value, sizeof(value)) < 0)
+        return;
+    int level = atoi(value);
+    if (level > 100)
+        level = 100;
+    if (level < 0)
+        level = 0;
+    gBattLevel = level;
+}
+
+// Return true if USB is connected.
+static int usb_connected() {
+    char buf[16];
     /* USB is connected if android_usb state is CONNECTED or CONFIGURED */
-    int connected = (read(fd, &buf, 1) == 1) && (buf == 'C');
-    if (close(fd) < 0) {
-        printf("failed to close /sys/class/android_usb/android0/state: %s\n",
-               strerror(errno));
-    }
-    return connected;
+    return read_status_file(&gUsbStateFile, buf, sizeof(buf)) > 0 && buf[0] == 'C';
 }
 
 void ui_cancel_wait_key() {
@@ -1089,6 +1443,7 @@ int ui_wait_key()
             }
         }
         timeouts -= REFRESH_TIME_USB_INTERVAL;
+        if (rc == ETIMEDOUT) sample_batt_level();
     } while ((timeouts > 0 || usb_connected()) && key_queue_len == 0);
 
     int key = -1;
@@ -1140,6 +1495,7 @@ int ui_wait_key_with_repeat()
                 }
             }
             timeouts -= REFRESH_TIME_USB_INTERVAL;
+            if (rc == ETIMEDOUT) sample_batt_level();
         }
         pthread_mutex_unlock(&key_queue_mutex);
 
@@ -1227,7 +1583,11 @@ int ui_should_log_stdout()
 }
 
 void ui_set_show_text(int value) {
+    pthread_mutex_lock(&gUpdateMutex);
     show_text = value;
+    gScreenStale = 1;
+    wake_render_thread();
+    pthread_mutex_unlock(&gUpdateMutex);
 }
 
 void ui_set_showing_back_button(int showBackButton) {
@@ -1250,12 +1610,22 @@ int ui_handle_key(int key, int visible) {
     return device_handle_key(key, visible);
 }
 
+// Drops the last line of the log.  It's only taken back when the next
+// line is printed, so callers that print a line and then delete it
+// (like nandroid's per-file progress) keep it on screen in between;
+// the renderer never sees it disappear.
 void ui_delete_line() {
-    pthread_mutex_lock(&gUpdateMutex);
-    text[text_row][0] = '\0';
-    text_row = (text_row - 1 + text_rows) % text_rows;
-    text_col = 0;
-    pthread_mutex_unlock(&gUpdateMutex);
+    pthread_mutex_lock(&gStateMutex);
+    if (text_rows > 0) {
+        if (text_overwrite) take_back_line_locked();
+        // anything after the last newline goes right away
+        text[text_row][0] = '\0';
+        text_col = 0;
+        text_overwrite = 1;
+        gLogChanged = 1;
+        request_render_locked();
+    }
+    pthread_mutex_unlock(&gStateMutex);
 }
 
 void ui_increment_frame() {
@@ -1288,25 +1658,10 @@ void ui_set_rainbow_mode(int rainbowMode) {
     pthread_mutex_unlock(&gUpdateMutex);
 }
 
+// The cached level; see sample_batt_level().
 int get_batt_stats(void)
 {
-    static int level = -1;
-
-    char value[4];
-    FILE * capacity;
-    if ( (capacity = fopen("/sys/class/power_supply/battery/capacity","r")) ) {
-        fgets(value, 4, capacity);
-        fclose(capacity);
-    } else if ( (capacity = fopen("/sys/devices/platform/android-battery/power_supply/android-battery/capacity","r")) ) {
-        fgets(value, 4, capacity);
-        fclose(capacity);    
-    }
-    level = atoi(value);
-    if (level > 100)
-        level = 100;
-    if (level < 0)
-        level = 0;
-    return level;
+    return gBattLevel;
 }
 
 int input_buttons()
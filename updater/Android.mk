@@ -5,6 +5,7 @@ LOCAL_PATH := $(call my-dir)
 updater_src_files := \
 	../mounts.c \
 	install.c \
+	metadata.c \
 	updater.c
 
 #
@@ -34,12 +35,20 @@ endif
 
 LOCAL_STATIC_LIBRARIES += libflashutils libmtdutils libmmcutils libbmlutils
 LOCAL_STATIC_LIBRARIES += $(TARGET_RECOVERY_UPDATER_LIBS) $(TARGET_RECOVERY_UPDATER_EXTRA_LIBS)
-LOCAL_STATIC_LIBRARIES += libapplypatch libedify libmtdutils libminzip libz
+# Boards can link a faster zlib-compatible inflate implementation (for
+# example a SIMD-accelerated fork) for package extraction by naming its
+# static library here.  It must keep zlib's API and z_stream layout.
+ifneq ($(TARGET_RECOVERY_UPDATER_ZLIB),)
+  updater_zlib := $(TARGET_RECOVERY_UPDATER_ZLIB)
+else
+  updater_zlib := libz
+endif
+LOCAL_STATIC_LIBRARIES += libapplypatch libedify libmtdutils libminzip $(updater_zlib)
 LOCAL_STATIC_LIBRARIES += libmincrypt libbz
 LOCAL_STATIC_LIBRARIES += libminelf
 LOCAL_STATIC_LIBRARIES += libcutils libstdc++ libc
 LOCAL_STATIC_LIBRARIES += libselinux libcrecovery
-LOCAL_C_INCLUDES += $(LOCAL_PATH)/..
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/.. external/zlib
 
 # Each library in TARGET_RECOVERY_UPDATER_LIBS should have a function
 # named "Register_<libname>()".  Here we emit a little C function that
@@ -79,6 +88,7 @@ LOCAL_C_INCLUDES += $(dir $(inc))
 
 inc :=
 inc_dep_file :=
+updater_zlib :=
 
 LOCAL_MODULE := updater
 
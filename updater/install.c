@@ -28,15 +28,18 @@
 #include <fcntl.h>
 #include <time.h>
 #include <selinux/selinux.h>
-#include <ftw.h>
 #include <sys/capability.h>
 #include <sys/xattr.h>
 #include <linux/xattr.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <zlib.h>
 
 #include "cutils/misc.h"
 #include "cutils/properties.h"
 #include "edify/expr.h"
+#include "flashutils/flashutils.h"
+#include "metadata.h"
 #include "mincrypt/sha.h"
 #include "minzip/DirUtil.h"
 #include "mounts.h"
@@ -566,7 +569,6 @@ Value* SymlinkFn(const char* name, State* state, int argc, Expr* argv[]) {
 
 
 Value* SetPermFn(const char* name, State* state, int argc, Expr* argv[]) {
-    char* result = NULL;
     bool recursive = (strcmp(name, "set_perm_recursive") == 0);
 
     int min_args = 4 + (recursive ? 1 : 0);
@@ -575,7 +577,7 @@ Value* SetPermFn(const char* name, State* state, int argc, Expr* argv[]) {
                           name, min_args, argc);
     }
 
-    char** args = ReadVarArgs(state, argc, argv);
+    char** args = ReadArenaArgs(state, argc, argv);
     if (args == NULL) return NULL;
 
     char* end;
@@ -584,85 +586,82 @@ Value* SetPermFn(const char* name, State* state, int argc, Expr* argv[]) {
 
     int uid = strtoul(args[0], &end, 0);
     if (*end != '\0' || args[0][0] == 0) {
-        ErrorAbort(state, "%s: \"%s\" not a valid uid", name, args[0]);
-        goto done;
+        return ErrorAbort(state, "%s: \"%s\" not a valid uid", name, args[0]);
     }
 
     int gid = strtoul(args[1], &end, 0);
     if (*end != '\0' || args[1][0] == 0) {
-        ErrorAbort(state, "%s: \"%s\" not a valid gid", name, args[1]);
-        goto done;
+        return ErrorAbort(state, "%s: \"%s\" not a valid gid", name, args[1]);
     }
 
     if (recursive) {
         int dir_mode = strtoul(args[2], &end, 0);
         if (*end != '\0' || args[2][0] == 0) {
-            ErrorAbort(state, "%s: \"%s\" not a valid dirmode", name, args[2]);
-            goto done;
+            return ErrorAbort(state, "%s: \"%s\" not a valid dirmode",
+                              name, args[2]);
         }
 
         int file_mode = strtoul(args[3], &end, 0);
         if (*end != '\0' || args[3][0] == 0) {
-            ErrorAbort(state, "%s: \"%s\" not a valid filemode",
-                       name, args[3]);
-            goto done;
+            return ErrorAbort(state, "%s: \"%s\" not a valid filemode",
+                              name, args[3]);
         }
 
+        MetadataRule* rules = calloc(argc - 4, sizeof(MetadataRule));
+        if (rules == NULL) {
+            return ErrorAbort(state, "%s: failed to alloc %d rules", name, argc - 4);
+        }
         for (i = 4; i < argc; ++i) {
-            dirSetHierarchyPermissions(args[i], uid, gid, dir_mode, file_mode);
+            MetadataRule* rule = rules + (i - 4);
+            rule->path = args[i];
+            rule->recursive = true;
+            rule->perms.has_uid = rule->perms.has_gid = true;
+            rule->perms.uid = uid;
+            rule->perms.gid = gid;
+            rule->perms.has_mode = rule->perms.has_dmode = true;
+            rule->perms.mode = file_mode;
+            rule->perms.dmode = dir_mode;
         }
+        // Failures here have always been ignored.
+        ApplyMetadataRules(rules, argc - 4);
+        free(rules);
     } else {
         int mode = strtoul(args[2], &end, 0);
         if (*end != '\0' || args[2][0] == 0) {
-            ErrorAbort(state, "%s: \"%s\" not a valid mode", name, args[2]);
-            goto done;
+            return ErrorAbort(state, "%s: \"%s\" not a valid mode",
+                              name, args[2]);
         }
 
         for (i = 3; i < argc; ++i) {
-            if (chown(args[i], uid, gid) < 0) {
-                fprintf(stderr, "%s: chown of %s to %d %d failed: %s\n",
-                        name, args[i], uid, gid, strerror(errno));
-                ++bad;
+            // Leave files that are already right alone; scripts call
+            // this on hundreds of files that mostly are.
+            struct stat st;
+            bool chowned = false;
+            if (stat(args[i], &st) < 0 || st.st_uid != (uid_t)uid ||
+                st.st_gid != (gid_t)gid) {
+                if (chown(args[i], uid, gid) < 0) {
+                    fprintf(stderr, "%s: chown of %s to %d %d failed: %s\n",
+                            name, args[i], uid, gid, strerror(errno));
+                    ++bad;
+                }
+                chowned = true;
             }
-            if (chmod(args[i], mode) < 0) {
-                fprintf(stderr, "%s: chmod of %s to %o failed: %s\n",
-                        name, args[i], mode, strerror(errno));
-                ++bad;
+            if (chowned || (st.st_mode & 07777) != (mode & 07777)) {
+                if (chmod(args[i], mode) < 0) {
+                    fprintf(stderr, "%s: chmod of %s to %o failed: %s\n",
+                            name, args[i], mode, strerror(errno));
+                    ++bad;
+                }
             }
         }
     }
-    result = strdup("");
-
-done:
-    for (i = 0; i < argc; ++i) {
-        free(args[i]);
-    }
-    free(args);
 
     if (bad) {
-        free(result);
         return ErrorAbort(state, "%s: some changes failed", name);
     }
-    return StringValue(result);
+    return SharedStringValue("", 0);
 }
 
-struct perm_parsed_args {
-    bool has_uid;
-    uid_t uid;
-    bool has_gid;
-    gid_t gid;
-    bool has_mode;
-    mode_t mode;
-    bool has_fmode;
-    mode_t fmode;
-    bool has_dmode;
-    mode_t dmode;
-    bool has_selabel;
-    char* selabel;
-    bool has_capabilities;
-    uint64_t capabilities;
-};
-
 static struct perm_parsed_args ParsePermArgs(int argc, char** args) {
     int i;
     struct perm_parsed_args parsed;
@@ -759,118 +758,8 @@ static struct perm_parsed_args ParsePermArgs(int argc, char** args) {
     return parsed;
 }
 
-static int ApplyParsedPerms(
-        const char* filename,
-        const struct stat *statptr,
-        struct perm_parsed_args parsed)
-{
-    int bad = 0;
-
-    /* ignore symlinks */
-    if (S_ISLNK(statptr->st_mode)) {
-        return 0;
-    }
-
-    if (parsed.has_uid) {
-        if (chown(filename, parsed.uid, -1) < 0) {
-            printf("ApplyParsedPerms: chown of %s to %d failed: %s\n",
-                   filename, parsed.uid, strerror(errno));
-            bad++;
-        }
-    }
-
-    if (parsed.has_gid) {
-        if (chown(filename, -1, parsed.gid) < 0) {
-            printf("ApplyParsedPerms: chgrp of %s to %d failed: %s\n",
-                   filename, parsed.gid, strerror(errno));
-            bad++;
-        }
-    }
-
-    if (parsed.has_mode) {
-        if (chmod(filename, parsed.mode) < 0) {
-            printf("ApplyParsedPerms: chmod of %s to %d failed: %s\n",
-                   filename, parsed.mode, strerror(errno));
-            bad++;
-        }
-    }
-
-    if (parsed.has_dmode && S_ISDIR(statptr->st_mode)) {
-        if (chmod(filename, parsed.dmode) < 0) {
-            printf("ApplyParsedPerms: chmod of %s to %d failed: %s\n",
-                   filename, parsed.dmode, strerror(errno));
-            bad++;
-        }
-    }
-
-    if (parsed.has_fmode && S_ISREG(statptr->st_mode)) {
-        if (chmod(filename, parsed.fmode) < 0) {
-            printf("ApplyParsedPerms: chmod of %s to %d failed: %s\n",
-                   filename, parsed.fmode, strerror(errno));
-            bad++;
-        }
-    }
-
-    if (parsed.has_selabel) {
-        // TODO: Don't silently ignore ENOTSUP
-        if (lsetfilecon(filename, parsed.selabel) && (errno != ENOTSUP)) {
-            printf("ApplyParsedPerms: lsetfilecon of %s to %s failed: %s\n",
-                   filename, parsed.selabel, strerror(errno));
-            bad++;
-        }
-    }
-
-    if (parsed.has_capabilities && S_ISREG(statptr->st_mode)) {
-        if (parsed.capabilities == 0) {
-            if ((removexattr(filename, XATTR_NAME_CAPS) == -1) && ((errno != ENODATA)
-#ifdef RECOVERY_CANT_USE_CONFIG_EXT4_FS_XATTR
-                 && (errno != EOPNOTSUPP)
-#endif
-               )) {
-                // Report failure unless it's ENODATA (attribute not set)
-                printf("ApplyParsedPerms: removexattr of %s to %" PRIx64 " failed: %s\n",
-                       filename, parsed.capabilities, strerror(errno));
-                bad++;
-            }
-        } else {
-            struct vfs_cap_data cap_data;
-            memset(&cap_data, 0, sizeof(cap_data));
-            cap_data.magic_etc = VFS_CAP_REVISION | VFS_CAP_FLAGS_EFFECTIVE;
-            cap_data.data[0].permitted = (uint32_t) (parsed.capabilities & 0xffffffff);
-            cap_data.data[0].inheritable = 0;
-            cap_data.data[1].permitted = (uint32_t) (parsed.capabilities >> 32);
-            cap_data.data[1].inheritable = 0;
-            if (setxattr(filename, XATTR_NAME_CAPS, &cap_data, sizeof(cap_data), 0) < 0
-#ifdef RECOVERY_CANT_USE_CONFIG_EXT4_FS_XATTR
-                 && (errno != EOPNOTSUPP)
-#endif
-               ) {
-                printf("ApplyParsedPerms: setcap of %s to %" PRIx64 " failed: %s\n",
-                       filename, parsed.capabilities, strerror(errno));
-                bad++;
-            }
-        }
-    }
-
-    return bad;
-}
-
-// nftw doesn't allow us to pass along context, so we need to use
-// global variables.  *sigh*
-static struct perm_parsed_args recursive_parsed_args;
-
-static int do_SetMetadataRecursive(const char* filename, const struct stat *statptr,
-        int fileflags, struct FTW *pfwt) {
-    return ApplyParsedPerms(filename, statptr, recursive_parsed_args);
-}
-
 static Value* SetMetadataFn(const char* name, State* state, int argc, Expr* argv[]) {
-    int i;
     int bad = 0;
-    static int nwarnings = 0;
-    struct stat sb;
-    Value* result = NULL;
-
     bool recursive = (strcmp(name, "set_metadata_recursive") == 0);
 
     if ((argc % 2) != 1) {
@@ -878,39 +767,80 @@ static Value* SetMetadataFn(const char* name, State* state, int argc, Expr* argv
                           name, argc);
     }
 
-    char** args = ReadVarArgs(state, argc, argv);
+    char** args = ReadArenaArgs(state, argc, argv);
     if (args == NULL) return NULL;
 
-    if (lstat(args[0], &sb) == -1) {
-        result = ErrorAbort(state, "%s: Error on lstat of \"%s\": %s", name, args[0], strerror(errno));
-        goto done;
+    MetadataRule rule;
+    rule.path = args[0];
+    rule.recursive = recursive;
+    rule.perms = ParsePermArgs(argc, args);
+    bad = ApplyMetadataRules(&rule, 1);
+    if (rule.stat_errno != 0) {
+        return ErrorAbort(state, "%s: Error on lstat of \"%s\": %s", name, args[0],
+                          strerror(rule.stat_errno));
     }
 
-    struct perm_parsed_args parsed = ParsePermArgs(argc, args);
-
-    if (recursive) {
-        recursive_parsed_args = parsed;
-        bad += nftw(args[0], do_SetMetadataRecursive, 30, FTW_CHDIR | FTW_DEPTH | FTW_PHYS);
-        memset(&recursive_parsed_args, 0, sizeof(recursive_parsed_args));
-    } else {
-        bad += ApplyParsedPerms(args[0], &sb, parsed);
+    if (bad > 0) {
+        return ErrorAbort(state, "%s: some changes failed", name);
     }
 
-done:
-    for (i = 0; i < argc; ++i) {
-        free(args[i]);
+    return SharedStringValue("", 0);
+}
+
+// set_metadata_batch("path"|"tree", "filename", "key1", "value1", ...,
+//                    "path"|"tree", "filename", ...)
+//
+//   applies any number of set_metadata ("path") and
+//   set_metadata_recursive ("tree") rules in one call, in order.
+static Value* SetMetadataBatchFn(const char* name, State* state, int argc, Expr* argv[]) {
+    if (argc < 2 || (argc % 2) != 0) {
+        return ErrorAbort(state, "%s() expects an even number of arguments, got %d",
+                          name, argc);
     }
-    free(args);
 
-    if (result != NULL) {
-        return result;
+    char** args = ReadArenaArgs(state, argc, argv);
+    if (args == NULL) return NULL;
+
+    MetadataRule* rules = calloc(argc / 2, sizeof(MetadataRule));
+    if (rules == NULL) {
+        return ErrorAbort(state, "%s: failed to alloc %d rules", name, argc / 2);
+    }
+    int count = 0;
+    int i = 0;
+    while (i < argc) {
+        bool recursive = (strcmp(args[i], "tree") == 0);
+        if (!recursive && strcmp(args[i], "path") != 0) {
+            free(rules);
+            return ErrorAbort(state, "%s: expected \"path\" or \"tree\", got \"%s\"",
+                              name, args[i]);
+        }
+        int start = i + 1;
+        for (i += 2; i < argc; i += 2) {
+            if (strcmp(args[i], "path") == 0 || strcmp(args[i], "tree") == 0) break;
+        }
+        // ParsePermArgs wants the filename followed by key/value pairs.
+        rules[count].path = args[start];
+        rules[count].recursive = recursive;
+        rules[count].perms = ParsePermArgs(i - start, args + start);
+        ++count;
+    }
+
+    int bad = ApplyMetadataRules(rules, count);
+    for (i = 0; i < count; ++i) {
+        if (rules[i].stat_errno != 0) {
+            Value* result = ErrorAbort(state, "%s: Error on lstat of \"%s\": %s", name,
+                                       rules[i].path, strerror(rules[i].stat_errno));
+            free(rules);
+            return result;
+        }
     }
+    free(rules);
 
     if (bad > 0) {
         return ErrorAbort(state, "%s: some changes failed", name);
     }
 
-    return StringValue(strdup(""));
+    return SharedStringValue("", 0);
 }
 
 Value* GetPropFn(const char* name, State* state, int argc, Expr* argv[]) {
@@ -1036,7 +966,171 @@ static bool write_raw_image_cb(const unsigned char* data,
     return false;
 }
 
+typedef struct {
+    bool (*write)(const unsigned char* data, int data_len, void* ctx);
+    void* ctx;
+    unsigned long crc;
+} RawImageSink;
+
+// Checksums the data on its way to the real writer, so a streamed
+// image can be checked against the CRC recorded in the package.
+static bool write_raw_image_crc_cb(const unsigned char* data,
+                                   int data_len, void* cookie) {
+    RawImageSink* sink = (RawImageSink*)cookie;
+    sink->crc = crc32(sink->crc, data, data_len);
+    return sink->write(data, data_len, sink->ctx);
+}
+
+static bool write_raw_image_fd_cb(const unsigned char* data,
+                                  int data_len, void* ctx) {
+    int fd = *(int*)ctx;
+    while (data_len > 0) {
+        ssize_t w = TEMP_FAILURE_RETRY(write(fd, data, data_len));
+        if (w <= 0) {
+            fprintf(stderr, "%s\n", strerror(errno));
+            return false;
+        }
+        data += w;
+        data_len -= w;
+    }
+    return true;
+}
+
+// Inflate a package entry straight into a raw partition, without first
+// staging it in /tmp.  MTD goes through mtd_write_data() (which reads
+// back and verifies every block), eMMC is written through the block
+// device.  Anything else falls back to extracting to a temp file and
+// using restore_raw_partition().  Returns 0 on success.
+//
+// There is no staged copy to check before the partition is touched, so
+// the entry's CRC is verified with an extra inflate pass up front.  A
+// failure after that point (write error, or the data changing between
+// the two passes) leaves the partition holding a partial or corrupt
+// image, and is reported as such.
+static int write_raw_image_from_package(const char* name, ZipArchive* za,
+                                        const char* zip_path,
+                                        const char* partition) {
+    const ZipEntry* entry = mzFindZipEntry(za, zip_path);
+    if (entry == NULL) {
+        fprintf(stderr, "%s: no %s in package\n", name, zip_path);
+        return -1;
+    }
+    if (!mzIsZipEntryIntact(za, entry)) {
+        fprintf(stderr, "%s: %s in package is corrupt; not writing %s\n",
+                name, zip_path, partition);
+        return -1;
+    }
+
+    RawImageSink sink;
+    sink.crc = crc32(0L, Z_NULL, 0);
+    bool success = false;
+
+    switch (detect_partition(NULL, partition)) {
+        case MTD: {
+            mtd_scan_partitions();
+            const MtdPartition* mtd = mtd_find_partition_by_name(partition);
+            if (mtd == NULL) {
+                fprintf(stderr, "%s: no mtd partition named \"%s\"\n",
+                        name, partition);
+                return -1;
+            }
+            MtdWriteContext* ctx = mtd_write_partition(mtd);
+            if (ctx == NULL) {
+                fprintf(stderr, "%s: can't write mtd partition \"%s\"\n",
+                        name, partition);
+                return -1;
+            }
+            sink.write = write_raw_image_cb;
+            sink.ctx = ctx;
+            success = mzProcessZipEntryContents(za, entry,
+                                                write_raw_image_crc_cb, &sink);
+            if (mtd_erase_blocks(ctx, -1) == -1) {
+                fprintf(stderr, "%s: error erasing blocks of %s\n",
+                        name, partition);
+            }
+            if (mtd_write_close(ctx) != 0) {
+                fprintf(stderr, "%s: error closing write of %s\n",
+                        name, partition);
+                success = false;
+            }
+            break;
+        }
+
+        case MMC: {
+            char device[PATH_MAX];
+            if (partition[0] == '/') {
+                strlcpy(device, partition, sizeof(device));
+            } else if (cmd_mmc_get_partition_device(partition, device) != 0) {
+                fprintf(stderr, "%s: no emmc partition named \"%s\"\n",
+                        name, partition);
+                return -1;
+            }
+            int fd = open(device, O_WRONLY);
+            if (fd < 0) {
+                fprintf(stderr, "%s: can't open %s for write: %s\n",
+                        name, device, strerror(errno));
+                return -1;
+            }
+            sink.write = write_raw_image_fd_cb;
+            sink.ctx = &fd;
+            success = mzProcessZipEntryContents(za, entry,
+                                                write_raw_image_crc_cb, &sink);
+            if (fsync(fd) != 0 || close(fd) != 0) {
+                fprintf(stderr, "%s: error closing %s: %s\n",
+                        name, device, strerror(errno));
+                success = false;
+            }
+            break;
+        }
+
+        default: {
+            const char* tmp = "/tmp/write_raw_image.img";
+            int fd = creat(tmp, 0600);
+            if (fd < 0) {
+                fprintf(stderr, "%s: can't open %s for write: %s\n",
+                        name, tmp, strerror(errno));
+                return -1;
+            }
+            sink.write = write_raw_image_fd_cb;
+            sink.ctx = &fd;
+            success = mzProcessZipEntryContents(za, entry,
+                                                write_raw_image_crc_cb, &sink);
+            close(fd);
+            if (!success ||
+                sink.crc != (unsigned long)mzGetZipEntryCrc32(entry)) {
+                fprintf(stderr, "%s: failed to extract %s to %s; "
+                        "%s left unchanged\n", name, zip_path, tmp, partition);
+                unlink(tmp);
+                return -1;
+            }
+            success = (restore_raw_partition(NULL, partition, tmp) == 0);
+            unlink(tmp);
+            break;
+        }
+    }
+
+    // Past this point the partition has already been (partly) written.
+    if (!success) {
+        fprintf(stderr, "%s: failed to write %s to %s; "
+                "%s now holds a partial image\n",
+                name, zip_path, partition, partition);
+        return -1;
+    }
+    if (sink.crc != (unsigned long)mzGetZipEntryCrc32(entry)) {
+        fprintf(stderr, "%s: %s written to %s has bad crc (0x%08lx vs 0x%08lx); "
+                "%s now holds corrupt data\n",
+                name, zip_path, partition, sink.crc,
+                (unsigned long)mzGetZipEntryCrc32(entry), partition);
+        return -1;
+    }
+    return 0;
+}
+
 // write_raw_image(filename_or_blob, partition)
+//   or
+// write_raw_image("PACKAGE:<package_path>", partition)
+//   to inflate an entry of the update package directly into the
+//   partition, with no temporary copy.
 Value* WriteRawImageFn(const char* name, State* state, int argc, Expr* argv[]) {
     char* result = NULL;
 
@@ -1061,7 +1155,15 @@ Value* WriteRawImageFn(const char* name, State* state, int argc, Expr* argv[]) {
     }
 
     char* filename = contents->data;
-    if (0 == restore_raw_partition(NULL, partition, filename))
+    int ret;
+    if (contents->type == VAL_STRING &&
+        strncmp(filename, "PACKAGE:", 8) == 0) {
+        ZipArchive* za = ((UpdaterInfo*)(state->cookie))->package_zip;
+        ret = write_raw_image_from_package(name, za, filename + 8, partition);
+    } else {
+        ret = restore_raw_partition(NULL, partition, filename);
+    }
+    if (0 == ret)
         result = strdup(partition);
     else {
         result = strdup("");
@@ -1074,21 +1176,27 @@ done:
     return StringValue(result);
 }
 
-// apply_patch_space(bytes)
+// apply_patch_space(bytes, ...)
 Value* ApplyPatchSpaceFn(const char* name, State* state,
                          int argc, Expr* argv[]) {
-    char* bytes_str;
-    if (ReadArgs(state, argv, 1, &bytes_str) < 0) {
-        return NULL;
+    if (argc < 1) {
+        return ErrorAbort(state, "%s() expects 1+ args, got %d", name, argc);
     }
+    char** args = ReadArenaArgs(state, argc, argv);
+    if (args == NULL) return NULL;
 
-    char* endptr;
-    size_t bytes = strtol(bytes_str, &endptr, 10);
-    if (bytes == 0 && endptr == bytes_str) {
-        ErrorAbort(state, "%s(): can't parse \"%s\" as byte count\n\n",
-                   name, bytes_str);
-        free(bytes_str);
-        return NULL;
+    // Patch sources are staged one at a time in the same file, so
+    // making room for the largest makes room for all of them.
+    size_t bytes = 0;
+    int i;
+    for (i = 0; i < argc; ++i) {
+        char* endptr;
+        size_t b = strtol(args[i], &endptr, 10);
+        if (b == 0 && endptr == args[i]) {
+            return ErrorAbort(state, "%s(): can't parse \"%s\" as byte count\n\n",
+                              name, args[i]);
+        }
+        if (b > bytes) bytes = b;
     }
 
     return StringValue(strdup(CacheSizeCheck(bytes) ? "" : "t"));
@@ -1410,6 +1518,13 @@ void RegisterInstallFunctions() {
     //   set_metadata_recursive("/system", "uid", 0, "gid", 0, "fmode", 0644, "dmode", 0755, "selabel", "u:object_r:system_file:s0", "capabilities", 0x0);
     RegisterFunction("set_metadata_recursive", SetMetadataFn);
 
+    // Usage:
+    //   set_metadata_batch("path"|"tree", "filename", "key1", "value1", ..., "path"|"tree", ...)
+    // Example:
+    //   set_metadata_batch("tree", "/system", "uid", 0, "gid", 0, "fmode", 0644, "dmode", 0755,
+    //                      "path", "/system/bin/netcfg", "gid", 3003, "mode", 02750);
+    RegisterFunction("set_metadata_batch", SetMetadataBatchFn);
+
     RegisterFunction("getprop", GetPropFn);
     RegisterFunction("file_getprop", FileGetPropFn);
     RegisterFunction("write_raw_image", WriteRawImageFn);
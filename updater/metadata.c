@@ -0,0 +1,281 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <selinux/selinux.h>
+#include <sys/capability.h>
+#include <sys/xattr.h>
+#include <linux/xattr.h>
+
+#include "metadata.h"
+
+// The layout getdents64(2) fills in.  We read directories with it
+// directly so that each entry costs no more than the fstatat() we
+// need anyway, and so symlinks can be skipped without a stat at all.
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+#define DIRENT_BUFFER_SIZE 4096
+
+static bool SameCapabilities(const char* path, const struct vfs_cap_data* want) {
+    struct vfs_cap_data current;
+    memset(&current, 0, sizeof(current));
+    ssize_t size = lgetxattr(path, XATTR_NAME_CAPS, &current, sizeof(current));
+    return size == sizeof(current) && memcmp(&current, want, sizeof(current)) == 0;
+}
+
+// Apply 'parsed' to the entry 'name' in the directory 'dirfd', whose
+// full path (for messages, labels and xattrs) is 'path' and whose
+// current attributes are 'st'.  Returns the number of failures.
+static int ApplyParsedPerms(int dirfd, const char* name, const char* path,
+                            const struct stat* st,
+                            const struct perm_parsed_args* parsed)
+{
+    int bad = 0;
+
+    /* ignore symlinks */
+    if (S_ISLNK(st->st_mode)) {
+        return 0;
+    }
+
+    uid_t uid = (parsed->has_uid && st->st_uid != parsed->uid) ? parsed->uid : (uid_t)-1;
+    gid_t gid = (parsed->has_gid && st->st_gid != parsed->gid) ? parsed->gid : (gid_t)-1;
+    bool chowned = false;
+    if (uid != (uid_t)-1 || gid != (gid_t)-1) {
+        if (fchownat(dirfd, name, uid, gid, AT_SYMLINK_NOFOLLOW) < 0) {
+            printf("ApplyParsedPerms: chown of %s to %d %d failed: %s\n",
+                   path, (int)uid, (int)gid, strerror(errno));
+            bad++;
+        } else {
+            chowned = true;
+        }
+    }
+
+    // Later keys win: fmode/dmode override mode for files/directories.
+    bool has_mode = false;
+    mode_t mode = 0;
+    if (parsed->has_mode) {
+        has_mode = true;
+        mode = parsed->mode;
+    }
+    if (parsed->has_dmode && S_ISDIR(st->st_mode)) {
+        has_mode = true;
+        mode = parsed->dmode;
+    }
+    if (parsed->has_fmode && S_ISREG(st->st_mode)) {
+        has_mode = true;
+        mode = parsed->fmode;
+    }
+    // chown clears the setuid and setgid bits, so after one the mode
+    // has to be set again even if it used to match.
+    if (has_mode && (chowned || (st->st_mode & 07777) != (mode & 07777))) {
+        if (fchmodat(dirfd, name, mode, 0) < 0) {
+            printf("ApplyParsedPerms: chmod of %s to %o failed: %s\n",
+                   path, mode, strerror(errno));
+            bad++;
+        }
+    }
+
+    if (parsed->has_selabel) {
+        char* current = NULL;
+        bool same = lgetfilecon(path, &current) > 0 &&
+                    strcmp(current, parsed->selabel) == 0;
+        freecon(current);
+        // TODO: Don't silently ignore ENOTSUP
+        if (!same && lsetfilecon(path, parsed->selabel) && (errno != ENOTSUP)) {
+            printf("ApplyParsedPerms: lsetfilecon of %s to %s failed: %s\n",
+                   path, parsed->selabel, strerror(errno));
+            bad++;
+        }
+    }
+
+    if (parsed->has_capabilities && S_ISREG(st->st_mode)) {
+        if (parsed->capabilities == 0) {
+            if ((removexattr(path, XATTR_NAME_CAPS) == -1) && ((errno != ENODATA)
+#ifdef RECOVERY_CANT_USE_CONFIG_EXT4_FS_XATTR
+                 && (errno != EOPNOTSUPP)
+#endif
+               )) {
+                // Report failure unless it's ENODATA (attribute not set)
+                printf("ApplyParsedPerms: removexattr of %s to %" PRIx64 " failed: %s\n",
+                       path, parsed->capabilities, strerror(errno));
+                bad++;
+            }
+        } else {
+            struct vfs_cap_data cap_data;
+            memset(&cap_data, 0, sizeof(cap_data));
+            cap_data.magic_etc = VFS_CAP_REVISION | VFS_CAP_FLAGS_EFFECTIVE;
+            cap_data.data[0].permitted = (uint32_t) (parsed->capabilities & 0xffffffff);
+            cap_data.data[0].inheritable = 0;
+            cap_data.data[1].permitted = (uint32_t) (parsed->capabilities >> 32);
+            cap_data.data[1].inheritable = 0;
+            if (!SameCapabilities(path, &cap_data) &&
+                setxattr(path, XATTR_NAME_CAPS, &cap_data, sizeof(cap_data), 0) < 0
+#ifdef RECOVERY_CANT_USE_CONFIG_EXT4_FS_XATTR
+                 && (errno != EOPNOTSUPP)
+#endif
+               ) {
+                printf("ApplyParsedPerms: setcap of %s to %" PRIx64 " failed: %s\n",
+                       path, parsed->capabilities, strerror(errno));
+                bad++;
+            }
+        }
+    }
+
+    return bad;
+}
+
+// Apply 'parsed' to everything under the directory entry 'name' in
+// 'dirfd' and then to the entry itself (children first, like nftw()
+// with FTW_DEPTH).  'path' holds the entry's full path in a PATH_MAX
+// buffer, 'len' bytes long; it's extended in place for children.
+static int WalkTree(int dirfd, const char* name, char* path, size_t len,
+                    const struct stat* st, const struct perm_parsed_args* parsed)
+{
+    int bad = 0;
+
+    if (S_ISDIR(st->st_mode)) {
+        int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0) {
+            printf("ApplyParsedPerms: can't open %s: %s\n", path, strerror(errno));
+            bad++;
+        } else {
+            char buffer[DIRENT_BUFFER_SIZE];
+            long count;
+            while ((count = syscall(__NR_getdents64, fd, buffer, sizeof(buffer))) > 0) {
+                long offset;
+                for (offset = 0; offset < count; ) {
+                    struct linux_dirent64* de = (struct linux_dirent64*)(buffer + offset);
+                    offset += de->d_reclen;
+
+                    if (de->d_type == DT_LNK ||
+                        strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+                        continue;
+                    }
+
+                    size_t name_len = strlen(de->d_name);
+                    if (len + 1 + name_len >= PATH_MAX) {
+                        printf("ApplyParsedPerms: path too long: %s/%s\n", path, de->d_name);
+                        bad++;
+                        continue;
+                    }
+                    path[len] = '/';
+                    memcpy(path + len + 1, de->d_name, name_len + 1);
+
+                    struct stat child;
+                    if (fstatat(fd, de->d_name, &child, AT_SYMLINK_NOFOLLOW) < 0) {
+                        printf("ApplyParsedPerms: can't stat %s: %s\n", path, strerror(errno));
+                        bad++;
+                    } else {
+                        bad += WalkTree(fd, de->d_name, path, len + 1 + name_len,
+                                        &child, parsed);
+                    }
+                    path[len] = '\0';
+                }
+            }
+            if (count < 0) {
+                printf("ApplyParsedPerms: can't read %s: %s\n", path, strerror(errno));
+                bad++;
+            }
+            close(fd);
+        }
+    }
+
+    return bad + ApplyParsedPerms(dirfd, name, path, st, parsed);
+}
+
+int ApplyMetadataRules(MetadataRule* rules, int count) {
+    int bad = 0;
+    char path[PATH_MAX];
+    char parent[PATH_MAX];
+    int parent_fd = -1;
+    int i;
+
+    parent[0] = '\0';
+    for (i = 0; i < count; ++i) {
+        MetadataRule* rule = rules + i;
+        rule->stat_errno = 0;
+
+        size_t len = strlen(rule->path);
+        if (len == 0 || len >= PATH_MAX) {
+            rule->stat_errno = len ? ENAMETOOLONG : ENOENT;
+            continue;
+        }
+        memcpy(path, rule->path, len + 1);
+        while (len > 1 && path[len-1] == '/') {
+            path[--len] = '\0';
+        }
+
+        // Split into the directory to open and the name within it.
+        char dir[PATH_MAX];
+        const char* name;
+        char* slash = strrchr(path, '/');
+        if (slash == NULL) {
+            strcpy(dir, ".");
+            name = path;
+        } else if (slash[1] == '\0') {
+            strcpy(dir, "/");
+            name = ".";
+        } else {
+            size_t dir_len = slash == path ? 1 : (size_t)(slash - path);
+            memcpy(dir, path, dir_len);
+            dir[dir_len] = '\0';
+            name = slash + 1;
+        }
+
+        if (parent_fd < 0 || strcmp(dir, parent) != 0) {
+            if (parent_fd >= 0) close(parent_fd);
+            parent_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (parent_fd < 0) {
+                rule->stat_errno = errno;
+                parent[0] = '\0';
+                continue;
+            }
+            strcpy(parent, dir);
+        }
+
+        struct stat st;
+        if (fstatat(parent_fd, name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+            rule->stat_errno = errno;
+            continue;
+        }
+
+        if (rule->recursive) {
+            bad += WalkTree(parent_fd, name, path, len, &st, &rule->perms);
+        } else {
+            bad += ApplyParsedPerms(parent_fd, name, path, &st, &rule->perms);
+        }
+    }
+
+    if (parent_fd >= 0) close(parent_fd);
+    return bad;
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _UPDATER_METADATA_H_
+#define _UPDATER_METADATA_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct perm_parsed_args {
+    bool has_uid;
+    uid_t uid;
+    bool has_gid;
+    gid_t gid;
+    bool has_mode;
+    mode_t mode;
+    bool has_fmode;
+    mode_t fmode;
+    bool has_dmode;
+    mode_t dmode;
+    bool has_selabel;
+    char* selabel;
+    bool has_capabilities;
+    uint64_t capabilities;
+};
+
+// One path to apply metadata to.  'mode' applies to everything;
+// 'dmode' and 'fmode', when present, override it for directories and
+// regular files.  Symlinks are never changed.
+typedef struct {
+    const char* path;
+    bool recursive;
+    struct perm_parsed_args perms;
+
+    // Set to the errno of the failed lstat when 'path' doesn't exist
+    // (in which case nothing else is done for this rule), else 0.
+    int stat_errno;
+} MetadataRule;
+
+// Apply each rule in order.  Trees are walked once with directory
+// fds, and ownership, modes, labels and capabilities that already
+// have the requested values are left alone.  Consecutive rules for
+// paths in the same directory share one open of that directory.
+// Returns the number of changes that failed.
+int ApplyMetadataRules(MetadataRule* rules, int count);
+
+#endif
@@ -14,6 +14,8 @@
  * limitations under the License.
  */
 
+#include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -21,6 +23,7 @@
 #include "edify/expr.h"
 #include "updater.h"
 #include "install.h"
+#include "minzip/LabelCache.h"
 #include "minzip/Zip.h"
 
 // Generated by the makefile, this function defines the
@@ -32,6 +35,14 @@
 // (Note it's "updateR-script", not the older "update-script".)
 #define SCRIPT_NAME "META-INF/com/google/android/updater-script"
 
+// Optional precompiled form of the script, made with "edify -c".  It is
+// used instead of parsing the script if it was compiled from the same
+// source and only calls functions this binary has.
+#define COMPILED_SCRIPT_NAME "META-INF/com/google/android/updater-script.bin"
+
+// The file contexts used to label what the script creates.
+#define FILE_CONTEXTS "/file_contexts"
+
 struct selabel_handle *sehandle;
 
 int main(int argc, char** argv) {
@@ -64,10 +75,30 @@ int main(int argc, char** argv) {
 
     // Extract the script from the package.
 
+    // Newer recoveries pass the central directory they already parsed;
+    // opening with it falls back to a normal parse if it doesn't match.
+
     char* package_data = argv[3];
     ZipArchive za;
     int err;
-    err = mzOpenZipArchive(package_data, &za);
+    const char* index_fd_str = getenv("UPDATE_PACKAGE_INDEX_FD");
+    if (index_fd_str != NULL) {
+        // Only trust a well-formed descriptor above stdio that is
+        // actually open; anything else gets a normal parse.
+        char* end;
+        long index_fd = strtol(index_fd_str, &end, 10);
+        if (end == index_fd_str || *end != '\0' || index_fd <= 2 ||
+            index_fd > INT_MAX || fcntl((int) index_fd, F_GETFD) < 0) {
+            fprintf(stderr, "ignoring bad UPDATE_PACKAGE_INDEX_FD \"%s\"\n",
+                    index_fd_str);
+            err = mzOpenZipArchive(package_data, &za);
+        } else {
+            err = mzOpenZipArchiveWithIndex(package_data, (int) index_fd, &za);
+            close((int) index_fd);
+        }
+    } else {
+        err = mzOpenZipArchive(package_data, &za);
+    }
     if (err != 0) {
         fprintf(stderr, "failed to open package %s: %s\n",
                 package_data, strerror(err));
@@ -94,19 +125,39 @@ int main(int argc, char** argv) {
     RegisterDeviceExtensions();
     FinishRegistration();
 
-    // Parse the script.
+    // Load the compiled script, if there is one; otherwise parse the
+    // script.
+
+    Expr* root = NULL;
+    unsigned char* compiled = NULL;
+    const ZipEntry* compiled_entry = mzFindZipEntry(&za, COMPILED_SCRIPT_NAME);
+    if (compiled_entry != NULL) {
+        compiled = malloc(compiled_entry->uncompLen);
+        if (compiled != NULL &&
+            mzReadZipEntry(&za, compiled_entry, (char*)compiled,
+                           compiled_entry->uncompLen)) {
+            root = LoadCompiledExpr(compiled, compiled_entry->uncompLen, script);
+        }
+        if (root == NULL) {
+            fprintf(stderr, "ignoring unusable %s\n", COMPILED_SCRIPT_NAME);
+            free(compiled);
+            compiled = NULL;
+        }
+    }
 
-    Expr* root;
-    int error_count = 0;
-    yy_scan_string(script);
-    int error = yyparse(&root, &error_count);
-    if (error != 0 || error_count > 0) {
-        fprintf(stderr, "%d parse errors\n", error_count);
-        return 6;
+    if (root == NULL) {
+        int error_count = 0;
+        yy_scan_string(script);
+        int error = yyparse(&root, &error_count);
+        if (error != 0 || error_count > 0) {
+            fprintf(stderr, "%d parse errors\n", error_count);
+            return 6;
+        }
+        root = OptimizeExpr(root);
     }
 
     struct selinux_opt seopts[] = {
-      { SELABEL_OPT_PATH, "/file_contexts" }
+      { SELABEL_OPT_PATH, FILE_CONTEXTS }
     };
 
     sehandle = selabel_open(SELABEL_CTX_FILE, seopts, 1);
@@ -114,6 +165,10 @@ int main(int argc, char** argv) {
     if (!sehandle) {
         fprintf(stderr, "Warning:  No file_contexts\n");
         // fprintf(cmd_pipe, "ui_print Warning: No file_contexts\n");
+    } else {
+        // Let extraction reuse one lookup per directory where the
+        // specs allow it.
+        labelCacheInit(sehandle, FILE_CONTEXTS);
     }
 
     // Evaluate the parsed script.
@@ -129,6 +184,14 @@ int main(int argc, char** argv) {
     state.errmsg = NULL;
 
     char* result = Evaluate(&state, root);
+
+    unsigned int label_hits, label_misses;
+    labelCacheStats(&label_hits, &label_misses);
+    if (label_hits + label_misses > 0) {
+        fprintf(stderr, "selabel cache: %u hits, %u misses\n",
+                label_hits, label_misses);
+    }
+
     if (result == NULL) {
         if (state.errmsg == NULL) {
             fprintf(stderr, "script aborted (no error message)\n");
@@ -152,6 +215,7 @@ int main(int argc, char** argv) {
     if (updater_info.package_zip) {
         mzCloseZipArchive(updater_info.package_zip);
     }
+    free(compiled);
     free(script);
 
     return 0;